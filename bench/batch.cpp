@@ -0,0 +1,79 @@
+// Copyright 2017 Elias Kosunen
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "bench.h"
+#include "native.h"
+
+#include <vector>
+
+// Columnar calls: one native call per row of a set of argument columns
+static const size_t batch_rows = 1024;
+
+/**
+ * Time f, which handles batch_rows rows per invocation, and report the
+ * result per row
+ */
+template <typename F>
+static void measure_rows(bench::context& ctx, const char* path, F&& f)
+{
+    std::vector<bench::result> results;
+    bench::context batches(ctx.iterations() / batch_rows + 1, results);
+    batches.measure("batch", "int32(int32,int32,int32)", path,
+                    std::forward<F>(f));
+
+    auto r = results.back();
+    r.iterations *= batch_rows;
+    r.ns_per_call /= static_cast<double>(batch_rows);
+    r.allocs_per_call /= static_cast<double>(batch_rows);
+    ctx.add(r);
+}
+
+CPPFFI_BENCHMARK("batch/ints")
+{
+    std::vector<int32_t> a(batch_rows), b(batch_rows), c(batch_rows);
+    for (size_t i = 0; i < batch_rows; ++i) {
+        a[i] = static_cast<int32_t>(i);
+        b[i] = static_cast<int32_t>(i * 2);
+        c[i] = static_cast<int32_t>(i * 3);
+    }
+    std::vector<int32_t> out(batch_rows);
+
+    ffi::cif<int32_t(int32_t, int32_t, int32_t)> interface;
+    auto bound = interface.bind(native::ints);
+
+    measure_rows(ctx, "callable()", [&] {
+        for (size_t i = 0; i < batch_rows; ++i) {
+            out[i] = bound(a[i], b[i], c[i]);
+        }
+        bench::do_not_optimize(out.back());
+    });
+
+    measure_rows(ctx, "callable::call_batch", [&] {
+        bound.call_batch(out, a, b, c);
+        bench::do_not_optimize(out.back());
+    });
+
+    auto& pool = ffi::thread_pool::global();
+    measure_rows(ctx, "callable::call_batch(pool)", [&] {
+        bound.call_batch(pool, out, a, b, c);
+        bench::do_not_optimize(out.back());
+    });
+    ctx.annotate("threads", static_cast<double>(pool.size() + 1));
+}
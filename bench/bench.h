@@ -0,0 +1,154 @@
+// Copyright 2017 Elias Kosunen
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef CPPFFI_BENCH_H
+#define CPPFFI_BENCH_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace bench {
+    /**
+     * Number of heap allocations made by the process so far.
+     * Counted by the replacement operator new in main.cpp
+     */
+    uint64_t allocations();
+
+    struct result {
+        std::string group;
+        std::string signature;
+        std::string path;
+        uint64_t iterations;
+        double ns_per_call;
+        double allocs_per_call;
+
+        /// Additional named measurements, e.g. memory use
+        std::vector<std::pair<std::string, double>> extra;
+    };
+
+    /**
+     * Resident set size of the process in KiB, or 0 where unavailable
+     */
+    double resident_kib();
+
+    class context {
+    public:
+        context(uint64_t p_iterations, std::vector<result>& p_results)
+            : m_iterations(p_iterations), m_results(p_results)
+        {
+        }
+
+        uint64_t iterations() const
+        {
+            return m_iterations;
+        }
+
+        void add(result r)
+        {
+            m_results.push_back(std::move(r));
+        }
+
+        /// Attach a named measurement to the most recent result
+        void annotate(const std::string& name, double value)
+        {
+            m_results.back().extra.emplace_back(name, value);
+        }
+
+        /**
+         * Time `iterations()` invocations of f.
+         * \param group     Benchmark group, e.g. "call"
+         * \param signature Human-readable signature of the measured call
+         * \param path      Which call path is being measured
+         * \param f         Callable doing one call per invocation
+         */
+        template <typename F>
+        void measure(const std::string& group,
+                     const std::string& signature,
+                     const std::string& path,
+                     F&& f)
+        {
+            using clock = std::chrono::steady_clock;
+
+            const auto warmup = m_iterations / 10 + 1;
+            for (uint64_t i = 0; i < warmup; ++i) {
+                f();
+            }
+
+            const auto allocs_before = allocations();
+            const auto start = clock::now();
+            for (uint64_t i = 0; i < m_iterations; ++i) {
+                f();
+            }
+            const auto end = clock::now();
+            const auto allocs_after = allocations();
+
+            using std::chrono::duration_cast;
+            using std::chrono::nanoseconds;
+            const auto ns = duration_cast<nanoseconds>(end - start).count();
+            const auto n = static_cast<double>(m_iterations);
+            add({group, signature, path, m_iterations,
+                 static_cast<double>(ns) / n,
+                 static_cast<double>(allocs_after - allocs_before) / n,
+                 {}});
+        }
+
+    private:
+        uint64_t m_iterations;
+        std::vector<result>& m_results;
+    };
+
+    using benchmark_fn = void (*)(context&);
+
+    struct registrar {
+        registrar(const char* name, benchmark_fn fn);
+    };
+
+    /**
+     * Keep the compiler from optimizing away a computed value
+     */
+    template <typename T>
+    inline void do_not_optimize(const T& value)
+    {
+#if defined(__GNUC__) || defined(__clang__)
+        asm volatile("" : : "g"(&value) : "memory");
+#else
+        static volatile const void* sink;
+        sink = &value;
+#endif
+    }
+}  // namespace bench
+
+#define CPPFFI_BENCH_CAT2(a, b) a##b
+#define CPPFFI_BENCH_CAT(a, b) CPPFFI_BENCH_CAT2(a, b)
+
+/**
+ * Define and register a benchmark function taking a bench::context&
+ */
+#define CPPFFI_BENCHMARK(name)                                            \
+    static void CPPFFI_BENCH_CAT(bench_fn_, __LINE__)(bench::context&);   \
+    static const bench::registrar CPPFFI_BENCH_CAT(bench_reg_, __LINE__)( \
+        name, &CPPFFI_BENCH_CAT(bench_fn_, __LINE__));                    \
+    static void CPPFFI_BENCH_CAT(bench_fn_, __LINE__)(bench::context & ctx)
+
+#endif
@@ -0,0 +1,163 @@
+// Copyright 2017 Elias Kosunen
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "bench.h"
+#include "native.h"
+
+#include <array>
+#include <tuple>
+
+namespace {
+    template <size_t... I>
+    struct indices {
+    };
+    template <size_t N, size_t... I>
+    struct make_indices : make_indices<N - 1, N - 1, I...> {
+    };
+    template <size_t... I>
+    struct make_indices<0, I...> {
+        using type = indices<I...>;
+    };
+
+    /**
+     * Measures one native function through every call path, always with the
+     * same argument values
+     */
+    template <typename ReturnT, typename... ArgsT>
+    class call_paths {
+    public:
+        using function_type = ReturnT(ArgsT...);
+        using index_type = typename make_indices<sizeof...(ArgsT)>::type;
+
+        call_paths(bench::context& ctx,
+                   const char* signature,
+                   function_type& fn,
+                   ArgsT... args)
+            : m_ctx(ctx), m_signature(signature), m_fn(fn), m_args(args...)
+        {
+        }
+
+        void run()
+        {
+            _run(index_type{});
+        }
+
+    private:
+        template <size_t... I>
+        void _run(indices<I...>)
+        {
+            const auto& args = m_args;
+
+            function_type* volatile direct = &m_fn;
+            m_ctx.measure("call", m_signature, "direct", [&] {
+                bench::do_not_optimize(direct(std::get<I>(args)...));
+            });
+
+            m_ctx.measure("call", m_signature, "ffi::call", [&] {
+                bench::do_not_optimize(
+                    ffi::call(m_fn, ArgsT(std::get<I>(args))...));
+            });
+
+            ffi::cif<function_type> c;
+            auto bound = c.bind(m_fn);
+            m_ctx.measure("call", m_signature, "cif::bind()()", [&] {
+                bench::do_not_optimize(bound(ArgsT(std::get<I>(args))...));
+            });
+
+            m_ctx.measure("call", m_signature, "callable::call().ret()", [&] {
+                bench::do_not_optimize(
+                    bound.call(ArgsT(std::get<I>(args))...).ret());
+            });
+
+            m_ctx.measure("call", m_signature, "callable::direct()", [&] {
+                bench::do_not_optimize(bound.direct(std::get<I>(args)...));
+            });
+
+            m_ctx.measure("call", m_signature, "callable::call_raw()", [&] {
+                bench::do_not_optimize(bound.call_raw(std::get<I>(args)...));
+            });
+
+            ffi_cif raw;
+            std::array<ffi_type*, sizeof...(ArgsT)> types{
+                {&ffi::type<ArgsT>::ffitype()...}};
+            ffi_prep_cif(&raw, FFI_DEFAULT_ABI, sizeof...(ArgsT),
+                         &ffi::type<ReturnT>::ffitype(), types.data());
+            m_ctx.measure("call", m_signature, "ffi_call", [&] {
+                std::array<void*, sizeof...(ArgsT)> ptrs{{const_cast<void*>(
+                    static_cast<const void*>(&std::get<I>(args)))...}};
+                typename ffi::type<ReturnT>::arg_type ret;
+                ffi_call(&raw, CPPFFI_FN(&m_fn), &ret, ptrs.data());
+                bench::do_not_optimize(ret);
+            });
+        }
+
+        bench::context& m_ctx;
+        const char* m_signature;
+        function_type& m_fn;
+        std::tuple<ArgsT...> m_args;
+    };
+
+    template <typename ReturnT, typename... ArgsT>
+    void run_paths(bench::context& ctx,
+                   const char* signature,
+                   ReturnT (&fn)(ArgsT...),
+                   ArgsT... args)
+    {
+        call_paths<ReturnT, ArgsT...>(ctx, signature, fn, args...).run();
+    }
+}  // namespace
+
+CPPFFI_BENCHMARK("call/nullary")
+{
+    run_paths(ctx, "int32(void)", native::nullary);
+}
+
+CPPFFI_BENCHMARK("call/ints")
+{
+    run_paths(ctx, "int32(int32,int32,int32)", native::ints, 1, 2, 3);
+}
+
+CPPFFI_BENCHMARK("call/floats")
+{
+    run_paths(ctx, "double(float,double,float,double)", native::floats, 1.5f,
+              2.5, 3.5f, 4.5);
+}
+
+CPPFFI_BENCHMARK("call/pointers")
+{
+    static int32_t dst = 0, src = 42;
+    run_paths(ctx, "int32*(int32*,const int32*)", native::pointers, &dst,
+              static_cast<const int32_t*>(&src));
+}
+
+CPPFFI_BENCHMARK("call/many")
+{
+    run_paths(ctx,
+              "int64(int64,int64,int64,int64,int64,int64,"
+              "double,double,double,double,int32,int32)",
+              native::many, int64_t{1}, int64_t{2}, int64_t{3}, int64_t{4},
+              int64_t{5}, int64_t{6}, 7.0, 8.0, 9.0, 10.0, 11, 12);
+}
+
+CPPFFI_BENCHMARK("call/struct")
+{
+    run_paths(ctx, "double(vec3)", native::length_squared,
+              native::vec3{1.0, 2.0, 3.0});
+}
@@ -0,0 +1,113 @@
+// Copyright 2017 Elias Kosunen
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "bench.h"
+
+#include <cppffi.h>
+#include <vector>
+
+// Short-lived callbacks: a window of live closures, where every iteration
+// destroys the oldest one and creates a new one
+static const size_t live_window = 1024;
+
+CPPFFI_BENCHMARK("closure/trampoline")
+{
+    std::vector<void*> live(live_window, nullptr);
+    size_t next = 0;
+    ctx.measure("closure", "trampoline", "ffi_closure_alloc", [&] {
+        if (live[next]) {
+            ffi_closure_free(live[next]);
+        }
+        void* code = nullptr;
+        live[next] = ffi_closure_alloc(sizeof(ffi_closure), &code);
+        bench::do_not_optimize(code);
+        next = (next + 1) % live_window;
+    });
+    ctx.annotate("rss_kib", bench::resident_kib());
+    for (auto p : live) {
+        if (p) {
+            ffi_closure_free(p);
+        }
+    }
+
+    ffi::closure_pool pool;
+    std::vector<std::pair<ffi_closure*, void*>> pooled(
+        live_window, std::pair<ffi_closure*, void*>(nullptr, nullptr));
+    next = 0;
+    ctx.measure("closure", "trampoline", "closure_pool", [&] {
+        auto& slot = pooled[next];
+        if (slot.first) {
+            pool.release(slot.first, slot.second);
+        }
+        slot.first = pool.acquire(slot.second);
+        bench::do_not_optimize(slot.second);
+        next = (next + 1) % live_window;
+    });
+    ctx.annotate("rss_kib", bench::resident_kib());
+    ctx.annotate("trampolines", static_cast<double>(pool.allocated()));
+    for (auto& slot : pooled) {
+        if (slot.first) {
+            pool.release(slot.first, slot.second);
+        }
+    }
+}
+
+CPPFFI_BENCHMARK("closure/object")
+{
+    using closure_type = ffi::closure<int32_t(int32_t)>;
+    int32_t offset = 1;
+    auto fn = [&offset](int32_t v) { return v + offset; };
+
+    {
+        std::vector<closure_type> live;
+        live.reserve(live_window);
+        size_t next = 0;
+        ctx.measure("closure", "int32(int32)", "closure", [&] {
+            if (live.size() < live_window) {
+                live.emplace_back(fn);
+            }
+            else {
+                live[next] = closure_type(fn);
+            }
+            bench::do_not_optimize(live[next].get());
+            next = (next + 1) % live_window;
+        });
+        ctx.annotate("rss_kib", bench::resident_kib());
+    }
+
+    {
+        auto& pool = ffi::closure_pool::local();
+        std::vector<closure_type> live;
+        live.reserve(live_window);
+        size_t next = 0;
+        ctx.measure("closure", "int32(int32)", "closure+pool", [&] {
+            if (live.size() < live_window) {
+                live.emplace_back(fn, pool);
+            }
+            else {
+                live[next] = closure_type(fn, pool);
+            }
+            bench::do_not_optimize(live[next].get());
+            next = (next + 1) % live_window;
+        });
+        ctx.annotate("rss_kib", bench::resident_kib());
+        ctx.annotate("trampolines", static_cast<double>(pool.allocated()));
+    }
+}
@@ -0,0 +1,96 @@
+// Copyright 2017 Elias Kosunen
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "bench.h"
+#include "native.h"
+
+#include <array>
+#include <cppffi.h>
+#include <cppffi_dispatch.h>
+#include <cppffi_dynamic.h>
+
+// Runtime signatures: the precompiled thunk against ffi_call on the same
+// prepared interface
+template <typename ReturnT, typename FunctionT, typename... ArgsT>
+static void run_dynamic(bench::context& ctx,
+                        const char* signature,
+                        FunctionT* fn,
+                        ArgsT... args)
+{
+    ffi::dynamic_cif c(ffi::type<ReturnT>::ffitype(),
+                       {&ffi::type<ArgsT>::ffitype()...});
+    const auto bound = c.bind(fn);
+    std::array<void*, sizeof...(ArgsT)> ptrs{
+        {static_cast<void*>(&args)...}};
+    ffi_arg ret;
+
+    ctx.measure("dynamic", signature,
+                c.has_thunk() ? "dynamic_callable (thunk)"
+                              : "dynamic_callable",
+                [&] {
+                    bound.call(&ret, ptrs.data());
+                    bench::do_not_optimize(ret);
+                });
+
+    ctx.measure("dynamic", signature, "dynamic_callable::invoke()", [&] {
+        bench::do_not_optimize(bound.template invoke<ReturnT>(args...));
+    });
+
+    // Frames carved from an arena, as frames too big to live inline are
+    ffi::frame_arena arena;
+    ctx.measure("dynamic", signature, "dynamic_frame (arena)", [&] {
+        ffi::dynamic_frame frame(c, arena);
+        size_t i = 0;
+        using expand = int[];
+        (void)expand{0, (frame.set(i++, args), 0)...};
+        bound.call(frame);
+        bench::do_not_optimize(frame.template ret<ReturnT>());
+    });
+
+    // The same call through an entry of a dispatch table
+    ffi::dispatch_table table;
+    const auto id = table.add(c, fn);
+    ctx.measure("dynamic", signature, "dispatch_table::call()", [&] {
+        table.call(id, &ret, ptrs.data());
+        bench::do_not_optimize(ret);
+    });
+
+    auto& raw = const_cast<ffi_cif&>(c.native());
+    ctx.measure("dynamic", signature, "ffi_call", [&] {
+        ffi_call(&raw, CPPFFI_FN(fn), &ret, ptrs.data());
+        bench::do_not_optimize(ret);
+    });
+}
+
+CPPFFI_BENCHMARK("dynamic/ints64")
+{
+    run_dynamic<int64_t>(ctx, "l(lll)", native::ints64, int64_t{1},
+                         int64_t{2}, int64_t{3});
+}
+
+CPPFFI_BENCHMARK("dynamic/doubles")
+{
+    run_dynamic<double>(ctx, "d(ddd)", native::lerp, 1.0, 2.0, 0.5);
+}
+
+CPPFFI_BENCHMARK("dynamic/ints")
+{
+    run_dynamic<int32_t>(ctx, "i(iii)", native::ints, 1, 2, 3);
+}
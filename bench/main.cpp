@@ -0,0 +1,173 @@
+// Copyright 2017 Elias Kosunen
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "bench.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+#if defined(__linux__)
+#include <unistd.h>
+#endif
+
+// Every heap allocation in the process goes through here, so the call paths
+// can be checked for hidden allocations
+static std::atomic<uint64_t> g_allocations{0};
+
+void* operator new(std::size_t size)
+{
+    g_allocations.fetch_add(1, std::memory_order_relaxed);
+    if (auto p = std::malloc(size ? size : 1)) {
+        return p;
+    }
+    throw std::bad_alloc{};
+}
+void* operator new[](std::size_t size)
+{
+    return ::operator new(size);
+}
+void operator delete(void* p) noexcept
+{
+    std::free(p);
+}
+void operator delete[](void* p) noexcept
+{
+    std::free(p);
+}
+#if defined(__cpp_sized_deallocation)
+void operator delete(void* p, std::size_t) noexcept
+{
+    std::free(p);
+}
+void operator delete[](void* p, std::size_t) noexcept
+{
+    std::free(p);
+}
+#endif
+
+namespace bench {
+    uint64_t allocations()
+    {
+        return g_allocations.load(std::memory_order_relaxed);
+    }
+
+    namespace {
+        struct entry {
+            const char* name;
+            benchmark_fn fn;
+        };
+
+        std::vector<entry>& registry()
+        {
+            static std::vector<entry> r;
+            return r;
+        }
+
+        void print_string(const std::string& str)
+        {
+            std::putchar('"');
+            for (auto ch : str) {
+                if (ch == '"' || ch == '\\') {
+                    std::putchar('\\');
+                }
+                std::putchar(ch);
+            }
+            std::putchar('"');
+        }
+
+        // One JSON object per line, so results can be appended to a log and
+        // diffed across releases
+        void print_result(const result& r)
+        {
+            std::printf("{\"group\":");
+            print_string(r.group);
+            std::printf(",\"signature\":");
+            print_string(r.signature);
+            std::printf(",\"path\":");
+            print_string(r.path);
+            std::printf(
+                ",\"iterations\":%llu,\"ns_per_call\":%.3f,"
+                "\"allocs_per_call\":%.3f",
+                static_cast<unsigned long long>(r.iterations), r.ns_per_call,
+                r.allocs_per_call);
+            for (const auto& e : r.extra) {
+                std::putchar(',');
+                print_string(e.first);
+                std::printf(":%.3f", e.second);
+            }
+            std::printf("}\n");
+        }
+    }  // namespace
+
+    double resident_kib()
+    {
+#if defined(__linux__)
+        // Second field of statm is the resident page count
+        if (auto f = std::fopen("/proc/self/statm", "r")) {
+            unsigned long size = 0, resident = 0;
+            const auto n = std::fscanf(f, "%lu %lu", &size, &resident);
+            std::fclose(f);
+            if (n == 2) {
+                return static_cast<double>(resident) *
+                       static_cast<double>(sysconf(_SC_PAGESIZE)) / 1024.0;
+            }
+        }
+#endif
+        return 0.0;
+    }
+
+    registrar::registrar(const char* name, benchmark_fn fn)
+    {
+        registry().push_back({name, fn});
+    }
+}  // namespace bench
+
+int main(int argc, char** argv)
+{
+    uint64_t iterations = 1000000;
+    const char* filter = nullptr;
+    if (argc > 1) {
+        iterations = std::strtoull(argv[1], nullptr, 10);
+    }
+    if (argc > 2) {
+        filter = argv[2];
+    }
+    if (iterations == 0) {
+        std::fprintf(stderr, "usage: %s [iterations] [filter]\n", argv[0]);
+        return 1;
+    }
+
+    std::vector<bench::result> results;
+    bench::context ctx(iterations, results);
+    for (const auto& e : bench::registry()) {
+        if (filter && !std::strstr(e.name, filter)) {
+            continue;
+        }
+        e.fn(ctx);
+        for (const auto& r : results) {
+            bench::print_result(r);
+        }
+        results.clear();
+        std::fflush(stdout);
+    }
+    return 0;
+}
@@ -0,0 +1,90 @@
+// Copyright 2017 Elias Kosunen
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "native.h"
+
+#include <cstdarg>
+
+namespace native {
+    int32_t nullary()
+    {
+        return 42;
+    }
+
+    int32_t ints(int32_t a, int32_t b, int32_t c)
+    {
+        return a + b * c;
+    }
+
+    double floats(float a, double b, float c, double d)
+    {
+        return static_cast<double>(a) * b + static_cast<double>(c) * d;
+    }
+
+    int32_t* pointers(int32_t* dst, const int32_t* src)
+    {
+        *dst = *src;
+        return dst;
+    }
+
+    int64_t many(int64_t a,
+                 int64_t b,
+                 int64_t c,
+                 int64_t d,
+                 int64_t e,
+                 int64_t f,
+                 double g,
+                 double h,
+                 double i,
+                 double j,
+                 int32_t k,
+                 int32_t l)
+    {
+        return a + b + c + d + e + f + static_cast<int64_t>(g + h + i + j) +
+               k + l;
+    }
+
+    double length_squared(vec3 v)
+    {
+        return v.x * v.x + v.y * v.y + v.z * v.z;
+    }
+
+    int64_t ints64(int64_t a, int64_t b, int64_t c)
+    {
+        return a + b * c;
+    }
+
+    double lerp(double a, double b, double t)
+    {
+        return a + (b - a) * t;
+    }
+
+    int64_t sum_var(int32_t count, ...)
+    {
+        va_list list;
+        va_start(list, count);
+        int64_t sum = 0;
+        for (int32_t i = 0; i < count; ++i) {
+            sum += va_arg(list, int64_t);
+        }
+        va_end(list);
+        return sum;
+    }
+}  // namespace native
@@ -0,0 +1,64 @@
+// Copyright 2017 Elias Kosunen
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef CPPFFI_BENCH_NATIVE_H
+#define CPPFFI_BENCH_NATIVE_H
+
+#include <cppffi.h>
+#include <cstdint>
+
+// Native functions called by the benchmarks.
+// They live in their own translation unit so the direct calls can't be
+// inlined away.
+namespace native {
+    struct vec3 {
+        double x, y, z;
+
+        static ffi_type& create_ffitype()
+        {
+            return ffi::struct_type<vec3, CPPFFI_FIELD(vec3, x),
+                                    CPPFFI_FIELD(vec3, y),
+                                    CPPFFI_FIELD(vec3, z)>::create_ffitype();
+        }
+    };
+
+    int32_t nullary();
+    int32_t ints(int32_t a, int32_t b, int32_t c);
+    double floats(float a, double b, float c, double d);
+    int32_t* pointers(int32_t* dst, const int32_t* src);
+    int64_t many(int64_t a,
+                 int64_t b,
+                 int64_t c,
+                 int64_t d,
+                 int64_t e,
+                 int64_t f,
+                 double g,
+                 double h,
+                 double i,
+                 double j,
+                 int32_t k,
+                 int32_t l);
+    double length_squared(vec3 v);
+    int64_t ints64(int64_t a, int64_t b, int64_t c);
+    double lerp(double a, double b, double t);
+    int64_t sum_var(int32_t count, ...);
+}  // namespace native
+
+#endif
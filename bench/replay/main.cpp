@@ -0,0 +1,88 @@
+// Copyright 2017 Elias Kosunen
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// Replays a call recording against a local library and prints one JSON line
+// with the throughput and latency, like the benchmarks do
+
+#include <cppffi.h>
+#include <cppffi_replay.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <string>
+
+static int usage(const char* self)
+{
+    std::fprintf(stderr,
+                 "usage: %s recording library [--recorded] [--threads n] "
+                 "[--repeat n]\n",
+                 self);
+    return 1;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 3) {
+        return usage(argv[0]);
+    }
+
+    ffi::replay_options options;
+    for (int i = 3; i < argc; ++i) {
+        if (std::strcmp(argv[i], "--recorded") == 0) {
+            options.recorded_pacing = true;
+        }
+        else if (std::strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            options.threads = std::strtoull(argv[++i], nullptr, 10);
+        }
+        else if (std::strcmp(argv[i], "--repeat") == 0 && i + 1 < argc) {
+            options.repeat = std::strtoull(argv[++i], nullptr, 10);
+        }
+        else {
+            return usage(argv[0]);
+        }
+    }
+
+    try {
+        ffi::call_log log(argv[1]);
+        ffi::shared_library lib(argv[2]);
+        ffi::replay r(log, lib);
+        const auto report = r.run(options);
+        std::printf(
+            "{\"recorded\":%llu,\"replayed\":%llu,\"skipped\":%llu,"
+            "\"calls\":%llu,\"seconds\":%.6f,\"calls_per_second\":%.1f,"
+            "\"mean_ns\":%.1f,\"p50_ns\":%llu,\"p90_ns\":%llu,"
+            "\"p99_ns\":%llu,\"max_ns\":%llu}\n",
+            static_cast<unsigned long long>(log.calls().size()),
+            static_cast<unsigned long long>(r.size()),
+            static_cast<unsigned long long>(r.skipped()),
+            static_cast<unsigned long long>(report.calls), report.seconds,
+            report.calls_per_second, report.mean_ns,
+            static_cast<unsigned long long>(report.p50_ns),
+            static_cast<unsigned long long>(report.p90_ns),
+            static_cast<unsigned long long>(report.p99_ns),
+            static_cast<unsigned long long>(report.max_ns));
+    }
+    catch (const std::exception& e) {
+        std::fprintf(stderr, "%s: %s\n", argv[0], e.what());
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,55 @@
+// Copyright 2017 Elias Kosunen
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include "bench.h"
+#include "native.h"
+
+#include <cppffi.h>
+
+CPPFFI_BENCHMARK("variadic/ints64")
+{
+    using function_type = int64_t(int32_t, ...);
+    function_type* volatile direct = &native::sum_var;
+    ctx.measure("variadic", "int64(int32,...int64,int64)", "direct", [&] {
+        bench::do_not_optimize(direct(2, int64_t{1}, int64_t{2}));
+    });
+
+    ffi::cif_var<int64_t(int32_t)> c;
+    ctx.measure("variadic", "int64(int32,...int64,int64)", "cif_var::call",
+                [&] {
+                    bench::do_not_optimize(
+                        c.call(native::sum_var, 2, int64_t{1}, int64_t{2}));
+                });
+
+    ffi_cif raw;
+    ffi_type* types[] = {&ffi_type_sint32, &ffi_type_sint64,
+                         &ffi_type_sint64};
+    ctx.measure("variadic", "int64(int32,...int64,int64)",
+                "ffi_prep_cif_var+ffi_call", [&] {
+                    ffi_prep_cif_var(&raw, FFI_DEFAULT_ABI, 1, 3,
+                                     &ffi_type_sint64, types);
+                    int32_t count = 2;
+                    int64_t a = 1, b = 2;
+                    void* args[] = {&count, &a, &b};
+                    ffi_arg ret;
+                    ffi_call(&raw, CPPFFI_FN(&native::sum_var), &ret, args);
+                    bench::do_not_optimize(ret);
+                });
+}
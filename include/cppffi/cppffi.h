@@ -22,8 +22,11 @@
 #define CPPFFI_H
 
 #include "ffi.h"
+#include <algorithm>
 #include <array>
+#include <atomic>
 #include <cassert>
+#include <initializer_list>
 #include <stdexcept>
 #include <string>
 #include <tuple>
@@ -31,8 +34,11 @@
 
 #include "cppffi_begin.h"
 
+#include "cppffi_span.h"
+#include "cppffi_instrument.h"
 #include "cppffi_support.h"
 #include "types/builtin.h"
+#include "types/structs.h"
 
 namespace ffi {
     using abi = ffi_abi;
@@ -40,23 +46,420 @@ namespace ffi {
     /**
      * Call InterFace.
      * Represents a function prototype that can be bound to multiple callable
-     * objects
+     * objects.
+     *
+     * A cif is never modified after construction, and libffi only reads the
+     * prepared ffi_cif when calling through it. A cif can be shared between
+     * any number of threads and called through concurrently.
      */
     template <typename T>
     class cif;
 
+    /**
+     * A function bound to a cif.
+     * Only holds references to the function and the cif, so calling it
+     * concurrently from several threads is safe as long as the function
+     * itself is.
+     */
     template <typename T>
     class callable;
 
+    class thread_pool;
+
     template <typename T>
     class call_context;
 
+    template <typename T>
+    class future;
+
+    namespace detail {
+        template <typename T>
+        class async_call;
+
+        struct prepare_tag {
+        };
+
+        /**
+         * Process-wide cache of prepared interfaces, one per Entry type and
+         * ABI. Entries are created on first use and live until the process
+         * exits. Lookups are a single atomic load once the entry exists.
+         */
+        template <typename Entry>
+        class cif_cache;
+
+        /**
+         * Where call_batch stores return values.
+         * Return types at least as big as a register go straight into the
+         * output column, smaller ones through a temporary
+         */
+        template <typename ReturnT, bool Direct>
+        struct batch_column {
+            using type = span<ReturnT>;
+
+            static std::size_t rows(type out)
+            {
+                return out.size();
+            }
+
+            static void* at(type out, std::size_t row, void*)
+            {
+                return std::addressof(out[row]);
+            }
+            static void store(type, std::size_t, const void*) {}
+
+            static type slice(type out, std::size_t begin, std::size_t end)
+            {
+                return {out.data() + begin, end - begin};
+            }
+        };
+
+        template <typename ReturnT>
+        struct batch_column<ReturnT, false> {
+            using type = span<ReturnT>;
+
+            static std::size_t rows(type out)
+            {
+                return out.size();
+            }
+
+            static void* at(type, std::size_t, void* tmp)
+            {
+                return tmp;
+            }
+            static void store(type out, std::size_t row, const void* tmp)
+            {
+                out[row] = read_return<ReturnT>(tmp);
+            }
+
+            static type slice(type out, std::size_t begin, std::size_t end)
+            {
+                return {out.data() + begin, end - begin};
+            }
+        };
+
+        template <typename ReturnT>
+        struct batch_output
+            : batch_column<ReturnT, (sizeof(ReturnT) >= sizeof(ffi_arg))> {
+        };
+
+        /**
+         * Functions returning void take a row count instead of an output
+         * column
+         */
+        template <>
+        struct batch_output<void> {
+            using type = std::size_t;
+
+            static std::size_t rows(type n)
+            {
+                return n;
+            }
+
+            static void* at(type, std::size_t, void*)
+            {
+                return nullptr;
+            }
+            static void store(type, std::size_t, const void*) {}
+
+            static type slice(type, std::size_t begin, std::size_t end)
+            {
+                return end - begin;
+            }
+        };
+
+        /**
+         * Throw bad_batch_size if any column is shorter than rows
+         */
+        void check_batch(std::size_t rows,
+                         std::initializer_list<std::size_t> sizes);
+
+        /**
+         * Call fn once per row, advancing every argument pointer by its
+         * stride after each call
+         */
+        template <typename ReturnT, size_t N>
+        void call_rows(ffi_cif& c,
+                       void (*fn)(),
+                       typename batch_output<ReturnT>::type out,
+                       std::size_t rows,
+                       std::array<void*, N>& args,
+                       const std::array<std::size_t, N>& strides);
+
+        template <typename ReturnT>
+        struct call_return {
+            using type = ReturnT;
+
+            static ReturnT release(type&& val)
+            {
+                return std::forward<type>(val);
+            }
+        };
+
+        template <>
+        struct call_return<void> {
+            using type = int;
+
+            static void release(type&&) {}
+        };
+
+        /**
+         * Receives the return value of a call.
+         * libffi needs at least a full register of return storage. Types
+         * at least that big are written straight into the destination;
+         * smaller ones go through a register-sized slot on the stack.
+         */
+        template <typename ReturnT, bool Direct>
+        struct return_slot_impl {
+            /// invoke(void* ret) makes the call
+            template <typename Invoke>
+            static void into(ReturnT& out, Invoke&& invoke)
+            {
+                invoke(static_cast<void*>(std::addressof(out)));
+            }
+        };
+
+        template <typename ReturnT>
+        struct return_slot_impl<ReturnT, false> {
+            template <typename Invoke>
+            static void into(ReturnT& out, Invoke&& invoke)
+            {
+                typename std::aligned_storage<
+                    sizeof(ffi_arg),
+                    (alignof(ReturnT) > alignof(ffi_arg)
+                         ? alignof(ReturnT)
+                         : alignof(ffi_arg))>::type storage;
+                invoke(static_cast<void*>(&storage));
+                out = read_return<ReturnT>(&storage);
+            }
+        };
+
+        template <typename ReturnT>
+        struct return_slot
+            : return_slot_impl<ReturnT,
+                               (sizeof(ReturnT) >= sizeof(ffi_arg))> {
+            static void call(ffi_cif& c,
+                             void (*fn)(),
+                             ReturnT& out,
+                             void** args)
+            {
+                return_slot::into(out, [&](void* ret) {
+                    invoke(c, fn, ret, args);
+                });
+            }
+        };
+
+        template <>
+        struct return_slot<void> {
+            template <typename Invoke>
+            static void into(call_return<void>::type&, Invoke&& invoke)
+            {
+                ffi_arg storage;
+                invoke(static_cast<void*>(&storage));
+            }
+
+            static void call(ffi_cif& c,
+                             void (*fn)(),
+                             call_return<void>::type& out,
+                             void** args)
+            {
+                into(out, [&](void* ret) { invoke(c, fn, ret, args); });
+            }
+        };
+
+        /**
+         * How an argument is packed into an ffi_raw buffer for the raw API.
+         * Every argument takes whole ffi_raw slots. Values are copied in;
+         * integers narrower than a slot are widened first
+         */
+        template <typename T, typename = void>
+        struct raw_arg {
+            static constexpr size_t slots =
+                (sizeof(T) + sizeof(ffi_raw) - 1) / sizeof(ffi_raw);
+
+            static void pack(ffi_raw* raw, const T& value)
+            {
+                std::memcpy(raw, std::addressof(value), sizeof(T));
+            }
+        };
+
+        template <typename T>
+        struct raw_arg<T,
+                       typename std::enable_if<std::is_integral<T>::value &&
+                                               (sizeof(T) <
+                                                sizeof(ffi_raw))>::type> {
+            static constexpr size_t slots = 1;
+
+            static void pack(ffi_raw* raw, const T& value)
+            {
+                _pack(raw, value, std::is_signed<T>{});
+            }
+
+        private:
+            static void _pack(ffi_raw* raw, const T& value, std::true_type)
+            {
+                raw->sint = value;
+            }
+            static void _pack(ffi_raw* raw, const T& value, std::false_type)
+            {
+                raw->uint = value;
+            }
+        };
+
+#if !(defined(FFI_NATIVE_RAW_API) && FFI_NATIVE_RAW_API)
+        // Without native support libffi unpacks the buffer itself and
+        // expects structs to be passed by address
+        template <typename T>
+        struct raw_arg<T,
+                       typename std::enable_if<std::is_class<T>::value &&
+                                               !is_span<T>::value>::type> {
+            static constexpr size_t slots = 1;
+
+            static void pack(ffi_raw* raw, const T& value)
+            {
+                raw->ptr = arg_address(value);
+            }
+        };
+#endif
+
+        template <typename... T>
+        struct raw_slots : std::integral_constant<size_t, 0> {
+        };
+        template <typename First, typename... Rest>
+        struct raw_slots<First, Rest...>
+            : std::integral_constant<size_t,
+                                     raw_arg<First>::slots +
+                                         raw_slots<Rest...>::value> {
+        };
+
+        template <typename T>
+        struct raw_arg<span<T>> {
+            static constexpr size_t slots = 2;
+
+            static void pack(ffi_raw* raw, const span<T>& value)
+            {
+                raw[0].ptr = const_cast<void*>(
+                    static_cast<const void*>(value.data()));
+                raw[1].uint = value.size();
+            }
+        };
+
+        /**
+         * How a parameter maps to native parameters.
+         * Most types are passed as themselves; types like span whose type<T>
+         * defines params expand to several
+         */
+        template <typename T, typename = void>
+        struct param {
+            static constexpr size_t count = 1;
+            using native = void(T);
+
+            static void types(ffi_type** out)
+            {
+                *out = &type<T>::ffitype();
+            }
+            static void addresses(const T& value, void** out)
+            {
+                *out = arg_address(value);
+            }
+            static std::tuple<const T&> unpack(const T& value)
+            {
+                return std::tuple<const T&>(value);
+            }
+        };
+
+        template <typename T>
+        struct param<T, typename std::enable_if<(type<T>::params > 0)>::type> {
+            static constexpr size_t count = type<T>::params;
+            using native = typename type<T>::native;
+
+            static void types(ffi_type** out)
+            {
+                type<T>::ffitypes(out);
+            }
+            static void addresses(const T& value, void** out)
+            {
+                type<T>::addresses(value, out);
+            }
+            static auto unpack(const T& value)
+                -> decltype(type<T>::unpack(value))
+            {
+                return type<T>::unpack(value);
+            }
+        };
+
+        /// Number of native parameters
+        template <typename... T>
+        struct param_total : std::integral_constant<size_t, 0> {
+        };
+        template <typename First, typename... Rest>
+        struct param_total<First, Rest...>
+            : std::integral_constant<size_t,
+                                     param<First>::count +
+                                         param_total<Rest...>::value> {
+        };
+
+        /**
+         * The native function type of a signature, with every parameter
+         * replaced by the native parameters it expands to
+         */
+        template <typename Done, typename... ArgsT>
+        struct native_function {
+            using type = Done;
+        };
+        template <typename Done, typename Native, typename... Rest>
+        struct native_append;
+        template <typename ReturnT,
+                  typename... Done,
+                  typename First,
+                  typename... Rest>
+        struct native_function<ReturnT(Done...), First, Rest...>
+            : native_append<ReturnT(Done...),
+                            typename param<First>::native,
+                            Rest...> {
+        };
+        template <typename ReturnT,
+                  typename... Done,
+                  typename... Native,
+                  typename... Rest>
+        struct native_append<ReturnT(Done...), void(Native...), Rest...>
+            : native_function<ReturnT(Done..., Native...), Rest...> {
+        };
+
+        /**
+         * Native argument pointers into the first row of a batch, and how
+         * far each one advances per row. Every column must be non-empty
+         */
+        template <size_t N, typename... ArgsT>
+        void batch_arguments(std::array<void*, N>& args,
+                             std::array<size_t, N>& strides,
+                             span<const ArgsT>... columns)
+        {
+            size_t i = 0;
+            using expand = int[];
+            (void)expand{0, (param<ArgsT>::addresses(columns[0], &args[i]),
+                             std::fill_n(&strides[i], param<ArgsT>::count,
+                                         sizeof(ArgsT)),
+                             i += param<ArgsT>::count, 0)...};
+        }
+    }  // namespace detail
+
+    template <typename T>
+    class closure;
+
     template <typename ReturnT, typename... ArgsT>
     class cif<ReturnT(ArgsT...)> {
     public:
         friend class callable<ReturnT(ArgsT...)>;
         friend class call_context<ReturnT(ArgsT...)>;
+        friend class closure<ReturnT(ArgsT...)>;
+        friend class detail::cif_cache<cif>;
 
+        /**
+         * Construct an interface for the given ABI.
+         * Unless CPPFFI_NO_CIF_CACHE is defined, the prepared ffi_cif is
+         * copied from the process-wide cache instead of calling
+         * ffi_prep_cif again
+         */
         cif(abi p_abi = FFI_DEFAULT_ABI);
 
         /**
@@ -67,14 +470,24 @@ namespace ffi {
         template <typename Callable>
         callable<ReturnT(ArgsT...)> bind(Callable&& c);
 
+        const ffi_cif& native() const
+        {
+            return m_cif;
+        }
+
     private:
+        cif(abi p_abi, detail::prepare_tag);
+
+        void _prepare(abi p_abi);
+
         template <size_t Index>
         void _expand_argument_list();
         template <size_t Index, typename FirstArg, typename... Args>
         void _expand_argument_list();
 
         ffi_cif m_cif;
-        std::array<ffi_type*, sizeof...(ArgsT)> m_argtypes;
+        std::array<ffi_type*, detail::param_total<ArgsT...>::value>
+            m_argtypes;
     };
 
     template <typename ReturnT>
@@ -82,6 +495,8 @@ namespace ffi {
     public:
         friend class callable<ReturnT()>;
         friend class call_context<ReturnT()>;
+        friend class closure<ReturnT()>;
+        friend class detail::cif_cache<cif>;
 
         cif(abi p_abi = FFI_DEFAULT_ABI);
 
@@ -93,7 +508,16 @@ namespace ffi {
         template <typename CallableT>
         callable<ReturnT()> bind(CallableT&& c);
 
+        const ffi_cif& native() const
+        {
+            return m_cif;
+        }
+
     private:
+        cif(abi p_abi, detail::prepare_tag);
+
+        void _prepare(abi p_abi);
+
         ffi_cif m_cif;
     };
 
@@ -101,30 +525,130 @@ namespace ffi {
     class callable<ReturnT(ArgsT...)> {
     public:
         friend class call_context<ReturnT(ArgsT...)>;
+        template <typename T>
+        friend class detail::async_call;
 
         using return_type = ReturnT;
         using callable_type = ReturnT(ArgsT...);
+        /**
+         * Type of the bound function.
+         * The same as callable_type, except that parameters like span are
+         * replaced by the native parameters they expand to
+         */
+        using native_type =
+            typename detail::native_function<ReturnT(), ArgsT...>::type;
 
-        callable(cif<ReturnT(ArgsT...)>& p_cif, callable_type& p_callable);
+        callable(cif<ReturnT(ArgsT...)>& p_cif, native_type& p_callable);
 
         template <typename... Args>
         call_context<ReturnT(ArgsT...)> call(Args&&... args) const;
 
+        /**
+         * Call the function.
+         * Goes through libffi, unless CPPFFI_DIRECT_DISPATCH is defined and
+         * the interface uses the default ABI, in which case this is
+         * equivalent to direct(). CPPFFI_INSTRUMENTATION turns this off, so
+         * that every call is counted
+         */
         template <typename... Args>
         ReturnT operator()(Args&&... args) const;
 
+        /**
+         * Call the function through its typed pointer, bypassing libffi.
+         * The function type is known at compile time, so this is a plain
+         * C++ function call. Expanding parameters like span are unpacked
+         * into their native arguments first.
+         */
+        template <typename... Args>
+        ReturnT direct(Args&&... args) const;
+
+        /**
+         * Call the function and store the return value in out.
+         * Return types at least as big as a register are written by libffi
+         * straight into out, without an intermediate copy
+         */
+        template <typename OutT, typename... Args>
+        void call_into(OutT& out, Args&&... args) const;
+
+        /**
+         * Call the function through libffi's raw API.
+         * The arguments are packed into one ffi_raw buffer on the stack
+         * instead of an array of pointers. Where libffi is built without
+         * the raw API (FFI_NO_RAW_API), this is the same as operator().
+         * On platforms without native raw support (FFI_NATIVE_RAW_API is
+         * 0, e.g. x86-64) libffi unpacks the buffer again, so this only
+         * pays off where the raw API is native.
+         */
+        template <typename... Args>
+        ReturnT call_raw(Args&&... args) const;
+
+        /**
+         * Call the function once for every row of the argument columns.
+         * The columns are checked once, before the first call; the rows then
+         * reuse the same prepared interface and argument pointers
+         * \param out     Column receiving the return values, one per row.
+         *                For functions returning void, the number of rows
+         * \param columns One column per parameter, each at least as long as
+         *                the number of rows
+         * \throw bad_batch_size if a column is too short
+         */
+        void call_batch(typename detail::batch_output<ReturnT>::type out,
+                        span<const ArgsT>... columns) const;
+
+        /**
+         * Spread a batch over the threads of a pool.
+         * A few rows are called first on the calling thread to measure the
+         * cost of a call, which decides how many rows a thread takes at a
+         * time. Every thread builds its own argument pointers, so nothing
+         * but the cif is shared while calling. The calling thread takes part
+         * and returns once every row has been called.
+         * \param pool    Pool to run on
+         * \param out     As for call_batch(out, columns...)
+         * \param columns As for call_batch(out, columns...)
+         * \throw bad_batch_size if a column is too short
+         */
+        void call_batch(thread_pool& pool,
+                        typename detail::batch_output<ReturnT>::type out,
+                        span<const ArgsT>... columns) const;
+
+        /**
+         * Run the call on thread_pool::global().
+         * See call_async(executor, args...)
+         */
+        future<ReturnT> call_async(const ArgsT&... args) const;
+
+        /**
+         * Run the call on an executor.
+         * The arguments are copied into the returned future's state,
+         * together with the return slot; that state is the only allocation,
+         * unless there are span parameters. Their elements are copied too,
+         * and mutable spans are rejected at compile time.
+         * The cif must outlive the future.
+         * \param executor Anything with a submit(task&) member, like
+         *                 thread_pool
+         * \return Future for the return value
+         */
+        template <typename Executor>
+        future<ReturnT> call_async(Executor& executor,
+                                   const ArgsT&... args) const;
+
     private:
-        template <size_t Index, typename ArgPack, typename Arg>
-        void _fill_arg_vec(ArgPack& vec, Arg arg) const;
-        template <size_t Index,
-                  typename ArgPack,
-                  typename FirstArg,
-                  typename... Args>
-        void _fill_arg_vec(ArgPack& vec,
-                           FirstArg first_arg,
-                           Args... args) const;
+        using expands = std::integral_constant<
+            bool,
+            detail::param_total<ArgsT...>::value != sizeof...(ArgsT)>;
 
-        callable_type& m_callable;
+        template <typename... Args>
+        ReturnT _direct(std::false_type, Args&&... args) const;
+        ReturnT _direct(std::true_type, const ArgsT&... args) const;
+        template <typename Tuple, size_t... I>
+        ReturnT _direct_native(const Tuple& args,
+                               detail::index_sequence<I...>) const;
+
+        void _call_into(typename detail::call_return<ReturnT>::type& out,
+                        const ArgsT&... args) const;
+        ReturnT _call_raw(const ArgsT&... args) const;
+
+        native_type& m_callable;
         cif<callable_type>& m_cif;
     };
 
@@ -132,6 +656,8 @@ namespace ffi {
     class callable<ReturnT()> {
     public:
         friend class call_context<ReturnT()>;
+        template <typename T>
+        friend class detail::async_call;
 
         using return_type = ReturnT;
         using callable_type = ReturnT();
@@ -140,41 +666,78 @@ namespace ffi {
 
         call_context<ReturnT()> call() const;
 
+        /**
+         * Call the function.
+         * Goes through libffi, unless CPPFFI_DIRECT_DISPATCH is defined and
+         * the interface uses the default ABI, in which case this is
+         * equivalent to direct(). CPPFFI_INSTRUMENTATION turns this off, so
+         * that every call is counted
+         */
         ReturnT operator()() const;
 
-    private:
-        callable_type& m_callable;
-        cif<ReturnT()>& m_cif;
-    };
+        /**
+         * Call the function through its typed pointer, bypassing libffi
+         */
+        ReturnT direct() const;
 
-    namespace detail {
-        template <typename ReturnT>
-        struct call_return {
-            using type = ReturnT;
+        /**
+         * Call the function and store the return value in out.
+         * Return types at least as big as a register are written by libffi
+         * straight into out, without an intermediate copy
+         */
+        template <typename OutT>
+        void call_into(OutT& out) const;
 
-            static type access(type&& val)
-            {
-                return std::forward<type>(val);
-            }
-        };
+        /**
+         * Call the function through libffi's raw API.
+         * With no arguments there is no buffer to pack; this is provided
+         * for symmetry with callable<ReturnT(ArgsT...)>::call_raw()
+         */
+        ReturnT call_raw() const;
 
-        template <>
-        struct call_return<void> {
-            using type = int;
+        /**
+         * Call the function once for every row.
+         * \param out Column receiving the return values, one per row.
+         *            For functions returning void, the number of rows
+         */
+        void call_batch(typename detail::batch_output<ReturnT>::type out) const;
 
-            template <typename T>
-            static type access(T&&)
-            {
-                return 0;
-            }
-        };
-    }
+        /**
+         * Run the call on thread_pool::global().
+         * See call_async(executor)
+         */
+        future<ReturnT> call_async() const;
+
+        /**
+         * Run the call on an executor.
+         * The return slot lives in the returned future's state, which is the
+         * only allocation.
+         * The cif must outlive the future.
+         * \param executor Anything with a submit(task&) member, like
+         *                 thread_pool
+         * \return Future for the return value
+         */
+        template <typename Executor>
+        future<ReturnT> call_async(Executor& executor) const;
+
+    private:
+        void _call_into(typename detail::call_return<ReturnT>::type& out) const;
+
+        callable_type& m_callable;
+        cif<ReturnT()>& m_cif;
+    };
 
     template <typename ReturnT, typename... ArgsT>
     class call_context<ReturnT(ArgsT...)> {
     public:
+        /**
+         * Call a callable.
+         * The arguments are handed to libffi by address, so they're never
+         * copied. Arguments of another type are converted into temporaries,
+         * which live until the call returns
+         */
         call_context(const callable<ReturnT(ArgsT...)>& p_callable,
-                     ArgsT&&... args);
+                     const ArgsT&... args);
 
         ReturnT ret() const;
 
@@ -184,27 +747,6 @@ namespace ffi {
         typename detail::call_return<ReturnT>::type&& ret_move();
 
     private:
-        template <size_t Index, typename Arg>
-        void _expand_argument_list(Arg&& arg);
-        template <size_t Index, typename FirstArg, typename... Args>
-        void _expand_argument_list(FirstArg&& arg, Args&&... args);
-
-        template <size_t Index = 0>
-        typename std::enable_if<Index == sizeof...(ArgsT), void>::type
-        _get_argument_addresses(std::array<void*, sizeof...(ArgsT)>&)
-        {
-        }
-
-        template <size_t Index = 0>
-            typename std::enable_if <
-            Index<sizeof...(ArgsT), void>::type _get_argument_addresses(
-                std::array<void*, sizeof...(ArgsT)>& vec)
-        {
-            vec[Index] = std::addressof(std::get<Index>(m_args));
-            _get_argument_addresses<Index + 1>(vec);
-        }
-
-        std::tuple<ArgsT...> m_args;
         const callable<ReturnT(ArgsT...)>& m_callable;
         typename detail::call_return<ReturnT>::type m_return;
     };
@@ -226,13 +768,31 @@ namespace ffi {
         typename detail::call_return<ReturnT>::type m_return;
     };
 
-    template <typename ReturnT, typename... ArgsT>
-    ReturnT call(ReturnT (&func)(ArgsT...), ArgsT&&... args);
+    template <typename ReturnT, typename... ArgsT, typename... Args>
+    ReturnT call(ReturnT (&func)(ArgsT...), Args&&... args);
+
+    /**
+     * The process-wide prepared interface for a signature and ABI.
+     * It is created on first use and never destroyed, so callables bound to
+     * it can be shared between threads without dangling
+     */
+    template <typename Signature>
+    cif<Signature>& shared_cif(abi p_abi = FFI_DEFAULT_ABI);
 }  // namespace ffi
 
 // Include the implementation header
 #include "cppffi_impl.h"
 
+#include "cppffi_async.h"
+#include "cppffi_closure.h"
+#include "cppffi_library.h"
+#include "cppffi_parallel.h"
+#include "cppffi_variadic.h"
+
+// Runtime signatures are included separately, since they bring in the
+// precompiled thunk table: cppffi_dynamic.h, cppffi_dispatch.h,
+// cppffi_signature.h, cppffi_recorder.h and cppffi_replay.h
+
 #include "cppffi_end.h"
 
 #endif  // CPPFFI_H
@@ -0,0 +1,213 @@
+// Copyright 2017 Elias Kosunen
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef CPPFFI_ARENA_H
+#define CPPFFI_ARENA_H
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+
+#include "cppffi_begin.h"
+
+#include "cppffi_support.h"
+
+#ifndef CPPFFI_ARENA_BLOCK_SIZE
+// Bytes a frame_arena allocates at a time, unless a frame needs more
+#define CPPFFI_ARENA_BLOCK_SIZE 16384
+#endif
+
+namespace ffi {
+    /**
+     * Where a frame_arena gets its blocks from.
+     * allocate may return null, which makes the arena throw std::bad_alloc
+     */
+    struct arena_allocator {
+        void* (*allocate)(std::size_t size, void* context);
+        void (*deallocate)(void* block, std::size_t size, void* context);
+        void* context;
+
+        /// ::operator new and ::operator delete
+        static arena_allocator global()
+        {
+            return {&arena_allocator::_new, &arena_allocator::_delete,
+                    nullptr};
+        }
+
+    private:
+        static void* _new(std::size_t size, void*)
+        {
+            return ::operator new(size, std::nothrow);
+        }
+        static void _delete(void* block, std::size_t, void*)
+        {
+            ::operator delete(block);
+        }
+    };
+
+    /**
+     * Stack allocator for argument frames.
+     * Memory is bumped off the current block and handed back in LIFO order
+     * by rewinding to a mark. Blocks are kept once allocated, so after the
+     * largest frame has been seen once, allocating a frame never goes to
+     * the underlying allocator again.
+     * Not thread-safe; local() gives every thread its own.
+     */
+    class frame_arena {
+    public:
+        /// A position to rewind to
+        struct mark {
+            void* block;
+            std::size_t used;
+        };
+
+        explicit frame_arena(
+            std::size_t block_size = CPPFFI_ARENA_BLOCK_SIZE,
+            arena_allocator allocator = arena_allocator::global())
+            : m_block_size(block_size), m_allocator(allocator)
+        {
+        }
+
+        frame_arena(const frame_arena&) = delete;
+        frame_arena& operator=(const frame_arena&) = delete;
+
+        ~frame_arena()
+        {
+            auto b = m_first;
+            while (b) {
+                auto next = b->next;
+                m_allocator.deallocate(b, b->size, m_allocator.context);
+                b = next;
+            }
+        }
+
+        /// The calling thread's arena, using the global allocator
+        static frame_arena& local()
+        {
+            static thread_local frame_arena arena;
+            return arena;
+        }
+
+        mark position() const
+        {
+            return {m_current, m_current ? m_current->used : 0};
+        }
+
+        /**
+         * Carve out memory
+         * \throw std::bad_alloc if the allocator fails
+         */
+        void* allocate(std::size_t size, std::size_t alignment)
+        {
+            if (m_current) {
+                if (auto p = _bump(*m_current, size, alignment)) {
+                    return p;
+                }
+            }
+
+            // Move on to the next block, replacing it if it's too small
+            auto next = m_current ? m_current->next : m_first;
+            const auto needed = sizeof(block) + size + alignment;
+            if (next && next->size < needed) {
+                _free_from(next);
+                next = nullptr;
+            }
+            if (!next) {
+                next = _grow(needed);
+            }
+            m_current = next;
+            m_current->used = 0;
+            return _bump(*m_current, size, alignment);
+        }
+
+        /**
+         * Release everything allocated since m was taken
+         */
+        void rewind(const mark& m)
+        {
+            m_current = static_cast<block*>(m.block);
+            if (m_current) {
+                m_current->used = m.used;
+            }
+        }
+
+        /// Bytes held in blocks, used or not
+        std::size_t reserved() const
+        {
+            std::size_t total = 0;
+            for (auto b = m_first; b; b = b->next) {
+                total += b->size;
+            }
+            return total;
+        }
+
+    private:
+        struct block {
+            block* next;
+            std::size_t size;
+            std::size_t used;
+        };
+
+        static void* _bump(block& b, std::size_t size, std::size_t alignment)
+        {
+            const auto base = reinterpret_cast<std::uintptr_t>(&b + 1);
+            const auto begin =
+                (base + b.used + alignment - 1) / alignment * alignment;
+            const auto end = begin - base + size;
+            if (end > b.size - sizeof(block)) {
+                return nullptr;
+            }
+            b.used = end;
+            return reinterpret_cast<void*>(begin);
+        }
+
+        block* _grow(std::size_t needed)
+        {
+            const auto size = needed > m_block_size ? needed : m_block_size;
+            auto memory = m_allocator.allocate(size, m_allocator.context);
+            if (!memory) {
+                CPPFFI_THROW(std::bad_alloc());
+            }
+            auto b = new (memory) block{nullptr, size, 0};
+            (m_current ? m_current->next : m_first) = b;
+            return b;
+        }
+
+        // Free b and every block after it
+        void _free_from(block* b)
+        {
+            (m_current ? m_current->next : m_first) = nullptr;
+            while (b) {
+                auto next = b->next;
+                m_allocator.deallocate(b, b->size, m_allocator.context);
+                b = next;
+            }
+        }
+
+        std::size_t m_block_size;
+        arena_allocator m_allocator;
+        block* m_first{nullptr};
+        block* m_current{nullptr};
+    };
+}  // namespace ffi
+
+#include "cppffi_end.h"
+
+#endif
@@ -0,0 +1,384 @@
+// Copyright 2017 Elias Kosunen
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef CPPFFI_ASYNC_H
+#define CPPFFI_ASYNC_H
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L
+#include <coroutine>
+#define CPPFFI_HAS_COROUTINES 1
+#else
+#define CPPFFI_HAS_COROUTINES 0
+#endif
+
+#include "cppffi_begin.h"
+
+#include "cppffi.h"
+#include "cppffi_parallel.h"
+
+namespace ffi {
+    namespace detail {
+        /**
+         * Completion state shared by every asynchronous call.
+         * Runs as a task on the executor; whoever waits for it is either
+         * blocked on the condition variable or a suspended coroutine.
+         * Not polymorphic, since task isn't: the concrete operation passes
+         * in how to delete itself
+         */
+        class async_state : public task {
+        public:
+            using destroy_type = void (*)(async_state&);
+
+            async_state(task::function_type fn, destroy_type p_destroy)
+                : task(fn), m_destroy(p_destroy)
+            {
+            }
+
+            async_state(const async_state&) = delete;
+            async_state& operator=(const async_state&) = delete;
+
+            /// Delete the operation this is part of
+            void destroy()
+            {
+                m_destroy(*this);
+            }
+
+            bool ready() const
+            {
+                std::lock_guard<std::mutex> lock(m_lock);
+                return m_done;
+            }
+
+            void wait() const
+            {
+                std::unique_lock<std::mutex> lock(m_lock);
+                m_ready.wait(lock, [this] { return m_done; });
+            }
+
+            /**
+             * Have resume(arg) called on completion.
+             * \return false if the call has already completed
+             */
+            bool on_done(void (*resume)(void*), void* arg)
+            {
+                std::lock_guard<std::mutex> lock(m_lock);
+                if (m_done) {
+                    return false;
+                }
+                m_resume = resume;
+                m_resume_arg = arg;
+                return true;
+            }
+
+        protected:
+            ~async_state() = default;
+
+            void _complete()
+            {
+                void (*resume)(void*) = nullptr;
+                void* arg = nullptr;
+                {
+                    // Notify under the lock: a waiter may destroy the state
+                    // as soon as it can observe m_done
+                    std::lock_guard<std::mutex> lock(m_lock);
+                    m_done = true;
+                    std::swap(resume, m_resume);
+                    std::swap(arg, m_resume_arg);
+                    m_ready.notify_all();
+                }
+                if (resume) {
+                    resume(arg);
+                }
+            }
+
+        private:
+            destroy_type m_destroy;
+            mutable std::mutex m_lock{};
+            mutable std::condition_variable m_ready{};
+            bool m_done{false};
+            void (*m_resume)(void*){nullptr};
+            void* m_resume_arg{nullptr};
+        };
+
+        template <typename ReturnT>
+        class async_result : public async_state {
+        public:
+            async_result(task::function_type fn, destroy_type p_destroy)
+                : async_state(fn, p_destroy)
+            {
+            }
+
+            typename call_return<ReturnT>::type m_return{};
+        };
+
+        /**
+         * How an asynchronous call keeps an argument until it runs.
+         * Most arguments are copied as they are
+         */
+        template <typename T>
+        struct async_arg {
+            using type = typename std::decay<T>::type;
+
+            static const type& store(const type& arg)
+            {
+                return arg;
+            }
+            static const type& view(const type& arg)
+            {
+                return arg;
+            }
+        };
+        /**
+         * A span only points at its elements, which may be a temporary
+         * container gone by the time the call runs, so the elements are
+         * copied. Functions writing through a span would then write to the
+         * copy, so mutable spans are rejected
+         */
+        template <typename T>
+        struct async_arg<span<T>> {
+            static_assert(std::is_const<T>::value,
+                          "call_async can't take a mutable span: writes "
+                          "would go to a copy of the elements");
+
+            using type = std::vector<typename std::remove_const<T>::type>;
+
+            static type store(const span<T>& arg)
+            {
+                return type(arg.begin(), arg.end());
+            }
+            static span<T> view(const type& arg)
+            {
+                return span<T>(arg.data(), arg.size());
+            }
+        };
+
+        /**
+         * Operation state of one asynchronous call: the task, a copy of the
+         * arguments and the return slot, allocated together
+         */
+        template <typename ReturnT, typename... ArgsT>
+        class async_call<ReturnT(ArgsT...)> : public async_result<ReturnT> {
+        public:
+            async_call(const callable<ReturnT(ArgsT...)>& p_callable,
+                       const ArgsT&... args)
+                : async_result<ReturnT>(&async_call::run,
+                                        &async_call::destroy),
+                  m_callable(p_callable),
+                  m_args(async_arg<ArgsT>::store(args)...)
+            {
+            }
+
+            static void run(task& t)
+            {
+                auto& self = static_cast<async_call&>(t);
+                self._run(make_index_sequence<sizeof...(ArgsT)>{});
+                self._complete();
+            }
+
+            static void destroy(async_state& s)
+            {
+                delete &static_cast<async_call&>(s);
+            }
+
+        private:
+            template <size_t... I>
+            void _run(index_sequence<I...>)
+            {
+                m_callable._call_into(
+                    this->m_return,
+                    async_arg<ArgsT>::view(std::get<I>(m_args))...);
+            }
+
+            callable<ReturnT(ArgsT...)> m_callable;
+            std::tuple<typename async_arg<ArgsT>::type...> m_args;
+        };
+    }  // namespace detail
+
+    /**
+     * Result of callable::call_async().
+     * Owns the operation state. Destroying a future whose call is still
+     * pending blocks until the call has finished, like std::async.
+     * In C++20 builds a future can also be co_awaited; the coroutine is
+     * then resumed on the thread that ran the call.
+     */
+    template <typename ReturnT>
+    class future {
+    public:
+        using state_type = detail::async_result<ReturnT>;
+
+        future() = default;
+        explicit future(state_type* p_state) : m_state(p_state) {}
+
+        future(const future&) = delete;
+        future& operator=(const future&) = delete;
+
+        future(future&& other) noexcept : m_state(other.m_state)
+        {
+            other.m_state = nullptr;
+        }
+        future& operator=(future&& other)
+        {
+            if (this != &other) {
+                _release();
+                std::swap(m_state, other.m_state);
+            }
+            return *this;
+        }
+
+        ~future()
+        {
+            _release();
+        }
+
+        /// Does this future refer to a call
+        bool valid() const noexcept
+        {
+            return m_state != nullptr;
+        }
+
+        /// Has the call finished
+        bool ready() const
+        {
+            return m_state->ready();
+        }
+
+        /// Block until the call has finished
+        void wait() const
+        {
+            m_state->wait();
+        }
+
+        /**
+         * Wait for the call and take its return value.
+         * Leaves the future without a call
+         */
+        ReturnT get()
+        {
+            wait();
+            std::unique_ptr<state_type, releaser> state(m_state);
+            m_state = nullptr;
+            return detail::call_return<ReturnT>::release(
+                std::move(state->m_return));
+        }
+
+#if CPPFFI_HAS_COROUTINES
+        class awaiter {
+        public:
+            explicit awaiter(future& p_future) : m_future(p_future) {}
+
+            bool await_ready() const
+            {
+                return m_future.ready();
+            }
+
+            bool await_suspend(std::coroutine_handle<> handle)
+            {
+                return m_future.m_state->on_done(&awaiter::_resume,
+                                                 handle.address());
+            }
+
+            ReturnT await_resume()
+            {
+                return m_future.get();
+            }
+
+        private:
+            static void _resume(void* handle)
+            {
+                std::coroutine_handle<>::from_address(handle).resume();
+            }
+
+            future& m_future;
+        };
+
+        awaiter operator co_await()
+        {
+            return awaiter{*this};
+        }
+#endif
+
+    private:
+        struct releaser {
+            void operator()(state_type* state) const
+            {
+                state->destroy();
+            }
+        };
+
+        void _release()
+        {
+            if (m_state) {
+                m_state->wait();
+                m_state->destroy();
+                m_state = nullptr;
+            }
+        }
+
+        state_type* m_state{nullptr};
+    };
+
+    template <typename ReturnT, typename... ArgsT>
+    inline future<ReturnT> callable<ReturnT(ArgsT...)>::call_async(
+        const ArgsT&... args) const
+    {
+        return call_async(thread_pool::global(), args...);
+    }
+
+    template <typename ReturnT, typename... ArgsT>
+    template <typename Executor>
+    inline future<ReturnT> callable<ReturnT(ArgsT...)>::call_async(
+        Executor& executor,
+        const ArgsT&... args) const
+    {
+        using op = detail::async_call<ReturnT(ArgsT...)>;
+        std::unique_ptr<op> state(new op(*this, args...));
+        executor.submit(*state);
+        return future<ReturnT>{state.release()};
+    }
+
+    template <typename ReturnT>
+    inline future<ReturnT> callable<ReturnT()>::call_async() const
+    {
+        return call_async(thread_pool::global());
+    }
+
+    template <typename ReturnT>
+    template <typename Executor>
+    inline future<ReturnT> callable<ReturnT()>::call_async(
+        Executor& executor) const
+    {
+        using op = detail::async_call<ReturnT()>;
+        std::unique_ptr<op> state(new op(*this));
+        executor.submit(*state);
+        return future<ReturnT>{state.release()};
+    }
+}  // namespace ffi
+
+#include "cppffi_end.h"
+
+#endif
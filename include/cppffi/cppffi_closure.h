@@ -0,0 +1,405 @@
+// Copyright 2017 Elias Kosunen
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef CPPFFI_CLOSURE_H
+#define CPPFFI_CLOSURE_H
+
+#include "ffi.h"
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "cppffi.h"
+
+#include "cppffi_begin.h"
+
+#if defined(FFI_CLOSURES) && FFI_CLOSURES
+
+namespace ffi {
+    /**
+     * Recycles ffi_closure trampolines.
+     *
+     * Every ffi_closure_alloc may map executable pages. A pool allocates
+     * trampolines in batches, keeps released ones on a free list, and hands
+     * them out again, re-prepared for the new closure. Trampolines are only
+     * given back to libffi when the pool is destroyed.
+     *
+     * A pool isn't thread-safe. local() gives every thread its own pool;
+     * closures taken from it must be destroyed on the same thread, before it
+     * exits.
+     */
+    class closure_pool {
+    public:
+        /**
+         * \param p_batch Number of trampolines to allocate at a time once the
+         *                free list is empty
+         */
+        explicit closure_pool(size_t p_batch = 64)
+            : m_batch(p_batch ? p_batch : 1)
+        {
+        }
+        ~closure_pool();
+
+        closure_pool(const closure_pool&) = delete;
+        closure_pool& operator=(const closure_pool&) = delete;
+
+        /// The pool of the calling thread
+        static closure_pool& local();
+
+        /// Make sure at least n trampolines are on the free list
+        void reserve(size_t n);
+
+        /// Trampolines ready to be handed out
+        size_t available() const
+        {
+            return m_free.size();
+        }
+        /// Trampolines allocated from libffi over the pool's lifetime
+        size_t allocated() const
+        {
+            return m_allocated;
+        }
+
+        /**
+         * Take a trampoline off the free list, growing the pool if needed
+         * \param code Receives the executable address of the trampoline
+         */
+        ffi_closure* acquire(void*& code);
+
+        /// Put a trampoline back on the free list. Never allocates
+        void release(ffi_closure* c, void* code) noexcept;
+
+    private:
+        struct slot {
+            ffi_closure* writable;
+            void* code;
+        };
+
+        void _grow(size_t n);
+
+        std::vector<slot> m_free{};
+        size_t m_batch;
+        size_t m_allocated{0};
+    };
+
+    /**
+     * Wraps any C++ callable into a plain C function pointer.
+     *
+     * The handler libffi invokes is instantiated for the exact callable type,
+     * so each call is dispatched statically into the callable, without
+     * type-erased indirection. The callable must not throw: exceptions can't
+     * propagate through the C code calling the pointer.
+     *
+     * The pointer returned by get() is valid until the closure is destroyed.
+     * By default each closure allocates its own trampoline; pass a
+     * closure_pool to recycle them instead.
+     */
+    template <typename ReturnT, typename... ArgsT>
+    class closure<ReturnT(ArgsT...)> {
+        static_assert(detail::param_total<ArgsT...>::value ==
+                          sizeof...(ArgsT),
+                      "closure parameters can't expand, e.g. span");
+
+    public:
+        using function_type = ReturnT(ArgsT...);
+        using pointer = ReturnT (*)(ArgsT...);
+
+        template <typename Callable,
+                  typename = typename std::enable_if<!std::is_same<
+                      typename std::decay<Callable>::type,
+                      closure>::value>::type>
+        explicit closure(Callable&& c, abi p_abi = FFI_DEFAULT_ABI);
+
+        template <typename Callable>
+        closure(Callable&& c, closure_pool& pool, abi p_abi = FFI_DEFAULT_ABI);
+
+        ~closure();
+
+        closure(const closure&) = delete;
+        closure& operator=(const closure&) = delete;
+
+        closure(closure&& other) noexcept;
+        closure& operator=(closure&& other) noexcept;
+
+        /// The C function pointer calling into the callable
+        pointer get() const
+        {
+            return reinterpret_cast<pointer>(m_code);
+        }
+
+    private:
+        template <typename Callable>
+        struct state {
+            template <typename C>
+            state(abi p_abi, C&& c) : interface(p_abi), fn(std::forward<C>(c))
+            {
+            }
+
+            cif<function_type> interface;
+            Callable fn;
+        };
+
+        template <typename Callable>
+        static void _handler(ffi_cif*, void* ret, void** args, void* data);
+
+        template <typename Callable, size_t... I>
+        static void _invoke(Callable& fn,
+                            void* ret,
+                            void** args,
+                            detail::index_sequence<I...>,
+                            std::false_type);
+        template <typename Callable, size_t... I>
+        static void _invoke(Callable& fn,
+                            void*,
+                            void** args,
+                            detail::index_sequence<I...>,
+                            std::true_type);
+
+        template <typename Callable>
+        static void _destroy(void* data)
+        {
+            delete static_cast<state<Callable>*>(data);
+        }
+
+        template <typename Callable>
+        void _prepare(Callable&& c, abi p_abi);
+
+        void _release();
+
+        ffi_closure* m_closure;
+        void* m_code;
+        void* m_state;
+        void (*m_destroy)(void*);
+        closure_pool* m_pool;
+    };
+
+    inline closure_pool::~closure_pool()
+    {
+        for (auto& s : m_free) {
+            ffi_closure_free(s.writable);
+        }
+    }
+
+    inline closure_pool& closure_pool::local()
+    {
+        static thread_local closure_pool pool;
+        return pool;
+    }
+
+    inline void closure_pool::reserve(size_t n)
+    {
+        if (m_free.size() < n) {
+            _grow(n - m_free.size());
+        }
+    }
+
+    inline ffi_closure* closure_pool::acquire(void*& code)
+    {
+        if (m_free.empty()) {
+            _grow(m_batch);
+        }
+        const auto s = m_free.back();
+        m_free.pop_back();
+        code = s.code;
+        return s.writable;
+    }
+
+    inline void closure_pool::release(ffi_closure* c, void* code) noexcept
+    {
+        // Capacity always covers every allocated trampoline
+        m_free.push_back({c, code});
+    }
+
+    inline void closure_pool::_grow(size_t n)
+    {
+        m_free.reserve(m_allocated + n);
+        for (size_t i = 0; i < n; ++i) {
+            void* code = nullptr;
+            auto c = static_cast<ffi_closure*>(
+                ffi_closure_alloc(sizeof(ffi_closure), &code));
+            if (!c) {
+                CPPFFI_THROW(std::bad_alloc());
+            }
+            ++m_allocated;
+            m_free.push_back({c, code});
+        }
+    }
+
+    template <typename ReturnT, typename... ArgsT>
+    template <typename Callable, typename>
+    inline closure<ReturnT(ArgsT...)>::closure(Callable&& c, abi p_abi)
+        : m_closure(nullptr),
+          m_code(nullptr),
+          m_state(nullptr),
+          m_destroy(nullptr),
+          m_pool(nullptr)
+    {
+        m_closure = static_cast<ffi_closure*>(
+            ffi_closure_alloc(sizeof(ffi_closure), &m_code));
+        if (!m_closure) {
+            CPPFFI_THROW(std::bad_alloc());
+        }
+        _prepare(std::forward<Callable>(c), p_abi);
+    }
+
+    template <typename ReturnT, typename... ArgsT>
+    template <typename Callable>
+    inline closure<ReturnT(ArgsT...)>::closure(Callable&& c,
+                                               closure_pool& pool,
+                                               abi p_abi)
+        : m_closure(nullptr),
+          m_code(nullptr),
+          m_state(nullptr),
+          m_destroy(nullptr),
+          m_pool(&pool)
+    {
+        m_closure = pool.acquire(m_code);
+        _prepare(std::forward<Callable>(c), p_abi);
+    }
+
+    template <typename ReturnT, typename... ArgsT>
+    template <typename Callable>
+    inline void closure<ReturnT(ArgsT...)>::_prepare(Callable&& c, abi p_abi)
+    {
+        using callable_type = typename std::decay<Callable>::type;
+
+        // Give the trampoline back if anything below throws
+        struct guard {
+            closure& self;
+            bool armed;
+            ~guard()
+            {
+                if (armed) {
+                    self._release();
+                }
+            }
+        } g{*this, true};
+
+        std::unique_ptr<state<callable_type>> s(
+            new state<callable_type>(p_abi, std::forward<Callable>(c)));
+        detail::check_status(ffi_prep_closure_loc(
+            m_closure, &s->interface.m_cif, &_handler<callable_type>, s.get(),
+            m_code));
+
+        m_state = s.release();
+        m_destroy = &_destroy<callable_type>;
+        g.armed = false;
+    }
+
+    template <typename ReturnT, typename... ArgsT>
+    inline closure<ReturnT(ArgsT...)>::~closure()
+    {
+        _release();
+    }
+
+    template <typename ReturnT, typename... ArgsT>
+    inline closure<ReturnT(ArgsT...)>::closure(closure&& other) noexcept
+        : m_closure(other.m_closure),
+          m_code(other.m_code),
+          m_state(other.m_state),
+          m_destroy(other.m_destroy),
+          m_pool(other.m_pool)
+    {
+        other.m_closure = nullptr;
+        other.m_code = nullptr;
+        other.m_state = nullptr;
+    }
+
+    template <typename ReturnT, typename... ArgsT>
+    inline closure<ReturnT(ArgsT...)>& closure<ReturnT(ArgsT...)>::operator=(
+        closure&& other) noexcept
+    {
+        if (this != &other) {
+            _release();
+            m_closure = other.m_closure;
+            m_code = other.m_code;
+            m_state = other.m_state;
+            m_destroy = other.m_destroy;
+            m_pool = other.m_pool;
+            other.m_closure = nullptr;
+            other.m_code = nullptr;
+            other.m_state = nullptr;
+        }
+        return *this;
+    }
+
+    template <typename ReturnT, typename... ArgsT>
+    inline void closure<ReturnT(ArgsT...)>::_release()
+    {
+        if (m_closure) {
+            if (m_pool) {
+                m_pool->release(m_closure, m_code);
+            }
+            else {
+                ffi_closure_free(m_closure);
+            }
+            m_closure = nullptr;
+        }
+        if (m_state) {
+            m_destroy(m_state);
+            m_state = nullptr;
+        }
+    }
+
+    template <typename ReturnT, typename... ArgsT>
+    template <typename Callable>
+    inline void closure<ReturnT(ArgsT...)>::_handler(ffi_cif*,
+                                                     void* ret,
+                                                     void** args,
+                                                     void* data)
+    {
+        _invoke(static_cast<state<Callable>*>(data)->fn, ret, args,
+                detail::make_index_sequence<sizeof...(ArgsT)>{},
+                std::is_void<ReturnT>{});
+    }
+
+    template <typename ReturnT, typename... ArgsT>
+    template <typename Callable, size_t... I>
+    inline void closure<ReturnT(ArgsT...)>::_invoke(
+        Callable& fn,
+        void* ret,
+        void** args,
+        detail::index_sequence<I...>,
+        std::false_type)
+    {
+        detail::write_return<ReturnT>(
+            ret, fn(*static_cast<typename std::remove_reference<ArgsT>::type*>(
+                     args[I])...));
+    }
+    template <typename ReturnT, typename... ArgsT>
+    template <typename Callable, size_t... I>
+    inline void closure<ReturnT(ArgsT...)>::_invoke(
+        Callable& fn,
+        void*,
+        void** args,
+        detail::index_sequence<I...>,
+        std::true_type)
+    {
+        fn(*static_cast<typename std::remove_reference<ArgsT>::type*>(
+            args[I])...);
+    }
+}  // namespace ffi
+
+#endif  // FFI_CLOSURES
+
+#include "cppffi_end.h"
+
+#endif
@@ -22,3 +22,16 @@
 
 //#define CPPFFI_NOTHROW
 
+// Prepare every cif from scratch instead of sharing the process-wide cache
+//#define CPPFFI_NO_CIF_CACHE
+
+// Make callable::operator() call statically typed functions directly instead
+// of through libffi, when the interface uses the default ABI.
+// Ignored under CPPFFI_INSTRUMENTATION
+//#define CPPFFI_DIRECT_DISPATCH
+
+// Call common dynamic signatures through ffi_call instead of precompiled thunks
+//#define CPPFFI_NO_THUNKS
+
+// Count and time every call, and run the hooks set on ffi::instrumentation
+//#define CPPFFI_INSTRUMENTATION
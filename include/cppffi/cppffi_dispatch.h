@@ -0,0 +1,236 @@
+// Copyright 2017 Elias Kosunen
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef CPPFFI_DISPATCH_H
+#define CPPFFI_DISPATCH_H
+
+#include "ffi.h"
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "cppffi_begin.h"
+
+#include "cppffi.h"
+#include "cppffi_dynamic.h"
+#include "cppffi_instrument.h"
+#include "cppffi_signature.h"
+#include "cppffi_span.h"
+#include "cppffi_support.h"
+#include "cppffi_thunk.h"
+
+// How many entries ahead dispatch_table::call_batch prefetches
+#ifndef CPPFFI_DISPATCH_PREFETCH
+#define CPPFFI_DISPATCH_PREFETCH 8
+#endif
+
+namespace ffi {
+    namespace detail {
+        /// What dispatch_table keeps for each function
+        struct alignas(32) dispatch_entry {
+            ffi_cif* cif;
+            void (*fn)();
+            thunk_fn thunk;
+            const dynamic_cif* layout;
+        };
+        static_assert(sizeof(dispatch_entry) == 32,
+                      "dispatch_entry should fill exactly half a cache line");
+
+        using dispatch_entries =
+            std::vector<dispatch_entry, aligned_allocator<dispatch_entry>>;
+    }  // namespace detail
+
+    /**
+     * Functions with runtime signatures, called by a dense integer id.
+     *
+     * Every entry holds what a call needs: the prepared ffi_cif, the
+     * function pointer, the precompiled thunk if there is one, and the
+     * dynamic_cif describing the argument frame layout. Entries are 32
+     * bytes, aligned so that none straddles a cache line, and stored in one
+     * contiguous array. A call by id is one indexed load and the call.
+     *
+     * The interfaces must outlive the table; ones from signature() always
+     * do. Adding entries isn't thread-safe, but once the table is filled
+     * any number of threads can call through it.
+     */
+    class dispatch_table {
+    public:
+        using id_type = std::uint32_t;
+
+        dispatch_table() = default;
+        /// Reserve room for capacity entries
+        explicit dispatch_table(size_t capacity)
+        {
+            m_entries.reserve(capacity);
+        }
+
+        /**
+         * Add a function.
+         * \return Its id; ids are assigned in order starting from 0
+         */
+        template <typename FunctionT>
+        id_type add(const dynamic_cif& p_cif, FunctionT* fn);
+
+        /**
+         * Add a function with a signature string, like "i(ifp)".
+         * Throws bad_signature if the string is malformed
+         */
+        template <typename FunctionT>
+        id_type add(const std::string& sig, FunctionT* fn)
+        {
+            return add(signature(sig), fn);
+        }
+
+        size_t size() const
+        {
+            return m_entries.size();
+        }
+
+        /// Interface of an entry, for building its dynamic_frame
+        const dynamic_cif& interface(id_type id) const
+        {
+            return *_entry(id).layout;
+        }
+
+        /**
+         * The entry as a dynamic_callable.
+         * Throws bad_function_id if there's no such entry
+         */
+        dynamic_callable at(id_type id) const;
+
+        /**
+         * Call with a libffi-style return pointer and argument array.
+         * The id isn't checked, except by an assertion
+         */
+        void call(id_type id, void* ret, void** args) const;
+
+        /// Call with a frame built for interface(id)
+        void call(id_type id, dynamic_frame& frame) const
+        {
+            assert(&frame.interface() == &interface(id));
+            call(id, frame.ret(), frame.args());
+        }
+
+        /**
+         * Copy the arguments into a frame, call, and read the return value
+         * as ReturnT. Throws bad_function_id if there's no such entry
+         */
+        template <typename ReturnT, typename... Args>
+        ReturnT invoke(id_type id, const Args&... args) const
+        {
+            return at(id).template invoke<ReturnT>(args...);
+        }
+
+        /**
+         * Call ids[i] with rets[i] and args[i] for every i, prefetching the
+         * entries CPPFFI_DISPATCH_PREFETCH calls ahead
+         * \throw bad_batch_size if rets or args is shorter than ids
+         */
+        void call_batch(span<const id_type> ids,
+                        span<void* const> rets,
+                        span<void** const> args) const;
+
+        /// Hint that an entry is about to be called
+        void prefetch(id_type id) const noexcept
+        {
+#if defined(__GNUC__) || defined(__clang__)
+            __builtin_prefetch(m_entries.data() + id);
+#else
+            (void)id;
+#endif
+        }
+
+    private:
+        using entry = detail::dispatch_entry;
+
+        const entry& _entry(id_type id) const
+        {
+            assert(id < m_entries.size());
+            return m_entries[id];
+        }
+
+        detail::dispatch_entries m_entries{};
+    };
+
+    template <typename FunctionT>
+    inline dispatch_table::id_type dispatch_table::add(const dynamic_cif& p_cif,
+                                                       FunctionT* fn)
+    {
+        static_assert(std::is_function<FunctionT>::value,
+                      "dispatch_table::add expects a function pointer");
+        if (m_entries.size() >= std::numeric_limits<id_type>::max()) {
+            CPPFFI_THROW(bad_function_id());
+        }
+
+        // ffi_call doesn't modify the interface
+        m_entries.push_back(entry{const_cast<ffi_cif*>(&p_cif.m_cif),
+                                  CPPFFI_FN(fn), p_cif.m_thunk, &p_cif});
+        return static_cast<id_type>(m_entries.size() - 1);
+    }
+
+    inline dynamic_callable dispatch_table::at(id_type id) const
+    {
+        if (id >= m_entries.size()) {
+            CPPFFI_THROW(bad_function_id());
+        }
+        const auto& e = m_entries[id];
+        return dynamic_callable(*e.layout, e.fn);
+    }
+
+    inline void dispatch_table::call(id_type id, void* ret, void** args) const
+    {
+        const auto& e = _entry(id);
+        if (e.thunk) {
+#ifdef CPPFFI_INSTRUMENTATION
+            detail::call_probe probe(*e.cif, e.fn, ret, args);
+#endif
+            e.thunk(e.fn, ret, args);
+            return;
+        }
+        detail::invoke(*e.cif, e.fn, ret, args);
+    }
+
+    inline void dispatch_table::call_batch(span<const id_type> ids,
+                                           span<void* const> rets,
+                                           span<void** const> args) const
+    {
+        const auto n = ids.size();
+        detail::check_batch(n, {rets.size(), args.size()});
+
+        const size_t ahead = CPPFFI_DISPATCH_PREFETCH;
+        for (size_t i = 0; i < n && i < ahead; ++i) {
+            prefetch(ids[i]);
+        }
+        for (size_t i = 0; i < n; ++i) {
+            if (i + ahead < n) {
+                prefetch(ids[i + ahead]);
+            }
+            call(ids[i], rets[i], args[i]);
+        }
+    }
+}  // namespace ffi
+
+#include "cppffi_end.h"
+
+#endif
@@ -0,0 +1,492 @@
+// Copyright 2017 Elias Kosunen
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef CPPFFI_DYNAMIC_H
+#define CPPFFI_DYNAMIC_H
+
+#include "ffi.h"
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <initializer_list>
+#include <new>
+#include <type_traits>
+#include <vector>
+
+#include "cppffi_begin.h"
+
+#include "cppffi.h"
+#include "cppffi_arena.h"
+#include "cppffi_instrument.h"
+#include "cppffi_support.h"
+#include "cppffi_thunk.h"
+#include "types/builtin.h"
+
+#ifndef CPPFFI_FRAME_INLINE_SIZE
+#define CPPFFI_FRAME_INLINE_SIZE 256
+#endif
+
+namespace ffi {
+    class dispatch_table;
+    class dynamic_callable;
+    class dynamic_frame;
+
+    /**
+     * Call InterFace with a signature that is only known at runtime.
+     * Built from the same ffi_type descriptors type<T>::ffitype() returns.
+     *
+     * Also computes the layout of the argument frame: every argument gets a
+     * correctly aligned slot in one contiguous buffer, followed by the return
+     * value storage and the argument pointer array libffi expects.
+     *
+     * Signatures of up to CPPFFI_THUNK_MAX_ARGS int64, pointer or double
+     * arguments returning int64, double or void are called through a
+     * precompiled thunk instead of ffi_call, unless CPPFFI_NO_THUNKS is
+     * defined or the interface doesn't use the default ABI.
+     */
+    class dynamic_cif {
+    public:
+        friend class dispatch_table;
+        friend class dynamic_callable;
+        friend class dynamic_frame;
+
+        dynamic_cif(ffi_type& p_return,
+                    std::vector<ffi_type*> p_args,
+                    abi p_abi = FFI_DEFAULT_ABI);
+        dynamic_cif(ffi_type& p_return,
+                    std::initializer_list<ffi_type*> p_args,
+                    abi p_abi = FFI_DEFAULT_ABI);
+
+        // m_cif points into m_argtypes
+        dynamic_cif(const dynamic_cif&) = delete;
+        dynamic_cif& operator=(const dynamic_cif&) = delete;
+        dynamic_cif(dynamic_cif&&) = default;
+        dynamic_cif& operator=(dynamic_cif&&) = default;
+
+        /**
+         * Bind a function to the interface and produce a callable object
+         * \param fn Function to bind to
+         * \return   dynamic_callable
+         */
+        template <typename FunctionT>
+        dynamic_callable bind(FunctionT* fn) const;
+
+        size_t arg_count() const
+        {
+            return m_argtypes.size();
+        }
+        ffi_type& return_type() const
+        {
+            return *m_cif.rtype;
+        }
+        ffi_type& arg_type(size_t index) const
+        {
+            return *m_argtypes[index];
+        }
+
+        /// Offset of an argument from the start of the frame
+        size_t arg_offset(size_t index) const
+        {
+            return m_offsets[index];
+        }
+        /// Bytes needed for the arguments, return value and pointer array
+        size_t frame_size() const
+        {
+            return m_frame_size;
+        }
+        size_t frame_alignment() const
+        {
+            return m_frame_alignment;
+        }
+
+        const ffi_cif& native() const
+        {
+            return m_cif;
+        }
+
+        /// Whether calls bypass ffi_call through a precompiled thunk
+        bool has_thunk() const
+        {
+            return m_thunk != nullptr;
+        }
+
+    private:
+        void _layout();
+
+        std::vector<ffi_type*> m_argtypes;
+        std::vector<size_t> m_offsets{};
+        size_t m_return_offset{0};
+        size_t m_pointers_offset{0};
+        size_t m_frame_size{0};
+        size_t m_frame_alignment{1};
+        ffi_cif m_cif;
+        detail::thunk_fn m_thunk{nullptr};
+    };
+
+    /**
+     * Storage for one call through a dynamic_cif: the arguments, the return
+     * value and the argument pointer array, in one block.
+     * Frames that fit in CPPFFI_FRAME_INLINE_SIZE bytes live inside the
+     * object; larger ones are carved from a frame_arena. Frames are
+     * released in the reverse order of their creation, as they are when
+     * they live on the stack.
+     */
+    class dynamic_frame {
+    public:
+        /// Inline if the frame fits, otherwise from frame_arena::local()
+        explicit dynamic_frame(const dynamic_cif& p_cif);
+        /// Always from the given arena
+        dynamic_frame(const dynamic_cif& p_cif, frame_arena& arena);
+        ~dynamic_frame();
+
+        dynamic_frame(const dynamic_frame&) = delete;
+        dynamic_frame& operator=(const dynamic_frame&) = delete;
+
+        /**
+         * Copy an argument into its slot.
+         * Throws bad_argument_type if T isn't the argument type of the
+         * interface, or for types without a type<T>, isn't the same size
+         */
+        template <typename T>
+        void set(size_t index, const T& value);
+
+        void* arg(size_t index)
+        {
+            return m_storage + m_cif.arg_offset(index);
+        }
+        void* ret()
+        {
+            return m_storage + m_cif.m_return_offset;
+        }
+        void** args()
+        {
+            return reinterpret_cast<void**>(m_storage +
+                                            m_cif.m_pointers_offset);
+        }
+
+        /**
+         * Read the return value after the call.
+         * Throws bad_argument_type on a mismatch, as set() does
+         */
+        template <typename T>
+        T ret() const;
+
+        const dynamic_cif& interface() const
+        {
+            return m_cif;
+        }
+
+    private:
+        template <size_t Index>
+        void _set_all()
+        {
+        }
+        template <size_t Index, typename FirstArg, typename... Args>
+        void _set_all(const FirstArg& first, const Args&... args)
+        {
+            set(Index, first);
+            _set_all<Index + 1>(args...);
+        }
+
+        friend class dynamic_callable;
+
+        void _carve(frame_arena& arena);
+        void _fill();
+
+        const dynamic_cif& m_cif;
+        unsigned char* m_storage;
+        frame_arena* m_arena{nullptr};
+        frame_arena::mark m_mark{nullptr, 0};
+        alignas(std::max_align_t) unsigned char
+            m_inline[CPPFFI_FRAME_INLINE_SIZE];
+    };
+
+    /**
+     * A function bound to a dynamic_cif.
+     * Like callable, it only references the interface, which must outlive it
+     */
+    class dynamic_callable {
+    public:
+        dynamic_callable(const dynamic_cif& p_cif, void (*p_fn)())
+            : m_cif(&p_cif), m_fn(p_fn)
+        {
+        }
+
+        /// Call with the arguments already stored in the frame
+        void call(dynamic_frame& frame) const;
+
+        /// Call with a libffi-style return pointer and argument array
+        void call(void* ret, void** args) const;
+
+        /**
+         * Copy the arguments into a frame on the stack, call, and read the
+         * return value as ReturnT
+         */
+        template <typename ReturnT, typename... Args>
+        ReturnT invoke(const Args&... args) const;
+
+        const dynamic_cif& interface() const
+        {
+            return *m_cif;
+        }
+        void (*function() const)()
+        {
+            return m_fn;
+        }
+
+    private:
+        const dynamic_cif* m_cif;
+        void (*m_fn)();
+    };
+
+    namespace detail {
+        inline size_t align_up(size_t n, size_t alignment)
+        {
+            return (n + alignment - 1) / alignment * alignment;
+        }
+
+        /// Does type<T> describe T with a single ffi_type
+        template <typename T, typename = void>
+        struct has_ffitype : std::false_type {
+        };
+        template <typename T>
+        struct has_ffitype<T, decltype(void(type<T>::ffitype()))>
+            : std::true_type {
+        };
+
+        /**
+         * Do two ffi_types describe the same type.
+         * Types built separately, like a struct from a signature string and
+         * one from struct_type, compare equal if their members do
+         */
+        inline bool same_type(const ffi_type& a, const ffi_type& b)
+        {
+            if (&a == &b) {
+                return true;
+            }
+            auto kind = [](unsigned short t) {
+                return t == FFI_TYPE_INT ? FFI_TYPE_SINT32 : t;
+            };
+            if (kind(a.type) != kind(b.type) ||
+                (a.size && b.size && a.size != b.size)) {
+                return false;
+            }
+            if (!a.elements || !b.elements) {
+                return a.elements == b.elements;
+            }
+            auto ea = a.elements;
+            auto eb = b.elements;
+            for (; *ea && *eb; ++ea, ++eb) {
+                if (!same_type(**ea, **eb)) {
+                    return false;
+                }
+            }
+            return !*ea && !*eb;
+        }
+
+        /**
+         * Can a T be stored in or read from a value of type t.
+         * Types without an ffi_type of their own are only checked by size
+         */
+        template <typename T>
+        typename std::enable_if<has_ffitype<T>::value, bool>::type
+        matches_type(const ffi_type& t)
+        {
+            return same_type(t, type<T>::ffitype());
+        }
+        template <typename T>
+        typename std::enable_if<!has_ffitype<T>::value, bool>::type
+        matches_type(const ffi_type& t)
+        {
+            return t.size == sizeof(T);
+        }
+    }  // namespace detail
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmissing-field-initializers"
+    inline dynamic_cif::dynamic_cif(ffi_type& p_return,
+                                    std::vector<ffi_type*> p_args,
+                                    abi p_abi)
+        : m_argtypes(std::move(p_args)), m_cif{}
+    {
+        detail::check_status(ffi_prep_cif(
+            &m_cif, p_abi, static_cast<unsigned>(m_argtypes.size()),
+            &p_return, m_argtypes.empty() ? nullptr : &m_argtypes[0]));
+        _layout();
+
+#ifndef CPPFFI_NO_THUNKS
+        if (p_abi == FFI_DEFAULT_ABI) {
+            m_thunk = detail::find_thunk(p_return, m_argtypes);
+        }
+#endif
+    }
+#pragma GCC diagnostic pop
+
+    inline dynamic_cif::dynamic_cif(ffi_type& p_return,
+                                    std::initializer_list<ffi_type*> p_args,
+                                    abi p_abi)
+        : dynamic_cif(p_return, std::vector<ffi_type*>(p_args), p_abi)
+    {
+    }
+
+    inline void dynamic_cif::_layout()
+    {
+        // Sizes and alignments of structs are only known after ffi_prep_cif
+        size_t offset = 0;
+        m_offsets.reserve(m_argtypes.size());
+        for (auto t : m_argtypes) {
+            const size_t alignment = t->alignment ? t->alignment : 1;
+            offset = detail::align_up(offset, alignment);
+            m_offsets.push_back(offset);
+            offset += t->size;
+            if (alignment > m_frame_alignment) {
+                m_frame_alignment = alignment;
+            }
+        }
+
+        // libffi writes at least a full register for the return value
+        const auto rtype = m_cif.rtype;
+        const size_t ret_alignment = rtype->alignment > alignof(ffi_arg)
+                                         ? rtype->alignment
+                                         : alignof(ffi_arg);
+        const size_t ret_size =
+            rtype->size > sizeof(ffi_arg) ? rtype->size : sizeof(ffi_arg);
+        m_return_offset = detail::align_up(offset, ret_alignment);
+        offset = m_return_offset + ret_size;
+        if (ret_alignment > m_frame_alignment) {
+            m_frame_alignment = ret_alignment;
+        }
+
+        m_pointers_offset = detail::align_up(offset, alignof(void*));
+        m_frame_size = m_pointers_offset + sizeof(void*) * m_argtypes.size();
+        if (alignof(void*) > m_frame_alignment) {
+            m_frame_alignment = alignof(void*);
+        }
+    }
+
+    template <typename FunctionT>
+    inline dynamic_callable dynamic_cif::bind(FunctionT* fn) const
+    {
+        static_assert(std::is_function<FunctionT>::value,
+                      "dynamic_cif::bind expects a function pointer");
+        return dynamic_callable(*this, CPPFFI_FN(fn));
+    }
+
+    inline dynamic_frame::dynamic_frame(const dynamic_cif& p_cif)
+        : m_cif(p_cif), m_storage(m_inline)
+    {
+        if (m_cif.frame_size() > sizeof(m_inline) ||
+            m_cif.frame_alignment() > alignof(std::max_align_t)) {
+            _carve(frame_arena::local());
+        }
+        _fill();
+    }
+
+    inline dynamic_frame::dynamic_frame(const dynamic_cif& p_cif,
+                                        frame_arena& arena)
+        : m_cif(p_cif), m_storage(m_inline)
+    {
+        _carve(arena);
+        _fill();
+    }
+
+    inline dynamic_frame::~dynamic_frame()
+    {
+        if (m_arena) {
+            m_arena->rewind(m_mark);
+        }
+    }
+
+    inline void dynamic_frame::_carve(frame_arena& arena)
+    {
+        m_mark = arena.position();
+        m_storage = static_cast<unsigned char*>(
+            arena.allocate(m_cif.frame_size(), m_cif.frame_alignment()));
+        m_arena = &arena;
+    }
+
+    inline void dynamic_frame::_fill()
+    {
+        auto ptrs = args();
+        for (size_t i = 0; i < m_cif.arg_count(); ++i) {
+            ptrs[i] = arg(i);
+        }
+    }
+
+    template <typename T>
+    inline void dynamic_frame::set(size_t index, const T& value)
+    {
+        if (index >= m_cif.arg_count()) {
+            CPPFFI_THROW(bad_argument_count());
+        }
+        if (!detail::matches_type<T>(m_cif.arg_type(index))) {
+            CPPFFI_THROW(bad_argument_type());
+        }
+        std::memcpy(arg(index), std::addressof(value), sizeof(T));
+    }
+
+    template <typename T>
+    inline T dynamic_frame::ret() const
+    {
+        if (!detail::matches_type<T>(*m_cif.m_cif.rtype)) {
+            CPPFFI_THROW(bad_argument_type());
+        }
+        return detail::read_return<T>(m_storage + m_cif.m_return_offset);
+    }
+    template <>
+    inline void dynamic_frame::ret<void>() const
+    {
+    }
+
+    inline void dynamic_callable::call(dynamic_frame& frame) const
+    {
+        call(frame.ret(), frame.args());
+    }
+
+    inline void dynamic_callable::call(void* ret, void** args) const
+    {
+        // ffi_call doesn't modify the interface
+        auto& c = const_cast<ffi_cif&>(m_cif->m_cif);
+        if (m_cif->m_thunk) {
+#ifdef CPPFFI_INSTRUMENTATION
+            detail::call_probe probe(c, m_fn, ret, args);
+#endif
+            m_cif->m_thunk(m_fn, ret, args);
+            return;
+        }
+        detail::invoke(c, m_fn, ret, args);
+    }
+
+    template <typename ReturnT, typename... Args>
+    inline ReturnT dynamic_callable::invoke(const Args&... args) const
+    {
+        if (sizeof...(Args) != m_cif->arg_count()) {
+            CPPFFI_THROW(bad_argument_count());
+        }
+        dynamic_frame frame(*m_cif);
+        frame._set_all<0>(args...);
+        call(frame);
+        return frame.ret<ReturnT>();
+    }
+}  // namespace ffi
+
+#include "cppffi_end.h"
+
+#endif
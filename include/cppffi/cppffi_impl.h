@@ -27,26 +27,114 @@
 #include "cppffi_begin.h"
 
 namespace ffi {
+    namespace detail {
+        template <typename Entry>
+        class cif_cache {
+        public:
+            static Entry& get(abi p_abi)
+            {
+                if (p_abi <= FFI_FIRST_ABI || p_abi >= FFI_LAST_ABI) {
+                    CPPFFI_THROW(bad_abi());
+                }
+
+                // Zero-initialized at load time, no guard needed
+                static std::atomic<Entry*> slots[FFI_LAST_ABI];
+
+                auto& slot = slots[static_cast<size_t>(p_abi)];
+                auto entry = slot.load(std::memory_order_acquire);
+                if (entry) {
+                    return *entry;
+                }
+                return _insert(slot, p_abi);
+            }
+
+        private:
+            static Entry& _insert(std::atomic<Entry*>& slot, abi p_abi)
+            {
+                // Racing threads may both prepare an entry; the loser throws
+                // its copy away. The winner is never freed.
+                std::unique_ptr<Entry> fresh(new Entry(p_abi, prepare_tag{}));
+                Entry* expected = nullptr;
+                if (slot.compare_exchange_strong(expected, fresh.get(),
+                                                 std::memory_order_acq_rel,
+                                                 std::memory_order_acquire)) {
+                    return *fresh.release();
+                }
+                return *expected;
+            }
+        };
+
+        inline void check_batch(std::size_t rows,
+                                std::initializer_list<std::size_t> sizes)
+        {
+            for (auto size : sizes) {
+                if (size < rows) {
+                    CPPFFI_THROW(bad_batch_size());
+                }
+            }
+        }
+
+        template <typename ReturnT, size_t N>
+        inline void call_rows(ffi_cif& c,
+                              void (*fn)(),
+                              typename batch_output<ReturnT>::type out,
+                              std::size_t rows,
+                              std::array<void*, N>& args,
+                              const std::array<std::size_t, N>& strides)
+        {
+            using output = batch_output<ReturnT>;
+
+            // Scratch space for returns libffi widens
+            ffi_arg tmp = 0;
+            for (std::size_t row = 0; row != rows; ++row) {
+                invoke(c, fn, output::at(out, row, &tmp), args.data());
+                output::store(out, row, &tmp);
+                for (std::size_t i = 0; i != N; ++i) {
+                    args[i] = static_cast<char*>(args[i]) + strides[i];
+                }
+            }
+        }
+    }  // namespace detail
+
+    template <typename Signature>
+    inline cif<Signature>& shared_cif(abi p_abi)
+    {
+        return detail::cif_cache<cif<Signature>>::get(p_abi);
+    }
+
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wmissing-field-initializers"
     template <typename ReturnT, typename... ArgsT>
     inline cif<ReturnT(ArgsT...)>::cif(abi p_abi)
         : m_cif{}, m_argtypes{{nullptr}}
     {
-        constexpr const size_t arg_count = sizeof...(ArgsT);
-        _expand_argument_list<0, ArgsT...>();
-        const auto status =
-            ffi_prep_cif(&m_cif, p_abi, arg_count, &type<ReturnT>::ffitype(),
-                         &m_argtypes[0]);
-        if (status == FFI_BAD_TYPEDEF) {
-            CPPFFI_THROW(bad_typedef());
-        }
-        if (status == FFI_BAD_ABI) {
-            CPPFFI_THROW(bad_abi());
-        }
+#ifdef CPPFFI_NO_CIF_CACHE
+        _prepare(p_abi);
+#else
+        // arg_types keeps pointing into the cached entry, so copies of this
+        // object stay valid
+        m_cif = detail::cif_cache<cif>::get(p_abi).m_cif;
+#endif
+    }
+
+    template <typename ReturnT, typename... ArgsT>
+    inline cif<ReturnT(ArgsT...)>::cif(abi p_abi, detail::prepare_tag)
+        : m_cif{}, m_argtypes{{nullptr}}
+    {
+        _prepare(p_abi);
     }
 #pragma GCC diagnostic pop
 
+    template <typename ReturnT, typename... ArgsT>
+    inline void cif<ReturnT(ArgsT...)>::_prepare(abi p_abi)
+    {
+        constexpr const size_t arg_count = detail::param_total<ArgsT...>::value;
+        _expand_argument_list<0, ArgsT...>();
+        detail::check_status(ffi_prep_cif(&m_cif, p_abi, arg_count,
+                                          &type<ReturnT>::ffitype(),
+                                          &m_argtypes[0]));
+    }
+
     template <typename ReturnT, typename... ArgsT>
     template <typename Callable>
     inline callable<ReturnT(ArgsT...)> cif<ReturnT(ArgsT...)>::bind(
@@ -64,21 +152,32 @@ namespace ffi {
     template <size_t Index, typename FirstArg, typename... Args>
     inline void cif<ReturnT(ArgsT...)>::_expand_argument_list()
     {
-        m_argtypes[Index] = &type<FirstArg>::ffitype();
-        _expand_argument_list<Index + 1, Args...>();
+        detail::param<FirstArg>::types(&m_argtypes[Index]);
+        _expand_argument_list<Index + detail::param<FirstArg>::count,
+                              Args...>();
     }
 
     template <typename ReturnT>
-    inline cif<ReturnT()>::cif(abi p_abi)
+    inline cif<ReturnT()>::cif(abi p_abi) : m_cif{}
     {
-        const auto status =
-            ffi_prep_cif(&m_cif, p_abi, 0, &type<ReturnT>::ffitype(), nullptr);
-        if (status == FFI_BAD_TYPEDEF) {
-            CPPFFI_THROW(bad_typedef());
-        }
-        if (status == FFI_BAD_ABI) {
-            CPPFFI_THROW(bad_abi());
-        }
+#ifdef CPPFFI_NO_CIF_CACHE
+        _prepare(p_abi);
+#else
+        m_cif = detail::cif_cache<cif>::get(p_abi).m_cif;
+#endif
+    }
+
+    template <typename ReturnT>
+    inline cif<ReturnT()>::cif(abi p_abi, detail::prepare_tag) : m_cif{}
+    {
+        _prepare(p_abi);
+    }
+
+    template <typename ReturnT>
+    inline void cif<ReturnT()>::_prepare(abi p_abi)
+    {
+        detail::check_status(ffi_prep_cif(&m_cif, p_abi, 0,
+                                          &type<ReturnT>::ffitype(), nullptr));
     }
 
     template <typename ReturnT>
@@ -90,17 +189,11 @@ namespace ffi {
 
     template <typename ReturnT, typename... ArgsT>
     inline callable<ReturnT(ArgsT...)>::callable(cif<ReturnT(ArgsT...)>& p_cif,
-                                                 callable_type& p_callable)
+                                                 native_type& p_callable)
         : m_callable(p_callable), m_cif(p_cif)
     {
     }
 
-    template <size_t Index, typename Tuple>
-    inline void* _get_tuple_elem_address(Tuple& t)
-    {
-        return static_cast<void*>(std::addressof(std::get<Index>(t)));
-    }
-
     template <typename ReturnT, typename... ArgsT>
     template <typename... Args>
     inline call_context<ReturnT(ArgsT...)> callable<ReturnT(ArgsT...)>::call(
@@ -114,28 +207,122 @@ namespace ffi {
     template <typename... Args>
     inline ReturnT callable<ReturnT(ArgsT...)>::operator()(Args&&... args) const
     {
-        return call(std::forward<Args>(args)...).ret_move();
+#if defined(CPPFFI_DIRECT_DISPATCH) && !defined(CPPFFI_INSTRUMENTATION)
+        if (m_cif.m_cif.abi == FFI_DEFAULT_ABI) {
+            return direct(std::forward<Args>(args)...);
+        }
+#endif
+        return detail::call_return<ReturnT>::release(
+            call(std::forward<Args>(args)...).ret_move());
+    }
+
+    template <typename ReturnT, typename... ArgsT>
+    template <typename... Args>
+    inline ReturnT callable<ReturnT(ArgsT...)>::direct(Args&&... args) const
+    {
+        return _direct(expands{}, std::forward<Args>(args)...);
+    }
+
+    template <typename ReturnT, typename... ArgsT>
+    template <typename... Args>
+    inline ReturnT callable<ReturnT(ArgsT...)>::_direct(std::false_type,
+                                                        Args&&... args) const
+    {
+        return m_callable(std::forward<Args>(args)...);
+    }
+
+    template <typename ReturnT, typename... ArgsT>
+    inline ReturnT callable<ReturnT(ArgsT...)>::_direct(
+        std::true_type,
+        const ArgsT&... args) const
+    {
+        using native_args =
+            detail::make_index_sequence<detail::param_total<ArgsT...>::value>;
+        return _direct_native(
+            std::tuple_cat(detail::param<ArgsT>::unpack(args)...),
+            native_args{});
     }
 
     template <typename ReturnT, typename... ArgsT>
-    template <size_t Index, typename ArgPack, typename Arg>
-    inline void callable<ReturnT(ArgsT...)>::_fill_arg_vec(ArgPack& vec,
-                                                           Arg arg) const
+    template <typename Tuple, size_t... I>
+    inline ReturnT callable<ReturnT(ArgsT...)>::_direct_native(
+        const Tuple& args,
+        detail::index_sequence<I...>) const
     {
-        vec[Index] = static_cast<void*>(arg);
-        return;
+        return m_callable(std::get<I>(args)...);
     }
+
+    template <typename ReturnT, typename... ArgsT>
+    template <typename OutT, typename... Args>
+    inline void callable<ReturnT(ArgsT...)>::call_into(OutT& out,
+                                                       Args&&... args) const
+    {
+        static_assert(std::is_same<OutT, ReturnT>::value,
+                      "call_into needs storage of the exact return type");
+        _call_into(out, std::forward<Args>(args)...);
+    }
+
+    template <typename ReturnT, typename... ArgsT>
+    template <typename... Args>
+    inline ReturnT callable<ReturnT(ArgsT...)>::call_raw(Args&&... args) const
+    {
+        return _call_raw(std::forward<Args>(args)...);
+    }
+
+    template <typename ReturnT, typename... ArgsT>
+    inline ReturnT callable<ReturnT(ArgsT...)>::_call_raw(
+        const ArgsT&... args) const
+    {
+        typename detail::call_return<ReturnT>::type ret{};
+#if defined(FFI_NO_RAW_API) && FFI_NO_RAW_API
+        _call_into(ret, args...);
+#else
+        std::array<ffi_raw, detail::raw_slots<ArgsT...>::value> raw;
+        size_t slot = 0;
+        using expand = int[];
+        (void)expand{0, (detail::raw_arg<ArgsT>::pack(&raw[slot], args),
+                         slot += detail::raw_arg<ArgsT>::slots, 0)...};
+
+        auto& c = m_cif.m_cif;
+        auto fn = CPPFFI_FN(m_callable);
+        detail::return_slot<ReturnT>::into(ret, [&](void* storage) {
+            detail::invoke_raw(c, fn, storage, raw.data());
+        });
+#endif
+        return detail::call_return<ReturnT>::release(std::move(ret));
+    }
+
     template <typename ReturnT, typename... ArgsT>
-    template <size_t Index,
-              typename ArgPack,
-              typename FirstArg,
-              typename... Args>
-    inline void callable<ReturnT(ArgsT...)>::_fill_arg_vec(ArgPack& vec,
-                                                           FirstArg first_arg,
-                                                           Args... args) const
+    inline void callable<ReturnT(ArgsT...)>::_call_into(
+        typename detail::call_return<ReturnT>::type& out,
+        const ArgsT&... args) const
     {
-        vec[Index] = static_cast<void*>(first_arg);
-        _fill_arg_vec<Index + 1>(vec, std::addressof(args)...);
+        std::array<void*, detail::param_total<ArgsT...>::value> arg_ptrs;
+        size_t i = 0;
+        using expand = int[];
+        (void)expand{0, (detail::param<ArgsT>::addresses(args, &arg_ptrs[i]),
+                         i += detail::param<ArgsT>::count, 0)...};
+        detail::return_slot<ReturnT>::call(m_cif.m_cif, CPPFFI_FN(m_callable),
+                                           out, arg_ptrs.data());
+    }
+
+    template <typename ReturnT, typename... ArgsT>
+    inline void callable<ReturnT(ArgsT...)>::call_batch(
+        typename detail::batch_output<ReturnT>::type out,
+        span<const ArgsT>... columns) const
+    {
+        const auto rows = detail::batch_output<ReturnT>::rows(out);
+        detail::check_batch(rows, {columns.size()...});
+        if (rows == 0) {
+            return;
+        }
+
+        constexpr auto arity = detail::param_total<ArgsT...>::value;
+        std::array<void*, arity> args;
+        std::array<std::size_t, arity> strides;
+        detail::batch_arguments(args, strides, columns...);
+        detail::call_rows<ReturnT>(m_cif.m_cif, CPPFFI_FN(m_callable), out,
+                                   rows, args, strides);
     }
 
     template <typename ReturnT>
@@ -154,25 +341,70 @@ namespace ffi {
     template <typename ReturnT>
     inline ReturnT callable<ReturnT()>::operator()() const
     {
-        return call().ret_move();
+#if defined(CPPFFI_DIRECT_DISPATCH) && !defined(CPPFFI_INSTRUMENTATION)
+        if (m_cif.m_cif.abi == FFI_DEFAULT_ABI) {
+            return direct();
+        }
+#endif
+        return detail::call_return<ReturnT>::release(call().ret_move());
+    }
+
+    template <typename ReturnT>
+    inline ReturnT callable<ReturnT()>::direct() const
+    {
+        return m_callable();
+    }
+
+    template <typename ReturnT>
+    template <typename OutT>
+    inline void callable<ReturnT()>::call_into(OutT& out) const
+    {
+        static_assert(std::is_same<OutT, ReturnT>::value,
+                      "call_into needs storage of the exact return type");
+        _call_into(out);
+    }
+
+    template <typename ReturnT>
+    inline void callable<ReturnT()>::_call_into(
+        typename detail::call_return<ReturnT>::type& out) const
+    {
+        detail::return_slot<ReturnT>::call(m_cif.m_cif, CPPFFI_FN(m_callable),
+                                           out, nullptr);
+    }
+
+    template <typename ReturnT>
+    inline ReturnT callable<ReturnT()>::call_raw() const
+    {
+        typename detail::call_return<ReturnT>::type ret{};
+#if defined(FFI_NO_RAW_API) && FFI_NO_RAW_API
+        _call_into(ret);
+#else
+        auto& c = m_cif.m_cif;
+        auto fn = CPPFFI_FN(m_callable);
+        detail::return_slot<ReturnT>::into(ret, [&](void* storage) {
+            detail::invoke_raw(c, fn, storage, nullptr);
+        });
+#endif
+        return detail::call_return<ReturnT>::release(std::move(ret));
+    }
+
+    template <typename ReturnT>
+    inline void callable<ReturnT()>::call_batch(
+        typename detail::batch_output<ReturnT>::type out) const
+    {
+        std::array<void*, 0> args{};
+        detail::call_rows<ReturnT>(m_cif.m_cif, CPPFFI_FN(m_callable), out,
+                                   detail::batch_output<ReturnT>::rows(out),
+                                   args, {});
     }
 
     template <typename ReturnT, typename... ArgsT>
     call_context<ReturnT(ArgsT...)>::call_context(
         const callable<ReturnT(ArgsT...)>& p_callable,
-        ArgsT&&... args)
-        : m_args{}, m_callable(p_callable), m_return{}
+        const ArgsT&... args)
+        : m_callable(p_callable), m_return{}
     {
-        _expand_argument_list<0>(std::forward<ArgsT>(args)...);
-
-        std::array<void*, sizeof...(ArgsT)> arg_ptrs;
-        _get_argument_addresses<0>(arg_ptrs);
-
-        typename type<ReturnT>::arg_type retval;
-        ffi_call(&p_callable.m_cif.m_cif, CPPFFI_FN(p_callable.m_callable),
-                 &retval, &arg_ptrs[0]);
-        m_return =
-            detail::call_return<ReturnT>::access(static_cast<ReturnT>(retval));
+        p_callable._call_into(m_return, args...);
     }
 
     template <typename ReturnT, typename... ArgsT>
@@ -201,34 +433,13 @@ namespace ffi {
         return std::move(m_return);
     }
 
-    template <typename ReturnT, typename... ArgsT>
-    template <size_t Index, typename Arg>
-    void call_context<ReturnT(ArgsT...)>::_expand_argument_list(Arg&& arg)
-    {
-        // m_args[Index] = unique_void(new Arg(arg));
-        /* m_args.push_back(unique_void(new Arg(arg))); */
-        std::get<Index>(m_args) = std::forward<Arg>(arg);
-    }
-    template <typename ReturnT, typename... ArgsT>
-    template <size_t Index, typename FirstArg, typename... Args>
-    void call_context<ReturnT(ArgsT...)>::_expand_argument_list(FirstArg&& arg,
-                                                                Args&&... args)
-    {
-        // m_args[Index] = unique_void(new FirstArg(arg));
-        /* m_args.push_back(unique_void(new FirstArg(arg))); */
-        std::get<Index>(m_args) = std::forward<FirstArg>(arg);
-        _expand_argument_list<Index + 1>(std::forward<Args>(args)...);
-    }
-
     template <typename ReturnT>
     call_context<ReturnT()>::call_context(const callable<ReturnT()>& p_callable)
-        : m_callable(p_callable)
+        : m_callable(p_callable), m_return{}
     {
-        typename type<ReturnT>::arg_type retval;
-        ffi_call(&p_callable.m_cif.m_cif, CPPFFI_FN(p_callable.m_callable),
-                 &retval, nullptr);
-        m_return =
-            detail::call_return<ReturnT>::access(static_cast<ReturnT>(retval));
+        detail::return_slot<ReturnT>::call(p_callable.m_cif.m_cif,
+                                           CPPFFI_FN(p_callable.m_callable),
+                                           m_return, nullptr);
     }
 
     template <typename ReturnT>
@@ -257,11 +468,11 @@ namespace ffi {
         return std::move(m_return);
     }
 
-    template <typename ReturnT, typename... ArgsT>
-    inline ReturnT call(ReturnT (&func)(ArgsT...), ArgsT&&... args)
+    template <typename ReturnT, typename... ArgsT, typename... Args>
+    inline ReturnT call(ReturnT (&func)(ArgsT...), Args&&... args)
     {
         cif<ReturnT(ArgsT...)> c;
-        return c.bind(func).call(std::forward<ArgsT>(args)...).ret();
+        return c.bind(func).call(std::forward<Args>(args)...).ret();
     }
 }  // namespace ffi
 
@@ -0,0 +1,672 @@
+// Copyright 2017 Elias Kosunen
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef CPPFFI_INSTRUMENT_H
+#define CPPFFI_INSTRUMENT_H
+
+#include "ffi.h"
+#include <string>
+
+#ifdef CPPFFI_INSTRUMENTATION
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#endif
+
+#include "cppffi_begin.h"
+
+namespace ffi {
+    /**
+     * Human-readable name of a type, e.g. "sint32" or "{double, pointer}"
+     */
+    inline std::string describe(const ffi_type& t)
+    {
+        switch (t.type) {
+            case FFI_TYPE_VOID:
+                return "void";
+            case FFI_TYPE_INT:
+                return "int";
+            case FFI_TYPE_FLOAT:
+                return "float";
+            case FFI_TYPE_DOUBLE:
+                return "double";
+#if FFI_TYPE_LONGDOUBLE != FFI_TYPE_DOUBLE
+            case FFI_TYPE_LONGDOUBLE:
+                return "longdouble";
+#endif
+            case FFI_TYPE_UINT8:
+                return "uint8";
+            case FFI_TYPE_SINT8:
+                return "sint8";
+            case FFI_TYPE_UINT16:
+                return "uint16";
+            case FFI_TYPE_SINT16:
+                return "sint16";
+            case FFI_TYPE_UINT32:
+                return "uint32";
+            case FFI_TYPE_SINT32:
+                return "sint32";
+            case FFI_TYPE_UINT64:
+                return "uint64";
+            case FFI_TYPE_SINT64:
+                return "sint64";
+            case FFI_TYPE_POINTER:
+                return "pointer";
+            case FFI_TYPE_STRUCT: {
+                std::string name = "{";
+                for (auto e = t.elements; e && *e; ++e) {
+                    if (e != t.elements) {
+                        name += ", ";
+                    }
+                    name += describe(**e);
+                }
+                return name + "}";
+            }
+#ifdef FFI_TARGET_HAS_COMPLEX_TYPE
+            case FFI_TYPE_COMPLEX:
+                return "complex<" + describe(**t.elements) + ">";
+#endif
+            default:
+                return "?";
+        }
+    }
+
+    /**
+     * Human-readable signature of an interface, e.g. "double(sint32, float)"
+     */
+    inline std::string describe(const ffi_cif& c)
+    {
+        std::string name = describe(*c.rtype) + "(";
+        for (unsigned i = 0; i < c.nargs; ++i) {
+            if (i != 0) {
+                name += ", ";
+            }
+            name += describe(*c.arg_types[i]);
+        }
+        return name + ")";
+    }
+
+#ifdef CPPFFI_INSTRUMENTATION
+    /**
+     * A call as seen by the instrumentation hooks.
+     * The pre-call hook sees ret before it has been written, and ns as 0.
+     * args is null for calls through the raw API
+     */
+    struct call_info {
+        const ffi_cif* cif;
+        void (*fn)();
+        void* ret;
+        void* const* args;
+        std::uint64_t ns;
+    };
+
+    using call_hook = void (*)(const call_info&, void* context);
+
+    /**
+     * Totals for one function called through one signature.
+     * cif is one of the interfaces the calls went through; it may have been
+     * destroyed since
+     */
+    struct call_stats {
+        /// Number of latency buckets: bucket i counts calls that took
+        /// [2^i, 2^(i + 1)) nanoseconds, the last one everything slower
+        static constexpr std::size_t buckets = 40;
+
+        const ffi_cif* cif;
+        void (*fn)();
+        std::string signature;
+        std::uint64_t calls;
+        std::uint64_t total_ns;
+        std::array<std::uint64_t, buckets> histogram;
+
+        /**
+         * Latency below which the given fraction of calls completed,
+         * rounded up to a bucket boundary
+         * \param q Fraction in [0, 1]
+         */
+        std::uint64_t percentile_ns(double q) const
+        {
+            const auto target = static_cast<std::uint64_t>(
+                q * static_cast<double>(calls) + 0.5);
+            std::uint64_t seen = 0;
+            for (std::size_t i = 0; i < buckets; ++i) {
+                seen += histogram[i];
+                if (seen >= target) {
+                    return std::uint64_t{2} << i;
+                }
+            }
+            return std::uint64_t{2} << (buckets - 1);
+        }
+    };
+
+    namespace detail {
+        /**
+         * A function and the interface it's called through, as seen by one
+         * thread. Interfaces are told apart by their types rather than by
+         * the address of the ffi_cif: typed cifs are copies of a cached
+         * one, often on the stack, but share its arg_types array, and so do
+         * the interfaces from signature()
+         */
+        struct site_key {
+            const ffi_type* rtype;
+            ffi_type* const* arg_types;
+            unsigned nargs;
+            ffi_abi abi;
+            void (*fn)();
+
+            static site_key of(const ffi_cif& c, void (*fn)())
+            {
+                return {c.rtype, c.arg_types, c.nargs, c.abi, fn};
+            }
+
+            bool operator==(const site_key& o) const
+            {
+                return fn == o.fn && arg_types == o.arg_types &&
+                       rtype == o.rtype && nargs == o.nargs && abi == o.abi;
+            }
+        };
+
+        struct site_hash {
+            std::size_t operator()(const site_key& k) const noexcept
+            {
+                return (std::hash<const void*>{}(k.arg_types) * 31 ^
+                        std::hash<const void*>{}(k.rtype)) *
+                           31 ^
+                       std::hash<void (*)()>{}(k.fn);
+            }
+        };
+
+        /**
+         * What snapshot() merges sites by, so interfaces with the same
+         * signature but separate type arrays, e.g. with
+         * CPPFFI_NO_CIF_CACHE, still end up in one entry
+         */
+        struct site_name {
+            void (*fn)();
+            std::string signature;
+
+            bool operator<(const site_name& o) const
+            {
+                if (fn != o.fn) {
+                    return std::less<void (*)()>{}(fn, o.fn);
+                }
+                return signature < o.signature;
+            }
+        };
+
+        /**
+         * Counters for one site on one thread. Only the owning thread
+         * writes them, so updates are plain loads and stores; snapshots
+         * read them from other threads
+         */
+        struct site_counters {
+            site_counters(const ffi_cif* p_cif, std::string p_signature)
+                : cif(p_cif), signature(std::move(p_signature))
+            {
+            }
+
+            site_counters(const site_counters&) = delete;
+            site_counters& operator=(const site_counters&) = delete;
+
+            // Taken when the site is first seen, while the cif still exists
+            const ffi_cif* const cif;
+            const std::string signature;
+            std::atomic<std::uint64_t> calls{0};
+            std::atomic<std::uint64_t> total_ns{0};
+            std::array<std::atomic<std::uint64_t>, call_stats::buckets>
+                histogram{};
+
+            static std::size_t bucket(std::uint64_t ns)
+            {
+                std::size_t b = 0;
+                while (ns > 1 && b + 1 < call_stats::buckets) {
+                    ns >>= 1;
+                    ++b;
+                }
+                return b;
+            }
+
+            void add(std::uint64_t ns)
+            {
+                _bump(calls, 1);
+                _bump(total_ns, ns);
+                _bump(histogram[bucket(ns)], 1);
+            }
+
+        private:
+            static void _bump(std::atomic<std::uint64_t>& c, std::uint64_t n)
+            {
+                c.store(c.load(std::memory_order_relaxed) + n,
+                        std::memory_order_relaxed);
+            }
+        };
+
+        /**
+         * The sites one thread has called. The owner looks sites up without
+         * locking; it only locks to insert, which is when a snapshot could
+         * otherwise be walking the map
+         */
+        class instrument_shard {
+        public:
+            using map_type = std::unordered_map<site_key,
+                                                std::unique_ptr<site_counters>,
+                                                site_hash>;
+
+            site_counters& site(const ffi_cif& c, void (*fn)())
+            {
+                return site(site_key::of(c, fn), &c,
+                            [&] { return describe(c); });
+            }
+
+            /// \param name Makes the signature, if the site is new
+            template <typename Name>
+            site_counters& site(const site_key& key,
+                                const ffi_cif* c,
+                                Name&& name)
+            {
+                if (m_last && m_last_key == key) {
+                    return *m_last;
+                }
+                auto it = m_sites.find(key);
+                if (it == m_sites.end()) {
+                    std::lock_guard<std::mutex> lock(m_lock);
+                    it = m_sites
+                             .emplace(key, std::unique_ptr<site_counters>(
+                                               new site_counters(c, name())))
+                             .first;
+                }
+                m_last_key = key;
+                m_last = it->second.get();
+                return *m_last;
+            }
+
+            template <typename F>
+            void for_each(F&& f)
+            {
+                std::lock_guard<std::mutex> lock(m_lock);
+                for (auto& s : m_sites) {
+                    f(s.first, *s.second);
+                }
+            }
+
+            void clear()
+            {
+                std::lock_guard<std::mutex> lock(m_lock);
+                for (auto& s : m_sites) {
+                    auto& c = *s.second;
+                    c.calls.store(0, std::memory_order_relaxed);
+                    c.total_ns.store(0, std::memory_order_relaxed);
+                    for (auto& h : c.histogram) {
+                        h.store(0, std::memory_order_relaxed);
+                    }
+                }
+            }
+
+        private:
+            std::mutex m_lock{};
+            map_type m_sites{};
+            site_key m_last_key{nullptr, nullptr, 0, FFI_DEFAULT_ABI,
+                                nullptr};
+            site_counters* m_last{nullptr};
+        };
+
+        struct instrument_hooks {
+            call_hook pre;
+            call_hook post;
+            void* context;
+
+            bool operator==(const instrument_hooks& o) const
+            {
+                return pre == o.pre && post == o.post && context == o.context;
+            }
+        };
+
+        /**
+         * A set of hooks as installed. Calls count themselves in active
+         * for as long as they use the set, so a set that is no longer
+         * installed can be rewritten once it drops to zero
+         */
+        struct hook_slot {
+            instrument_hooks hooks{nullptr, nullptr, nullptr};
+            std::atomic<std::size_t> active{0};
+        };
+
+        class call_probe;
+    }  // namespace detail
+
+    /**
+     * Process-wide call statistics and hooks.
+     * Available when CPPFFI_INSTRUMENTATION is defined. Every call made
+     * through cppffi is then timed and counted per interface and function,
+     * in counters private to the calling thread.
+     */
+    class instrumentation {
+    public:
+        instrumentation(const instrumentation&) = delete;
+        instrumentation& operator=(const instrumentation&) = delete;
+
+        /**
+         * The process-wide instance.
+         * Never destroyed: threads that outlive it at exit, like the
+         * workers of thread_pool::global(), still retire their counters
+         * into it
+         */
+        static instrumentation& global()
+        {
+            static auto inst = new instrumentation;
+            return *inst;
+        }
+
+        /**
+         * Install hooks called before and after every call.
+         * Either may be null. Hooks run on the calling thread and must not
+         * throw. Calls already in flight finish with the hooks they
+         * started with.
+         *
+         * Every installed set is kept, but one no call is using anymore
+         * is reused by the next set_hooks(), and installing the same set
+         * again reuses it. The number kept is therefore bounded by the
+         * number of sets in use at the same time.
+         * \param context Passed to both hooks
+         */
+        void set_hooks(call_hook pre, call_hook post, void* context)
+        {
+            const detail::instrument_hooks hooks{pre, post, context};
+            std::lock_guard<std::mutex> lock(m_lock);
+            if (!pre && !post) {
+                m_hooks.store(nullptr);
+                return;
+            }
+            const auto current = m_hooks.load();
+            detail::hook_slot* idle = nullptr;
+            for (auto& s : m_hook_slots) {
+                if (s->hooks == hooks) {
+                    m_hooks.store(s.get());
+                    return;
+                }
+                if (!idle && s.get() != current && s->active.load() == 0) {
+                    idle = s.get();
+                }
+            }
+            if (!idle) {
+                m_hook_slots.emplace_back(new detail::hook_slot{});
+                idle = m_hook_slots.back().get();
+            }
+            // A call that loaded this slot before it was retired checks
+            // again that it's installed before reading it
+            idle->hooks = hooks;
+            m_hooks.store(idle);
+        }
+
+        /// The installed hooks, all null if there are none
+        detail::instrument_hooks hooks() const
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            const auto slot = m_hooks.load();
+            return slot ? slot->hooks
+                        : detail::instrument_hooks{nullptr, nullptr, nullptr};
+        }
+
+        /**
+         * Totals of every thread, live and exited, one entry per signature
+         * and function, most called first
+         */
+        std::vector<call_stats> snapshot()
+        {
+            std::map<detail::site_name, call_stats> merged;
+            auto add = [&](const detail::site_key& key,
+                           const detail::site_counters& c) {
+                detail::site_name name{key.fn, c.signature};
+                auto it = merged.find(name);
+                if (it == merged.end()) {
+                    it = merged
+                             .emplace(std::move(name),
+                                      call_stats{c.cif, key.fn, c.signature,
+                                                 0, 0, {}})
+                             .first;
+                }
+                auto& s = it->second;
+                s.calls += c.calls.load(std::memory_order_relaxed);
+                s.total_ns += c.total_ns.load(std::memory_order_relaxed);
+                for (std::size_t i = 0; i < call_stats::buckets; ++i) {
+                    s.histogram[i] +=
+                        c.histogram[i].load(std::memory_order_relaxed);
+                }
+            };
+
+            std::lock_guard<std::mutex> lock(m_lock);
+            for (auto shard : m_shards) {
+                shard->for_each(add);
+            }
+            m_retired.for_each(add);
+
+            std::vector<call_stats> stats;
+            stats.reserve(merged.size());
+            for (auto& s : merged) {
+                if (s.second.calls != 0) {
+                    stats.push_back(std::move(s.second));
+                }
+            }
+            std::stable_sort(stats.begin(), stats.end(),
+                             [](const call_stats& a, const call_stats& b) {
+                                 return a.calls > b.calls;
+                             });
+            return stats;
+        }
+
+        /**
+         * Zero every counter. Calls in flight on other threads may still
+         * be counted afterwards
+         */
+        void reset()
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            for (auto shard : m_shards) {
+                shard->clear();
+            }
+            m_retired.clear();
+        }
+
+        /// Record a finished call made on this thread
+        void record(const call_info& info)
+        {
+            _local().site(*info.cif, info.fn).add(info.ns);
+        }
+
+    private:
+        friend class detail::call_probe;
+
+        instrumentation() = default;
+
+        /**
+         * The installed hook slot, marked as in use until _release_hooks()
+         * \return Slot, or null if no hooks are installed
+         */
+        detail::hook_slot* _acquire_hooks()
+        {
+            for (;;) {
+                const auto slot = m_hooks.load();
+                if (!slot) {
+                    return nullptr;
+                }
+                slot->active.fetch_add(1);
+                // Still installed, so set_hooks() can't rewrite it until
+                // active drops again
+                if (m_hooks.load() == slot) {
+                    return slot;
+                }
+                slot->active.fetch_sub(1);
+            }
+        }
+        static void _release_hooks(detail::hook_slot& slot)
+        {
+            slot.active.fetch_sub(1, std::memory_order_release);
+        }
+
+        // Registers this thread's shard, and folds it into m_retired when
+        // the thread exits
+        class shard_owner {
+        public:
+            explicit shard_owner(instrumentation& p_inst) : m_inst(p_inst)
+            {
+                std::lock_guard<std::mutex> lock(m_inst.m_lock);
+                m_inst.m_shards.push_back(&m_shard);
+            }
+
+            shard_owner(const shard_owner&) = delete;
+            shard_owner& operator=(const shard_owner&) = delete;
+
+            ~shard_owner()
+            {
+                std::lock_guard<std::mutex> lock(m_inst.m_lock);
+                auto& shards = m_inst.m_shards;
+                shards.erase(std::find(shards.begin(), shards.end(), &m_shard));
+                m_shard.for_each([&](const detail::site_key& key,
+                                     const detail::site_counters& c) {
+                    auto& r = m_inst.m_retired.site(
+                        key, c.cif, [&] { return c.signature; });
+                    r.calls.fetch_add(c.calls.load(std::memory_order_relaxed),
+                                      std::memory_order_relaxed);
+                    r.total_ns.fetch_add(
+                        c.total_ns.load(std::memory_order_relaxed),
+                        std::memory_order_relaxed);
+                    for (std::size_t i = 0; i < call_stats::buckets; ++i) {
+                        r.histogram[i].fetch_add(
+                            c.histogram[i].load(std::memory_order_relaxed),
+                            std::memory_order_relaxed);
+                    }
+                });
+            }
+
+            detail::instrument_shard& shard()
+            {
+                return m_shard;
+            }
+
+        private:
+            instrumentation& m_inst;
+            detail::instrument_shard m_shard{};
+        };
+
+        detail::instrument_shard& _local()
+        {
+            static thread_local shard_owner owner(*this);
+            return owner.shard();
+        }
+
+        mutable std::mutex m_lock{};
+        std::vector<detail::instrument_shard*> m_shards{};
+        // Counters of threads that have exited; only touched under m_lock
+        detail::instrument_shard m_retired{};
+        std::vector<std::unique_ptr<detail::hook_slot>> m_hook_slots{};
+        // Sequentially consistent, as it pairs with hook_slot::active
+        std::atomic<detail::hook_slot*> m_hooks{nullptr};
+    };
+#endif
+
+    namespace detail {
+#ifdef CPPFFI_INSTRUMENTATION
+        /**
+         * Times one call and runs the hooks around it
+         */
+        class call_probe {
+        public:
+            call_probe(const ffi_cif& c,
+                       void (*fn)(),
+                       void* ret,
+                       void* const* args)
+                : m_info{&c, fn, ret, args, 0},
+                  m_hooks(instrumentation::global()._acquire_hooks()),
+                  m_start{}
+            {
+                if (m_hooks && m_hooks->hooks.pre) {
+                    m_hooks->hooks.pre(m_info, m_hooks->hooks.context);
+                }
+                m_start = std::chrono::steady_clock::now();
+            }
+
+            call_probe(const call_probe&) = delete;
+            call_probe& operator=(const call_probe&) = delete;
+
+            ~call_probe()
+            {
+                const auto elapsed = std::chrono::steady_clock::now() - m_start;
+                m_info.ns = static_cast<std::uint64_t>(
+                    std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        elapsed)
+                        .count());
+                instrumentation::global().record(m_info);
+                if (m_hooks) {
+                    if (m_hooks->hooks.post) {
+                        m_hooks->hooks.post(m_info, m_hooks->hooks.context);
+                    }
+                    instrumentation::_release_hooks(*m_hooks);
+                }
+            }
+
+        private:
+            call_info m_info;
+            hook_slot* m_hooks;
+            std::chrono::steady_clock::time_point m_start;
+        };
+#endif
+
+        /**
+         * ffi_call, counted and timed when CPPFFI_INSTRUMENTATION is defined
+         */
+        inline void invoke(ffi_cif& c, void (*fn)(), void* ret, void** args)
+        {
+#ifdef CPPFFI_INSTRUMENTATION
+            call_probe probe(c, fn, ret, args);
+#endif
+            ffi_call(&c, fn, ret, args);
+        }
+
+#if !(defined(FFI_NO_RAW_API) && FFI_NO_RAW_API)
+        /**
+         * ffi_raw_call, counted and timed when CPPFFI_INSTRUMENTATION is
+         * defined
+         */
+        inline void invoke_raw(ffi_cif& c,
+                               void (*fn)(),
+                               void* ret,
+                               ffi_raw* args)
+        {
+#ifdef CPPFFI_INSTRUMENTATION
+            call_probe probe(c, fn, ret, nullptr);
+#endif
+            ffi_raw_call(&c, fn, ret, args);
+        }
+#endif
+    }  // namespace detail
+}  // namespace ffi
+
+#include "cppffi_end.h"
+
+#endif
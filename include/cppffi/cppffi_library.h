@@ -0,0 +1,310 @@
+// Copyright 2017 Elias Kosunen
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef CPPFFI_LIBRARY_H
+#define CPPFFI_LIBRARY_H
+
+#include <atomic>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+
+#ifdef _WIN32
+// Keep the min/max macros and the rest of windows.h out of user code
+#ifndef NOMINMAX
+#define NOMINMAX
+#define CPPFFI_DEFINED_NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#define CPPFFI_DEFINED_WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#ifdef CPPFFI_DEFINED_NOMINMAX
+#undef NOMINMAX
+#undef CPPFFI_DEFINED_NOMINMAX
+#endif
+#ifdef CPPFFI_DEFINED_WIN32_LEAN_AND_MEAN
+#undef WIN32_LEAN_AND_MEAN
+#undef CPPFFI_DEFINED_WIN32_LEAN_AND_MEAN
+#endif
+#else
+#include <dlfcn.h>
+#endif
+
+#include "cppffi_begin.h"
+
+#include "cppffi.h"
+
+namespace ffi {
+    class shared_library;
+
+    template <typename T>
+    class symbol;
+
+    namespace detail {
+        class symbol_base {
+        public:
+            symbol_base() = default;
+            symbol_base(const symbol_base&) = delete;
+            symbol_base& operator=(const symbol_base&) = delete;
+            virtual ~symbol_base() = default;
+        };
+
+        /// Unique address per signature, used to tell symbols apart
+        template <typename T>
+        const void* signature_id()
+        {
+            static const char id = 0;
+            return &id;
+        }
+    }  // namespace detail
+
+    /**
+     * A function in a shared_library, with a fixed signature.
+     * The address is looked up on the first call, not when the symbol is
+     * created, and kept for later calls. Calls go through a cif copied from
+     * the process-wide cache. Safe to call from several threads at once.
+     */
+    template <typename ReturnT, typename... ArgsT>
+    class symbol<ReturnT(ArgsT...)> : public detail::symbol_base {
+    public:
+        using function_type = ReturnT(ArgsT...);
+        /**
+         * Type of the exported function.
+         * See callable::native_type; parameters like span expand
+         */
+        using native_type =
+            typename detail::native_function<ReturnT(), ArgsT...>::type;
+
+        symbol(shared_library& p_library, std::string p_name)
+            : m_library(p_library), m_name(std::move(p_name))
+        {
+        }
+
+        /**
+         * Call the function, resolving it first if needed
+         * \throw bad_symbol if the library doesn't export the name
+         */
+        template <typename... Args>
+        ReturnT operator()(Args&&... args) const
+        {
+            return bind()(std::forward<Args>(args)...);
+        }
+
+        /**
+         * Resolve the function and bind it to the interface
+         * \throw bad_symbol if the library doesn't export the name
+         */
+        callable<function_type> bind() const
+        {
+            return callable<function_type>(m_cif, address());
+        }
+
+        /**
+         * Address of the function, resolving it first if needed
+         * \throw bad_symbol if the library doesn't export the name
+         */
+        native_type& address() const
+        {
+            auto fn = m_address.load(std::memory_order_acquire);
+            if (!fn) {
+                fn = _resolve();
+            }
+            return *fn;
+        }
+
+        bool resolved() const
+        {
+            return m_address.load(std::memory_order_acquire) != nullptr;
+        }
+
+        const std::string& name() const
+        {
+            return m_name;
+        }
+
+    private:
+        native_type* _resolve() const;
+
+        shared_library& m_library;
+        std::string m_name;
+        mutable std::atomic<native_type*> m_address{nullptr};
+
+        // Never modified after construction; callable just wants a
+        // non-const reference
+        mutable cif<function_type> m_cif{};
+    };
+
+    /**
+     * A dynamically loaded library.
+     * Symbols are created once per name and signature and live as long as
+     * the library. Raw addresses are cached too, so asking for the same name
+     * again never goes back to the dynamic linker.
+     */
+    class shared_library {
+    public:
+        /**
+         * Load a library
+         * \param path Path or name, as accepted by dlopen or LoadLibrary
+         * \throw bad_library if it can't be loaded
+         */
+        explicit shared_library(const std::string& path)
+            : m_handle(_open(path))
+        {
+            if (!m_handle) {
+                CPPFFI_THROW(bad_library());
+            }
+        }
+
+        // Symbols refer back to the library
+        shared_library(const shared_library&) = delete;
+        shared_library& operator=(const shared_library&) = delete;
+
+        ~shared_library()
+        {
+            m_symbols.clear();
+            _close(m_handle);
+        }
+
+        /**
+         * Get the function with the given name and signature.
+         * The address isn't looked up until the function is first called
+         * \return Symbol, valid for the lifetime of the library
+         */
+        template <typename FunctionT>
+        const symbol<FunctionT>& get(const std::string& name)
+        {
+            static_assert(std::is_function<FunctionT>::value,
+                          "shared_library::get expects a function type");
+
+            std::lock_guard<std::mutex> lock(m_lock);
+            auto& slot =
+                m_symbols[key{name, detail::signature_id<FunctionT>()}];
+            if (!slot) {
+                slot.reset(new symbol<FunctionT>(*this, name));
+            }
+            return static_cast<const symbol<FunctionT>&>(*slot);
+        }
+
+        /**
+         * Address of an exported symbol
+         * \return Address, or nullptr if the library doesn't export the name
+         */
+        void* address(const std::string& name)
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            auto it = m_addresses.find(name);
+            if (it != m_addresses.end()) {
+                return it->second;
+            }
+            auto sym = _lookup(m_handle, name.c_str());
+            if (sym) {
+                m_addresses.emplace(name, sym);
+            }
+            return sym;
+        }
+
+    private:
+        struct key {
+            std::string name;
+            const void* signature;
+
+            bool operator==(const key& other) const
+            {
+                return signature == other.signature && name == other.name;
+            }
+        };
+        struct key_hash {
+            size_t operator()(const key& k) const
+            {
+                return std::hash<std::string>()(k.name) ^
+                       std::hash<const void*>()(k.signature);
+            }
+        };
+
+#ifdef _WIN32
+        using handle_type = HMODULE;
+
+        static handle_type _open(const std::string& path)
+        {
+            return LoadLibraryA(path.c_str());
+        }
+        static void _close(handle_type handle)
+        {
+            FreeLibrary(handle);
+        }
+        static void* _lookup(handle_type handle, const char* name)
+        {
+            auto sym = GetProcAddress(handle, name);
+            void* address = nullptr;
+            std::memcpy(&address, &sym, sizeof(address));
+            return address;
+        }
+#else
+        using handle_type = void*;
+
+        static handle_type _open(const std::string& path)
+        {
+            return dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+        }
+        static void _close(handle_type handle)
+        {
+            dlclose(handle);
+        }
+        static void* _lookup(handle_type handle, const char* name)
+        {
+            return dlsym(handle, name);
+        }
+#endif
+
+        handle_type m_handle;
+        std::mutex m_lock{};
+        std::unordered_map<key, std::unique_ptr<detail::symbol_base>, key_hash>
+            m_symbols{};
+        std::unordered_map<std::string, void*> m_addresses{};
+    };
+
+    template <typename ReturnT, typename... ArgsT>
+    inline auto symbol<ReturnT(ArgsT...)>::_resolve() const -> native_type*
+    {
+        auto sym = m_library.address(m_name);
+        if (!sym) {
+            CPPFFI_THROW(bad_symbol());
+        }
+
+        // Object and function pointers have the same representation on every
+        // platform with dlsym
+        native_type* fn = nullptr;
+        std::memcpy(&fn, &sym, sizeof(fn));
+
+        // Racing threads resolve to the same address
+        m_address.store(fn, std::memory_order_release);
+        return fn;
+    }
+}  // namespace ffi
+
+#include "cppffi_end.h"
+
+#endif  // CPPFFI_LIBRARY_H
@@ -0,0 +1,444 @@
+// Copyright 2017 Elias Kosunen
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef CPPFFI_PARALLEL_H
+#define CPPFFI_PARALLEL_H
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "cppffi_begin.h"
+
+#include "cppffi.h"
+
+#ifndef CPPFFI_PARALLEL_CHUNK_NS
+// Time a thread should spend on the rows it takes at once
+#define CPPFFI_PARALLEL_CHUNK_NS 50000
+#endif
+
+#ifndef CPPFFI_PARALLEL_PROBE_ROWS
+// Rows called on the calling thread to measure the cost of a call
+#define CPPFFI_PARALLEL_PROBE_ROWS 16
+#endif
+
+namespace ffi {
+    /**
+     * Unit of work for a thread_pool.
+     * Tasks are linked into the queue intrusively, so submitting one never
+     * allocates. The owner keeps the task alive until it has run or has
+     * been cancelled.
+     */
+    class task {
+    public:
+        using function_type = void (*)(task&);
+
+        explicit task(function_type fn) noexcept : m_fn(fn) {}
+
+        /**
+         * Run the task. Executors other than thread_pool call this once for
+         * every task submitted to them
+         */
+        void run()
+        {
+            m_fn(*this);
+        }
+
+    private:
+        friend class thread_pool;
+
+        function_type m_fn;
+        task* m_next{nullptr};
+    };
+
+    /**
+     * Fixed set of worker threads running tasks in submission order
+     */
+    class thread_pool {
+    public:
+        /**
+         * Start the worker threads
+         * \param threads Number of workers, at least one
+         */
+        explicit thread_pool(std::size_t threads = default_size())
+        {
+            threads = std::max<std::size_t>(threads, 1);
+            m_threads.reserve(threads);
+            for (std::size_t i = 0; i < threads; ++i) {
+                m_threads.emplace_back(&thread_pool::_work, this);
+            }
+        }
+
+        thread_pool(const thread_pool&) = delete;
+        thread_pool& operator=(const thread_pool&) = delete;
+
+        /**
+         * Run the tasks still queued, then stop the workers
+         */
+        ~thread_pool()
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_lock);
+                m_stop = true;
+            }
+            m_ready.notify_all();
+            for (auto& t : m_threads) {
+                t.join();
+            }
+        }
+
+        /**
+         * Process-wide pool with default_size() workers, started on first
+         * use
+         */
+        static thread_pool& global()
+        {
+            static thread_pool pool;
+            return pool;
+        }
+
+        /**
+         * One worker per hardware thread, leaving one for the caller
+         */
+        static std::size_t default_size()
+        {
+            const std::size_t hw = std::thread::hardware_concurrency();
+            return hw > 1 ? hw - 1 : 1;
+        }
+
+        std::size_t size() const noexcept
+        {
+            return m_threads.size();
+        }
+
+        /**
+         * Queue a task to run on one of the workers
+         */
+        void submit(task& t)
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_lock);
+                t.m_next = nullptr;
+                if (m_tail) {
+                    m_tail->m_next = &t;
+                }
+                else {
+                    m_head = &t;
+                }
+                m_tail = &t;
+            }
+            m_ready.notify_one();
+        }
+
+        /**
+         * Remove a task that no worker has started yet
+         * \return true if the task was removed and will never run
+         */
+        bool cancel(task& t)
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            task* prev = nullptr;
+            for (auto cur = m_head; cur; prev = cur, cur = cur->m_next) {
+                if (cur != &t) {
+                    continue;
+                }
+                (prev ? prev->m_next : m_head) = cur->m_next;
+                if (m_tail == cur) {
+                    m_tail = prev;
+                }
+                return true;
+            }
+            return false;
+        }
+
+        /**
+         * Call body(begin, end) over disjoint ranges covering [0, n).
+         * Every worker and the calling thread start with an equal share and
+         * take up to grain indices at a time from the front of it. A thread
+         * that runs out steals the back half of another's share. Returns
+         * once the whole range has been processed. body must not throw.
+         * \param n     Number of indices
+         * \param grain Most indices handed to body at once
+         * \param body  Callable taking (std::size_t begin, std::size_t end)
+         */
+        template <typename Body>
+        void parallel_for(std::size_t n, std::size_t grain, Body&& body);
+
+    private:
+        void _work()
+        {
+            std::unique_lock<std::mutex> lock(m_lock);
+            while (true) {
+                m_ready.wait(lock, [this] { return m_head || m_stop; });
+                if (!m_head) {
+                    return;
+                }
+                auto t = m_head;
+                m_head = t->m_next;
+                if (!m_head) {
+                    m_tail = nullptr;
+                }
+                lock.unlock();
+                t->m_fn(*t);
+                lock.lock();
+            }
+        }
+
+        std::mutex m_lock{};
+        std::condition_variable m_ready{};
+        task* m_head{nullptr};
+        task* m_tail{nullptr};
+        bool m_stop{false};
+        std::vector<std::thread> m_threads{};
+    };
+
+    namespace detail {
+        /**
+         * The part of a parallel_for range owned by one thread.
+         * Padded so neighbouring shares don't share a cache line
+         */
+        struct steal_range {
+            std::mutex lock{};
+            std::size_t begin{0};
+            std::size_t end{0};
+            char padding[64]{};
+        };
+
+        template <typename Body>
+        class range_job {
+        public:
+            range_job(std::size_t threads,
+                      std::size_t n,
+                      std::size_t grain,
+                      Body& body)
+                : m_ranges(new steal_range[threads]),
+                  m_threads(threads),
+                  m_grain(std::max<std::size_t>(grain, 1)),
+                  m_body(body)
+            {
+                for (std::size_t i = 0; i < threads; ++i) {
+                    m_ranges[i].begin = n * i / threads;
+                    m_ranges[i].end = n * (i + 1) / threads;
+                }
+            }
+
+            /**
+             * Process indices as participant `self` until none are left
+             */
+            void work(std::size_t self)
+            {
+                std::size_t begin = 0, end = 0;
+                while (_take(self, begin, end) || _steal(self, begin, end)) {
+                    m_body(begin, end);
+                }
+            }
+
+        private:
+            bool _take(std::size_t self, std::size_t& begin, std::size_t& end)
+            {
+                auto& own = m_ranges[self];
+                std::lock_guard<std::mutex> lock(own.lock);
+                if (own.begin == own.end) {
+                    return false;
+                }
+                begin = own.begin;
+                end = std::min(own.end, begin + m_grain);
+                own.begin = end;
+                return true;
+            }
+
+            bool _steal(std::size_t self, std::size_t& begin, std::size_t& end)
+            {
+                for (std::size_t i = 1; i < m_threads; ++i) {
+                    auto& victim = m_ranges[(self + i) % m_threads];
+                    std::size_t from = 0, to = 0;
+                    {
+                        std::lock_guard<std::mutex> lock(victim.lock);
+                        const auto left = victim.end - victim.begin;
+                        if (left == 0) {
+                            continue;
+                        }
+                        from = victim.end - (left + 1) / 2;
+                        to = victim.end;
+                        victim.end = from;
+                    }
+
+                    // Run the first chunk now, keep the rest stealable
+                    begin = from;
+                    end = std::min(to, from + m_grain);
+                    auto& own = m_ranges[self];
+                    std::lock_guard<std::mutex> lock(own.lock);
+                    own.begin = end;
+                    own.end = to;
+                    return true;
+                }
+                return false;
+            }
+
+            std::unique_ptr<steal_range[]> m_ranges;
+            std::size_t m_threads;
+            std::size_t m_grain;
+            Body& m_body;
+        };
+
+        template <typename Body>
+        struct range_task : task {
+            range_task(range_job<Body>& p_job,
+                       std::size_t p_self,
+                       std::atomic<std::size_t>& p_pending,
+                       std::mutex& p_lock,
+                       std::condition_variable& p_done) noexcept
+                : task(&range_task::run),
+                  job(p_job),
+                  self(p_self),
+                  pending(p_pending),
+                  lock(p_lock),
+                  done(p_done)
+            {
+            }
+
+            static void run(task& t)
+            {
+                auto& rt = static_cast<range_task&>(t);
+                rt.job.work(rt.self);
+                rt.finish();
+            }
+
+            void finish()
+            {
+                // Notify under the lock: the waiting thread may destroy the
+                // job as soon as it can observe pending == 0
+                std::lock_guard<std::mutex> guard(lock);
+                if (pending.fetch_sub(1) == 1) {
+                    done.notify_all();
+                }
+            }
+
+            range_job<Body>& job;
+            std::size_t self;
+            std::atomic<std::size_t>& pending;
+            std::mutex& lock;
+            std::condition_variable& done;
+        };
+    }  // namespace detail
+
+    template <typename Body>
+    inline void thread_pool::parallel_for(std::size_t n,
+                                          std::size_t grain,
+                                          Body&& body)
+    {
+        if (n == 0) {
+            return;
+        }
+        grain = std::max<std::size_t>(grain, 1);
+        const auto helpers = std::min(size(), (n - 1) / grain);
+        if (helpers == 0) {
+            body(std::size_t{0}, n);
+            return;
+        }
+
+        using body_type = typename std::remove_reference<Body>::type;
+        detail::range_job<body_type> job(helpers + 1, n, grain, body);
+
+        std::atomic<std::size_t> pending{helpers};
+        std::mutex lock;
+        std::condition_variable done;
+        std::vector<detail::range_task<body_type>> tasks;
+        tasks.reserve(helpers);
+        for (std::size_t i = 0; i < helpers; ++i) {
+            tasks.emplace_back(job, i + 1, pending, lock, done);
+            submit(tasks.back());
+        }
+
+        job.work(0);
+
+        // Helpers that never got a worker aren't needed any more; this also
+        // keeps a parallel_for issued from inside a worker from deadlocking
+        for (auto& t : tasks) {
+            if (cancel(t)) {
+                t.finish();
+            }
+        }
+
+        std::unique_lock<std::mutex> guard(lock);
+        done.wait(guard, [&] { return pending.load() == 0; });
+    }
+
+    template <typename ReturnT, typename... ArgsT>
+    inline void callable<ReturnT(ArgsT...)>::call_batch(
+        thread_pool& pool,
+        typename detail::batch_output<ReturnT>::type out,
+        span<const ArgsT>... columns) const
+    {
+        using output = detail::batch_output<ReturnT>;
+        constexpr std::size_t arity = detail::param_total<ArgsT...>::value;
+
+        const auto rows = output::rows(out);
+        detail::check_batch(rows, {columns.size()...});
+        if (rows == 0) {
+            return;
+        }
+
+        std::array<void*, arity> base;
+        std::array<std::size_t, arity> strides;
+        detail::batch_arguments(base, strides, columns...);
+        auto fn = CPPFFI_FN(m_callable);
+        auto& c = m_cif.m_cif;
+
+        auto call_range = [&](std::size_t begin, std::size_t end) {
+            std::array<void*, arity> args;
+            for (std::size_t i = 0; i != arity; ++i) {
+                args[i] = static_cast<char*>(base[i]) + begin * strides[i];
+            }
+            detail::call_rows<ReturnT>(c, fn, output::slice(out, begin, end),
+                                       end - begin, args, strides);
+        };
+
+        using clock = std::chrono::steady_clock;
+        const auto probe = std::min<std::size_t>(rows,
+                                                 CPPFFI_PARALLEL_PROBE_ROWS);
+        const auto start = clock::now();
+        call_range(0, probe);
+        const auto elapsed = std::chrono::duration_cast<
+                                 std::chrono::nanoseconds>(clock::now() - start)
+                                 .count();
+
+        const auto per_row = std::max<std::size_t>(
+            static_cast<std::size_t>(elapsed) / std::max<std::size_t>(probe, 1),
+            1);
+        const auto grain =
+            std::max<std::size_t>(CPPFFI_PARALLEL_CHUNK_NS / per_row, 1);
+        pool.parallel_for(rows - probe, grain,
+                          [&](std::size_t begin, std::size_t end) {
+                              call_range(probe + begin, probe + end);
+                          });
+    }
+}  // namespace ffi
+
+#include "cppffi_end.h"
+
+#endif  // CPPFFI_PARALLEL_H
@@ -0,0 +1,556 @@
+// Copyright 2017 Elias Kosunen
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef CPPFFI_RECORDER_H
+#define CPPFFI_RECORDER_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <new>
+#include <string>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#if defined(CPPFFI_INSTRUMENTATION) && !defined(_WIN32)
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include "cppffi_begin.h"
+
+#include "cppffi.h"
+#include "cppffi_signature.h"
+
+#ifndef CPPFFI_RECORDER_SYMBOLS
+// Distinct functions a recording can name
+#define CPPFFI_RECORDER_SYMBOLS 1024
+#endif
+
+namespace ffi {
+    namespace detail {
+        /*
+         * A recording file is a header, a table of the functions seen and a
+         * ring of fixed-size slots, one per call. The table is never
+         * overwritten, so every slot left in the ring can be named.
+         */
+        struct recording_header {
+            char magic[8]{};
+            std::uint32_t version{0};
+            std::uint32_t slot_size{0};
+            std::uint64_t slots{0};
+            std::uint64_t symbols{0};
+            std::atomic<std::uint64_t> next_slot{0};
+            std::atomic<std::uint64_t> symbol_count{0};
+        };
+
+        struct recording_symbol {
+            std::uint64_t address;
+            /// Offset from the start of the library containing it
+            std::uint64_t offset;
+            char name[112];
+            char library[128];
+        };
+
+        struct recording_slot {
+            /// Sequence number + 1 once complete, 0 while being written
+            std::atomic<std::uint64_t> seq;
+            /// Nanoseconds since the Unix epoch when the call returned
+            std::uint64_t timestamp_ns;
+            std::uint64_t duration_ns;
+            std::uint64_t function;
+            std::uint16_t signature_size;
+            /// Number of values: the return value, then the arguments
+            std::uint16_t value_count;
+            /// Number of leading values whose bytes follow; the rest didn't
+            /// fit in the slot
+            std::uint16_t stored_count;
+            std::uint16_t reserved;
+            // Followed by the signature string, a std::uint16_t size for
+            // every value, then the values, each 8-byte aligned
+        };
+
+        constexpr char recording_magic[8] = {'c', 'p', 'p', 'f',
+                                             'f', 'i', 'r', 'c'};
+        constexpr std::uint32_t recording_version = 1;
+
+        static_assert(sizeof(std::atomic<std::uint64_t>) ==
+                          sizeof(std::uint64_t),
+                      "Recordings are read back as plain integers");
+
+        constexpr std::size_t recording_align(std::size_t n)
+        {
+            return (n + 7) & ~std::size_t{7};
+        }
+
+        inline std::size_t recording_slots_offset(std::size_t symbols)
+        {
+            return recording_align(sizeof(recording_header)) +
+                   symbols * sizeof(recording_symbol);
+        }
+    }  // namespace detail
+
+
+    /**
+     * One call read back from a recording
+     */
+    struct recorded_call {
+        std::uint64_t seq;
+        std::uint64_t timestamp_ns;
+        std::uint64_t duration_ns;
+        /// Address of the function in the recording process
+        std::uint64_t function;
+        /// Symbol name, if the function was exported
+        std::string name;
+        /// Path of the library or executable containing the function
+        std::string library;
+        /// Offset of the function from the start of library
+        std::uint64_t offset;
+        /// Signature string, see signature()
+        std::string signature;
+        /// Whether some values didn't fit in the slot
+        bool truncated;
+        /// Bytes of the return value, then of every argument; only the
+        /// leading ones that fit if truncated
+        std::vector<std::vector<unsigned char>> values;
+    };
+
+    /**
+     * A recording made by call_recorder, read back in full
+     */
+    class call_log {
+    public:
+        /**
+         * Read a recording file
+         * \throw bad_recording if it can't be read or isn't a recording
+         */
+        explicit call_log(const std::string& path)
+        {
+            std::ifstream file(path, std::ios::binary | std::ios::ate);
+            const auto size = file.tellg();
+            if (!file || size <= 0) {
+                CPPFFI_THROW(bad_recording());
+            }
+            std::vector<char> data(static_cast<std::size_t>(size));
+            file.seekg(0);
+            if (!file.read(data.data(), size)) {
+                CPPFFI_THROW(bad_recording());
+            }
+            _parse(data);
+        }
+
+        /// The calls still in the ring, oldest first
+        const std::vector<recorded_call>& calls() const
+        {
+            return m_calls;
+        }
+
+    private:
+        template <typename T>
+        static T _read(const std::vector<char>& data, std::size_t offset)
+        {
+            T value{};
+            if (offset + sizeof(T) > data.size()) {
+                CPPFFI_THROW(bad_recording());
+            }
+            std::memcpy(&value, data.data() + offset, sizeof(T));
+            return value;
+        }
+
+        static std::string _string(const char* str, std::size_t max)
+        {
+            return std::string(str, std::find(str, str + max, '\0'));
+        }
+
+        void _parse(const std::vector<char>& data)
+        {
+            using header = detail::recording_header;
+            using slot = detail::recording_slot;
+            using symbol = detail::recording_symbol;
+
+            if (data.size() < sizeof(header) ||
+                std::memcmp(data.data(), detail::recording_magic,
+                            sizeof(detail::recording_magic)) != 0 ||
+                _read<std::uint32_t>(data, offsetof(header, version)) !=
+                    detail::recording_version) {
+                CPPFFI_THROW(bad_recording());
+            }
+            const auto slot_size =
+                _read<std::uint32_t>(data, offsetof(header, slot_size));
+            const auto slots =
+                _read<std::uint64_t>(data, offsetof(header, slots));
+            const auto symbols =
+                _read<std::uint64_t>(data, offsetof(header, symbols));
+            const auto named =
+                _read<std::uint64_t>(data, offsetof(header, symbol_count));
+            const auto table = detail::recording_align(sizeof(header));
+            const auto first = detail::recording_slots_offset(symbols);
+            if (slot_size < sizeof(slot) ||
+                first + slots * slot_size > data.size()) {
+                CPPFFI_THROW(bad_recording());
+            }
+
+            std::map<std::uint64_t, const symbol*> by_address;
+            for (std::uint64_t i = 0; i < named && i < symbols; ++i) {
+                auto sym = reinterpret_cast<const symbol*>(
+                    data.data() + table + i * sizeof(symbol));
+                by_address[sym->address] = sym;
+            }
+
+            for (std::uint64_t i = 0; i < slots; ++i) {
+                const auto base = first + i * slot_size;
+                const auto seq = _read<std::uint64_t>(data, base);
+                if (seq == 0) {
+                    continue;
+                }
+                recorded_call call{seq - 1, 0, 0, 0, {}, {}, 0, {}, false, {}};
+                auto field = [&](std::size_t offset) {
+                    return _read<std::uint64_t>(data, base + offset);
+                };
+                call.timestamp_ns = field(offsetof(slot, timestamp_ns));
+                call.duration_ns = field(offsetof(slot, duration_ns));
+                call.function = field(offsetof(slot, function));
+                const auto sig_size = _read<std::uint16_t>(
+                    data, base + offsetof(slot, signature_size));
+                const auto count = _read<std::uint16_t>(
+                    data, base + offsetof(slot, value_count));
+                const auto stored = _read<std::uint16_t>(
+                    data, base + offsetof(slot, stored_count));
+                call.truncated = stored < count || count == 0;
+
+                auto it = by_address.find(call.function);
+                if (it != by_address.end()) {
+                    auto& sym = *it->second;
+                    call.name = _string(sym.name, sizeof(sym.name));
+                    call.library = _string(sym.library, sizeof(sym.library));
+                    call.offset = sym.offset;
+                }
+
+                auto pos = base + sizeof(slot);
+                const auto end = base + slot_size;
+                if (pos + sig_size > end) {
+                    CPPFFI_THROW(bad_recording());
+                }
+                call.signature.assign(data.data() + pos, sig_size);
+                pos += sig_size;
+                pos += pos % 2;
+
+                std::vector<std::uint16_t> sizes;
+                for (std::uint16_t v = 0; v < count; ++v, pos += 2) {
+                    if (pos + 2 > end) {
+                        CPPFFI_THROW(bad_recording());
+                    }
+                    sizes.push_back(_read<std::uint16_t>(data, pos));
+                }
+                for (std::uint16_t v = 0; v < stored && v < count; ++v) {
+                    const auto size = sizes[v];
+                    pos = detail::recording_align(pos);
+                    if (pos + size > end) {
+                        CPPFFI_THROW(bad_recording());
+                    }
+                    auto bytes = data.data() + pos;
+                    call.values.emplace_back(bytes, bytes + size);
+                    pos += size;
+                }
+                m_calls.push_back(std::move(call));
+            }
+            // stable_sort avoids the heap fallback GCC 12 flags at C++20
+            std::stable_sort(m_calls.begin(), m_calls.end(),
+                             [](const recorded_call& a,
+                                const recorded_call& b) {
+                                 return a.seq < b.seq;
+                             });
+        }
+
+        std::vector<recorded_call> m_calls{};
+    };
+
+#if defined(CPPFFI_INSTRUMENTATION) && !defined(_WIN32)
+    /**
+     * Records every call made through cppffi into a memory-mapped ring
+     * buffer file.
+     *
+     * For each call a slot receives the function, the signature string
+     * (see signature()), the return value and argument bytes as sized by
+     * their ffi_type, the duration and a timestamp. Pointers are recorded
+     * by value, not what they point to. Writing a slot is a few stores into
+     * the mapping; only the first call to a function on a thread takes a
+     * lock, to add it to the function table. Once the ring is full, the
+     * oldest slots are overwritten.
+     *
+     * Installs itself as the post-call hook of ffi::instrumentation, so it
+     * needs CPPFFI_INSTRUMENTATION, and replaces any hooks set before.
+     * Calls still running on other threads must finish before the recorder
+     * is destroyed.
+     */
+    class call_recorder {
+    public:
+        /**
+         * Create or truncate the recording file and start recording
+         * \param path      File to record into
+         * \param slots     Calls kept before the oldest are overwritten
+         * \param slot_size Bytes per call; calls whose values don't fit are
+         *                  recorded without them
+         * \throw bad_recording if the file can't be created or mapped
+         */
+        explicit call_recorder(const std::string& path,
+                               std::size_t slots = 65536,
+                               std::size_t slot_size = 256)
+            : m_slots(std::max<std::size_t>(slots, 1)),
+              m_slot_size(detail::recording_align(std::max(
+                  slot_size, sizeof(detail::recording_slot) + 64))),
+              m_id(_next_id())
+        {
+            m_size = detail::recording_slots_offset(CPPFFI_RECORDER_SYMBOLS) +
+                     m_slots * m_slot_size;
+            m_fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+            if (m_fd < 0) {
+                CPPFFI_THROW(bad_recording());
+            }
+            void* map = MAP_FAILED;
+            if (::ftruncate(m_fd, static_cast<off_t>(m_size)) == 0) {
+                map = ::mmap(nullptr, m_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED, m_fd, 0);
+            }
+            if (map == MAP_FAILED) {
+                ::close(m_fd);
+                CPPFFI_THROW(bad_recording());
+            }
+            m_base = static_cast<char*>(map);
+
+            auto h = new (m_base) detail::recording_header;
+            std::memcpy(h->magic, detail::recording_magic, sizeof(h->magic));
+            h->version = detail::recording_version;
+            h->slot_size = static_cast<std::uint32_t>(m_slot_size);
+            h->slots = m_slots;
+            h->symbols = CPPFFI_RECORDER_SYMBOLS;
+            m_header = h;
+
+            instrumentation::global().set_hooks(nullptr, &call_recorder::hook,
+                                                this);
+        }
+
+        call_recorder(const call_recorder&) = delete;
+        call_recorder& operator=(const call_recorder&) = delete;
+
+        /**
+         * Stop recording and unmap the file
+         */
+        ~call_recorder()
+        {
+            stop();
+            ::msync(m_base, m_size, MS_ASYNC);
+            ::munmap(m_base, m_size);
+            ::close(m_fd);
+        }
+
+        /**
+         * Remove the hooks; calls after this aren't recorded
+         */
+        void stop()
+        {
+            auto& inst = instrumentation::global();
+            if (inst.hooks().context == this) {
+                inst.set_hooks(nullptr, nullptr, nullptr);
+            }
+        }
+
+        /// Calls recorded so far, including overwritten ones
+        std::uint64_t recorded() const
+        {
+            return m_header->next_slot.load(std::memory_order_relaxed);
+        }
+
+        /**
+         * Record one call. Called by the hook; exposed for chaining from
+         * other hooks
+         */
+        void record(const call_info& info)
+        {
+            const auto n =
+                m_header->next_slot.fetch_add(1, std::memory_order_relaxed);
+            auto base = _slot(n % m_slots);
+            auto slot = reinterpret_cast<detail::recording_slot*>(base);
+            // Invalidate the slot before anything else in it changes, so a
+            // crash mid-write leaves no slot that looks complete but isn't
+            slot->seq.exchange(0, std::memory_order_acquire);
+
+            const auto now = std::chrono::system_clock::now();
+            slot->timestamp_ns = static_cast<std::uint64_t>(
+                std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    now.time_since_epoch())
+                    .count());
+            slot->duration_ns = info.ns;
+            slot->function = reinterpret_cast<std::uintptr_t>(info.fn);
+            _name(info.fn);
+
+            char* out = base + sizeof(detail::recording_slot);
+            char* end = base + m_slot_size;
+            const auto sig = detail::write_signature(
+                *info.cif, out, static_cast<std::size_t>(end - out));
+            slot->signature_size = static_cast<std::uint16_t>(sig);
+            out += sig;
+            _values(*slot, info, out, end);
+
+            slot->seq.store(n + 1, std::memory_order_release);
+        }
+
+        static void hook(const call_info& info, void* context)
+        {
+            static_cast<call_recorder*>(context)->record(info);
+        }
+
+    private:
+        static std::uint64_t _next_id()
+        {
+            static std::atomic<std::uint64_t> id{0};
+            return ++id;
+        }
+
+        char* _slot(std::uint64_t index) const
+        {
+            return m_base +
+                   detail::recording_slots_offset(CPPFFI_RECORDER_SYMBOLS) +
+                   index * m_slot_size;
+        }
+
+        void _values(detail::recording_slot& slot,
+                     const call_info& info,
+                     char* out,
+                     char* end)
+        {
+            const auto& c = *info.cif;
+            const auto count = c.nargs + 1;
+            slot.value_count = static_cast<std::uint16_t>(count);
+            slot.stored_count = 0;
+            slot.reserved = 0;
+
+            auto size_of = [&](unsigned i) -> std::size_t {
+                return i == 0 ? (c.rtype->type == FFI_TYPE_VOID
+                                     ? 0
+                                     : c.rtype->size)
+                              : c.arg_types[i - 1]->size;
+            };
+            auto value_of = [&](unsigned i) -> const void* {
+                return i == 0 ? info.ret : info.args[i - 1];
+            };
+
+            // Sizes first, so a reader can skip values it can't use
+            out += reinterpret_cast<std::uintptr_t>(out) % 2;
+            const auto sizes = out;
+            out += count * sizeof(std::uint16_t);
+            if (out > end || slot.signature_size == 0) {
+                slot.value_count = 0;
+                return;
+            }
+            for (unsigned i = 0; i < count; ++i) {
+                const auto size = static_cast<std::uint16_t>(size_of(i));
+                std::memcpy(sizes + i * sizeof(size), &size, sizeof(size));
+            }
+
+            // No pointers to copy from for calls through the raw API
+            if (!info.args && c.nargs != 0) {
+                return;
+            }
+            for (unsigned i = 0; i < count; ++i) {
+                out = m_base + detail::recording_align(
+                                   static_cast<std::size_t>(out - m_base));
+                const auto size = size_of(i);
+                if (size > static_cast<std::size_t>(end - out)) {
+                    return;
+                }
+                std::memcpy(out, value_of(i), size);
+                out += size;
+                ++slot.stored_count;
+            }
+        }
+
+        // Add a function to the table the first time it's recorded
+        void _name(void (*fn)())
+        {
+            struct seen_cache {
+                std::uint64_t recorder{0};
+                std::unordered_set<void (*)()> functions{};
+            };
+            static thread_local seen_cache seen;
+            if (seen.recorder != m_id) {
+                seen.recorder = m_id;
+                seen.functions.clear();
+            }
+            if (!seen.functions.insert(fn).second) {
+                return;
+            }
+
+            std::lock_guard<std::mutex> lock(m_lock);
+            if (!m_named.insert(fn).second) {
+                return;
+            }
+            const auto index =
+                m_header->symbol_count.load(std::memory_order_relaxed);
+            if (index == CPPFFI_RECORDER_SYMBOLS) {
+                return;
+            }
+            auto table = reinterpret_cast<detail::recording_symbol*>(
+                m_base +
+                detail::recording_align(sizeof(detail::recording_header)));
+            auto& sym = table[index];
+            std::memset(&sym, 0, sizeof(sym));
+            sym.address = reinterpret_cast<std::uintptr_t>(fn);
+
+            Dl_info dl;
+            if (::dladdr(reinterpret_cast<void*>(fn), &dl) != 0) {
+                sym.offset = sym.address -
+                             reinterpret_cast<std::uintptr_t>(dl.dli_fbase);
+                if (dl.dli_sname) {
+                    std::strncpy(sym.name, dl.dli_sname, sizeof(sym.name) - 1);
+                }
+                if (dl.dli_fname) {
+                    std::strncpy(sym.library, dl.dli_fname,
+                                 sizeof(sym.library) - 1);
+                }
+            }
+            m_header->symbol_count.store(index + 1, std::memory_order_release);
+        }
+
+        std::size_t m_slots;
+        std::size_t m_slot_size;
+        std::uint64_t m_id;
+        std::size_t m_size{0};
+        int m_fd{-1};
+        char* m_base{nullptr};
+        detail::recording_header* m_header{nullptr};
+        std::mutex m_lock{};
+        std::unordered_set<void (*)()> m_named{};
+    };
+#endif
+}  // namespace ffi
+
+#include "cppffi_end.h"
+
+#endif
@@ -0,0 +1,154 @@
+// Copyright 2017 Elias Kosunen
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef CPPFFI_REGISTRY_H
+#define CPPFFI_REGISTRY_H
+
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <utility>
+
+#include "cppffi_begin.h"
+
+// Buckets per intern_map, a power of two
+#ifndef CPPFFI_REGISTRY_BUCKETS
+#define CPPFFI_REGISTRY_BUCKETS 256
+#endif
+
+namespace ffi {
+    namespace detail {
+        /**
+         * Insert-only hash map with lock-free lookups.
+         *
+         * Each bucket is a singly linked list whose head is swapped in with
+         * a compare-and-swap. Nodes are immutable once published and are
+         * only freed with the map, so a lookup is a few acquire loads: it
+         * takes no lock and writes no shared memory, and references to
+         * values never dangle while the map is alive.
+         */
+        template <typename Key, typename Value, typename Hash = std::hash<Key>>
+        class intern_map {
+        public:
+            intern_map() = default;
+            ~intern_map()
+            {
+                for (auto& bucket : m_buckets) {
+                    auto n = bucket.load(std::memory_order_relaxed);
+                    while (n) {
+                        auto next = n->next;
+                        delete n;
+                        n = next;
+                    }
+                }
+            }
+
+            intern_map(const intern_map&) = delete;
+            intern_map& operator=(const intern_map&) = delete;
+
+            /// The value stored under a key, or nullptr
+            Value* find(const Key& k) const
+            {
+                const auto h = Hash()(k);
+                return _find(_bucket(h).load(std::memory_order_acquire),
+                             nullptr, k, h);
+            }
+
+            /**
+             * Store a value unless the key is already present.
+             * If another thread wins the race, v is destroyed.
+             * \return The value stored under the key
+             */
+            Value& insert(Key k, std::unique_ptr<Value> v)
+            {
+                const auto h = Hash()(k);
+                auto& bucket = _bucket(h);
+                std::unique_ptr<node> fresh(
+                    new node{std::move(k), h, std::move(v), nullptr});
+
+                auto head = bucket.load(std::memory_order_acquire);
+                const node* checked = nullptr;
+                while (true) {
+                    // Only nodes pushed since the last attempt are new
+                    if (auto found = _find(head, checked, fresh->key, h)) {
+                        return *found;
+                    }
+                    checked = head;
+                    fresh->next = head;
+                    if (bucket.compare_exchange_weak(
+                            head, fresh.get(), std::memory_order_release,
+                            std::memory_order_acquire)) {
+                        m_size.fetch_add(1, std::memory_order_relaxed);
+                        return *fresh.release()->value;
+                    }
+                }
+            }
+
+            /// Number of stored values
+            size_t size() const
+            {
+                return m_size.load(std::memory_order_relaxed);
+            }
+
+        private:
+            struct node {
+                Key key;
+                size_t hash;
+                std::unique_ptr<Value> value;
+                node* next;
+            };
+
+            static constexpr size_t bucket_count = CPPFFI_REGISTRY_BUCKETS;
+            static_assert(bucket_count > 0 &&
+                              (bucket_count & (bucket_count - 1)) == 0,
+                          "CPPFFI_REGISTRY_BUCKETS must be a power of two");
+
+            std::atomic<node*>& _bucket(size_t h)
+            {
+                return m_buckets[h & (bucket_count - 1)];
+            }
+            const std::atomic<node*>& _bucket(size_t h) const
+            {
+                return m_buckets[h & (bucket_count - 1)];
+            }
+
+            static Value* _find(const node* n,
+                                const node* stop,
+                                const Key& k,
+                                size_t h)
+            {
+                for (; n != stop; n = n->next) {
+                    if (n->hash == h && n->key == k) {
+                        return n->value.get();
+                    }
+                }
+                return nullptr;
+            }
+
+            std::atomic<node*> m_buckets[bucket_count]{};
+            std::atomic<size_t> m_size{0};
+        };
+    }  // namespace detail
+}  // namespace ffi
+
+#include "cppffi_end.h"
+
+#endif
@@ -0,0 +1,264 @@
+// Copyright 2017 Elias Kosunen
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef CPPFFI_REPLAY_H
+#define CPPFFI_REPLAY_H
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#include "cppffi_begin.h"
+
+#include "cppffi.h"
+#include "cppffi_library.h"
+#include "cppffi_parallel.h"
+#include "cppffi_recorder.h"
+#include "cppffi_signature.h"
+
+namespace ffi {
+    struct replay_options {
+        /// Keep the recorded gaps between calls, instead of issuing every
+        /// call as soon as the previous one returns
+        bool recorded_pacing{false};
+        /// Threads issuing calls, including the calling one
+        std::size_t threads{1};
+        /// Times to go through the log
+        std::size_t repeat{1};
+    };
+
+    struct replay_report {
+        std::uint64_t calls;
+        double seconds;
+        double calls_per_second;
+        double mean_ns;
+        std::uint64_t p50_ns;
+        std::uint64_t p90_ns;
+        std::uint64_t p99_ns;
+        std::uint64_t max_ns;
+    };
+
+    /**
+     * Re-issues the calls of a recording against a local library.
+     *
+     * Every call is resolved up front: its interface comes from
+     * signature(), its function from the library by the recorded name, and
+     * its arguments are copied out of the log. Calls that can't be replayed
+     * are skipped: those recorded without all their values, without a
+     * name, with a name the library doesn't export, or taking pointers,
+     * which only meant something in the recording process.
+     */
+    class replay {
+    public:
+        /**
+         * Prepare the calls of a log
+         * \param log     Recorded calls
+         * \param library Library to resolve the recorded names in
+         */
+        replay(const call_log& log, shared_library& library)
+        {
+            for (const auto& call : log.calls()) {
+                _prepare(call, library);
+            }
+            if (!m_calls.empty()) {
+                m_span_ns = m_calls.back().offset_ns + 1;
+            }
+        }
+
+        /// Calls that will be replayed
+        std::size_t size() const
+        {
+            return m_calls.size();
+        }
+
+        /// Calls in the log that can't be replayed
+        std::size_t skipped() const
+        {
+            return m_skipped;
+        }
+
+        /**
+         * Issue the calls and time each one.
+         * With several threads the calls are shared out between them, so
+         * their order is only kept approximately
+         */
+        replay_report run(const replay_options& options = {}) const
+        {
+            using clock = std::chrono::steady_clock;
+
+            const auto count = m_calls.size();
+            const auto total = count * std::max<std::size_t>(options.repeat, 1);
+            replay_report report{0, 0.0, 0.0, 0.0, 0, 0, 0, 0};
+            if (total == 0) {
+                return report;
+            }
+
+            std::vector<std::uint64_t> latencies(total);
+            const auto start = clock::now();
+            auto body = [&](std::size_t begin, std::size_t end) {
+                std::vector<std::max_align_t> ret(m_return_words);
+                for (auto i = begin; i != end; ++i) {
+                    const auto& call = m_calls[i % count];
+                    if (options.recorded_pacing) {
+                        std::this_thread::sleep_until(
+                            start + std::chrono::nanoseconds(
+                                        call.offset_ns +
+                                        (i / count) * m_span_ns));
+                    }
+                    const auto t0 = clock::now();
+                    // libffi only reads the argument pointers
+                    call.fn.call(ret.data(),
+                                 const_cast<void**>(call.args.data()));
+                    const auto t1 = clock::now();
+                    latencies[i] = static_cast<std::uint64_t>(
+                        std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            t1 - t0)
+                            .count());
+                }
+            };
+
+            const auto threads = std::max<std::size_t>(options.threads, 1);
+            if (threads == 1) {
+                body(0, total);
+            }
+            else {
+                thread_pool pool(threads - 1);
+                const auto grain =
+                    std::max<std::size_t>(total / threads / 16, 1);
+                pool.parallel_for(total, grain, body);
+            }
+            const auto elapsed = clock::now() - start;
+
+            report.calls = total;
+            report.seconds = std::chrono::duration<double>(elapsed).count();
+            report.calls_per_second =
+                report.seconds > 0 ? static_cast<double>(total) / report.seconds
+                                   : 0.0;
+            double sum = 0;
+            for (auto l : latencies) {
+                sum += static_cast<double>(l);
+            }
+            report.mean_ns = sum / static_cast<double>(total);
+            // Not std::sort: GCC 12 flags its heap fallback with
+            // -Wstrict-overflow at C++20
+            std::stable_sort(latencies.begin(), latencies.end());
+            auto at = [&](double q) {
+                return latencies[static_cast<std::size_t>(
+                    q * static_cast<double>(total - 1))];
+            };
+            report.p50_ns = at(0.5);
+            report.p90_ns = at(0.9);
+            report.p99_ns = at(0.99);
+            report.max_ns = latencies.back();
+            return report;
+        }
+
+    private:
+        struct prepared {
+            dynamic_callable fn;
+            std::uint64_t offset_ns;
+            std::vector<std::max_align_t> storage;
+            std::vector<void*> args;
+        };
+
+        static bool _has_pointer(const ffi_type& t)
+        {
+            if (t.type == FFI_TYPE_POINTER) {
+                return true;
+            }
+            if (t.type == FFI_TYPE_STRUCT) {
+                for (auto e = t.elements; e && *e; ++e) {
+                    if (_has_pointer(**e)) {
+                        return true;
+                    }
+                }
+            }
+            return false;
+        }
+
+        void _prepare(const recorded_call& call, shared_library& library)
+        {
+            if (call.truncated || call.name.empty()) {
+                ++m_skipped;
+                return;
+            }
+            auto address = library.address(call.name);
+            if (!address) {
+                ++m_skipped;
+                return;
+            }
+            const auto& c = signature(call.signature);
+            if (call.values.size() != c.arg_count() + 1) {
+                ++m_skipped;
+                return;
+            }
+            // One max_align_t-aligned block per argument
+            auto blocks = [](std::size_t size) {
+                return size / sizeof(std::max_align_t) + 1;
+            };
+            std::size_t words = 0;
+            for (std::size_t i = 0; i < c.arg_count(); ++i) {
+                const auto& t = c.arg_type(i);
+                if (_has_pointer(t) || call.values[i + 1].size() != t.size) {
+                    ++m_skipped;
+                    return;
+                }
+                words += blocks(t.size);
+            }
+
+            void (*fn)() = nullptr;
+            std::memcpy(&fn, &address, sizeof(fn));
+            if (m_calls.empty()) {
+                m_first_ns = call.timestamp_ns;
+            }
+            prepared p{c.bind(fn),
+                       call.timestamp_ns > m_first_ns
+                           ? call.timestamp_ns - m_first_ns
+                           : 0,
+                       std::vector<std::max_align_t>(words),
+                       {}};
+            auto out = p.storage.data();
+            for (std::size_t i = 0; i < c.arg_count(); ++i) {
+                const auto& value = call.values[i + 1];
+                std::memcpy(out, value.data(), value.size());
+                p.args.push_back(out);
+                out += blocks(value.size());
+            }
+
+            const auto ret = std::max(c.return_type().size, sizeof(ffi_arg));
+            m_return_words = std::max(m_return_words, blocks(ret));
+            m_calls.push_back(std::move(p));
+        }
+
+        std::vector<prepared> m_calls{};
+        std::size_t m_skipped{0};
+        std::size_t m_return_words{1};
+        std::uint64_t m_first_ns{0};
+        std::uint64_t m_span_ns{0};
+    };
+}  // namespace ffi
+
+#include "cppffi_end.h"
+
+#endif
@@ -0,0 +1,403 @@
+// Copyright 2017 Elias Kosunen
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef CPPFFI_SIGNATURE_H
+#define CPPFFI_SIGNATURE_H
+
+#include "ffi.h"
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "cppffi_begin.h"
+
+#include "cppffi.h"
+#include "cppffi_dynamic.h"
+#include "cppffi_registry.h"
+#include "cppffi_support.h"
+#include "types/builtin.h"
+#include "types/structs.h"
+
+namespace ffi {
+    /**
+     * Interns signature strings and the struct types they describe.
+     *
+     * A signature is a return type followed by the argument types in
+     * parentheses, e.g. "i(ifp)" or "{ii}(p{dd})":
+     *
+     *   v void (return type only)  b bool
+     *   c int8     C uint8         s int16    S uint16
+     *   i int32    I uint32        l int64    L uint64
+     *   f float    d double        D long double
+     *   p pointer  {...} struct with the enclosed fields
+     *
+     * Every distinct string is parsed and prepared once. Later lookups of the
+     * same string return the same dynamic_cif, and identical struct
+     * descriptions share one ffi_type. Nothing is ever removed, so returned
+     * references stay valid for the lifetime of the table.
+     *
+     * Lookups of known strings are lock-free and touch no shared counters,
+     * so any number of threads can share one interface without contention.
+     * Only parsing and preparing a new string takes a lock.
+     */
+    class signature_table {
+    public:
+        signature_table() = default;
+
+        signature_table(const signature_table&) = delete;
+        signature_table& operator=(const signature_table&) = delete;
+
+        /// The process-wide table
+        static signature_table& global();
+
+        /**
+         * Look up or prepare the interface for a signature string.
+         * Throws bad_signature if the string is malformed
+         */
+        const dynamic_cif& get(const std::string& signature,
+                               abi p_abi = FFI_DEFAULT_ABI);
+
+        /**
+         * Look up or build the ffi_type of a single type string, e.g. "{id}"
+         */
+        ffi_type& get_type(const std::string& type);
+
+        /// Number of distinct prepared signatures
+        size_t size() const;
+
+    private:
+        struct struct_type {
+            ffi_type type{};
+            std::vector<ffi_type*> elements{};
+        };
+
+        struct key {
+            std::string signature;
+            abi p_abi;
+
+            bool operator==(const key& other) const
+            {
+                return p_abi == other.p_abi && signature == other.signature;
+            }
+        };
+        struct key_hash {
+            size_t operator()(const key& k) const
+            {
+                return std::hash<std::string>()(k.signature) ^
+                       static_cast<size_t>(k.p_abi);
+            }
+        };
+
+        ffi_type& _parse_type(const std::string& str, size_t& pos);
+        ffi_type& _intern_struct(const std::string& str);
+
+        // Serializes parsing, never taken by lookups that hit
+        std::mutex m_mutex{};
+        detail::intern_map<key, dynamic_cif, key_hash> m_signatures{};
+        detail::intern_map<std::string, struct_type> m_structs{};
+    };
+
+    /**
+     * Interface for a signature string, from the process-wide table
+     */
+    inline const dynamic_cif& signature(const std::string& str,
+                                        abi p_abi = FFI_DEFAULT_ABI)
+    {
+        return signature_table::global().get(str, p_abi);
+    }
+
+    namespace detail {
+        inline char builtin_code(const ffi_type& t)
+        {
+            switch (t.type) {
+                case FFI_TYPE_VOID:
+                    return 'v';
+                case FFI_TYPE_SINT8:
+                    return 'c';
+                case FFI_TYPE_UINT8:
+                    return 'C';
+                case FFI_TYPE_SINT16:
+                    return 's';
+                case FFI_TYPE_UINT16:
+                    return 'S';
+                case FFI_TYPE_INT:
+                case FFI_TYPE_SINT32:
+                    return 'i';
+                case FFI_TYPE_UINT32:
+                    return 'I';
+                case FFI_TYPE_SINT64:
+                    return 'l';
+                case FFI_TYPE_UINT64:
+                    return 'L';
+                case FFI_TYPE_FLOAT:
+                    return 'f';
+                case FFI_TYPE_DOUBLE:
+                    return 'd';
+#if FFI_TYPE_LONGDOUBLE != FFI_TYPE_DOUBLE
+                case FFI_TYPE_LONGDOUBLE:
+                    return 'D';
+#endif
+                case FFI_TYPE_POINTER:
+                    return 'p';
+                default:
+                    return '\0';
+            }
+        }
+
+        /**
+         * Append the code of a type to [out, end).
+         * \return false if it didn't fit or has no code
+         */
+        inline bool write_type(const ffi_type& t, char*& out, char* end)
+        {
+            if (out == end) {
+                return false;
+            }
+            if (t.type != FFI_TYPE_STRUCT) {
+                *out = builtin_code(t);
+                return *out++ != '\0';
+            }
+            *out++ = '{';
+            for (auto e = t.elements; e && *e; ++e) {
+                if (!write_type(**e, out, end)) {
+                    return false;
+                }
+            }
+            if (out == end) {
+                return false;
+            }
+            *out++ = '}';
+            return true;
+        }
+
+        /**
+         * Write the signature string of an interface to a buffer, without
+         * allocating
+         * \return Characters written, or 0 if it didn't fit or a type has no
+         *         code
+         */
+        inline size_t write_signature(const ffi_cif& c, char* out, size_t size)
+        {
+            const auto begin = out, end = out + size;
+            if (!write_type(*c.rtype, out, end) || out == end) {
+                return 0;
+            }
+            *out++ = '(';
+            for (unsigned i = 0; i < c.nargs; ++i) {
+                if (!write_type(*c.arg_types[i], out, end)) {
+                    return 0;
+                }
+            }
+            if (out == end) {
+                return 0;
+            }
+            *out++ = ')';
+            return static_cast<size_t>(out - begin);
+        }
+
+        inline ffi_type* builtin_type(char code)
+        {
+            switch (code) {
+                case 'v':
+                    return &type<void>::ffitype();
+                case 'b':
+                    return &type<bool>::ffitype();
+                case 'c':
+                    return &type<int8_t>::ffitype();
+                case 'C':
+                    return &type<uint8_t>::ffitype();
+                case 's':
+                    return &type<int16_t>::ffitype();
+                case 'S':
+                    return &type<uint16_t>::ffitype();
+                case 'i':
+                    return &type<int32_t>::ffitype();
+                case 'I':
+                    return &type<uint32_t>::ffitype();
+                case 'l':
+                    return &type<int64_t>::ffitype();
+                case 'L':
+                    return &type<uint64_t>::ffitype();
+                case 'f':
+                    return &type<float>::ffitype();
+                case 'd':
+                    return &type<double>::ffitype();
+                case 'D':
+                    return &type<long double>::ffitype();
+                case 'p':
+                    return &type<void*>::ffitype();
+                default:
+                    return nullptr;
+            }
+        }
+    }  // namespace detail
+
+    /**
+     * The signature string of a prepared interface; the inverse of
+     * signature(). Throws bad_signature if a type can't be expressed
+     */
+    inline std::string signature_string(const ffi_cif& c)
+    {
+        std::vector<char> buf(64);
+        size_t n = 0;
+        while ((n = detail::write_signature(c, buf.data(), buf.size())) == 0) {
+            if (buf.size() > 65536) {
+                CPPFFI_THROW(bad_signature());
+            }
+            buf.resize(buf.size() * 4);
+        }
+        return std::string(buf.data(), n);
+    }
+
+    inline signature_table& signature_table::global()
+    {
+        static signature_table table;
+        return table;
+    }
+
+    inline const dynamic_cif& signature_table::get(const std::string& str,
+                                                   abi p_abi)
+    {
+        key k{str, p_abi};
+        if (auto c = m_signatures.find(k)) {
+            return *c;
+        }
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (auto c = m_signatures.find(k)) {
+            return *c;
+        }
+
+        size_t pos = 0;
+        auto& ret = _parse_type(str, pos);
+        if (pos >= str.size() || str[pos] != '(') {
+            CPPFFI_THROW(bad_signature());
+        }
+        ++pos;
+
+        std::vector<ffi_type*> args;
+        while (pos < str.size() && str[pos] != ')') {
+            auto& arg = _parse_type(str, pos);
+            if (arg.type == FFI_TYPE_VOID) {
+                CPPFFI_THROW(bad_signature());
+            }
+            args.push_back(&arg);
+        }
+        if (pos + 1 != str.size()) {
+            CPPFFI_THROW(bad_signature());
+        }
+
+        return m_signatures.insert(
+            std::move(k), std::unique_ptr<dynamic_cif>(
+                              new dynamic_cif(ret, std::move(args), p_abi)));
+    }
+
+    inline ffi_type& signature_table::get_type(const std::string& str)
+    {
+        if (str.size() == 1) {
+            if (auto t = detail::builtin_type(str[0])) {
+                return *t;
+            }
+        }
+        if (auto s = m_structs.find(str)) {
+            return s->type;
+        }
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        size_t pos = 0;
+        auto& t = _parse_type(str, pos);
+        if (pos != str.size()) {
+            CPPFFI_THROW(bad_signature());
+        }
+        return t;
+    }
+
+    inline size_t signature_table::size() const
+    {
+        return m_signatures.size();
+    }
+
+    inline ffi_type& signature_table::_parse_type(const std::string& str,
+                                                  size_t& pos)
+    {
+        if (pos >= str.size()) {
+            CPPFFI_THROW(bad_signature());
+        }
+        if (str[pos] != '{') {
+            auto t = detail::builtin_type(str[pos]);
+            if (!t) {
+                CPPFFI_THROW(bad_signature());
+            }
+            ++pos;
+            return *t;
+        }
+
+        // Find the matching brace, so the whole struct text is the key
+        const auto begin = pos;
+        size_t depth = 0;
+        do {
+            if (str[pos] == '{') {
+                ++depth;
+            }
+            else if (str[pos] == '}') {
+                --depth;
+            }
+            ++pos;
+        } while (depth > 0 && pos < str.size());
+        if (depth > 0) {
+            CPPFFI_THROW(bad_signature());
+        }
+        return _intern_struct(str.substr(begin, pos - begin));
+    }
+
+    inline ffi_type& signature_table::_intern_struct(const std::string& str)
+    {
+        if (auto found = m_structs.find(str)) {
+            return found->type;
+        }
+
+        std::unique_ptr<struct_type> s(new struct_type);
+        size_t pos = 1;
+        while (pos < str.size() - 1) {
+            auto& field = _parse_type(str, pos);
+            if (field.type == FFI_TYPE_VOID) {
+                CPPFFI_THROW(bad_signature());
+            }
+            s->elements.push_back(&field);
+        }
+        if (s->elements.empty()) {
+            CPPFFI_THROW(bad_signature());
+        }
+        s->elements.push_back(nullptr);
+
+        s->type.type = FFI_TYPE_STRUCT;
+        s->type.elements = &s->elements[0];
+        detail::layout_struct(s->type);
+
+        return m_structs.insert(str, std::move(s)).type;
+    }
+}  // namespace ffi
+
+#include "cppffi_end.h"
+
+#endif
@@ -0,0 +1,141 @@
+// Copyright 2017 Elias Kosunen
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef CPPFFI_SPAN_H
+#define CPPFFI_SPAN_H
+
+#include <array>
+#include <cstddef>
+#include <type_traits>
+#include <vector>
+
+#include "cppffi_begin.h"
+
+namespace ffi {
+    template <typename T, typename Enable>
+    struct type;
+
+    /**
+     * Non-owning view over a contiguous array of objects.
+     * Used for batched calls, where every row of a column is handed to the
+     * native function in turn, and as a parameter type that expands to a
+     * pointer and a length
+     */
+    template <typename T>
+    class span {
+    public:
+        template <typename U, typename Enable>
+        friend struct type;
+
+        using element_type = T;
+        using value_type = typename std::remove_cv<T>::type;
+        using pointer = T*;
+        using reference = T&;
+        using iterator = T*;
+
+        span() noexcept = default;
+        span(pointer p_data, std::size_t p_size) noexcept
+            : m_data(p_data), m_size(p_size)
+        {
+        }
+
+        template <std::size_t N>
+        span(T (&arr)[N]) noexcept : m_data(arr), m_size(N)
+        {
+        }
+
+        template <typename U,
+                  std::size_t N,
+                  typename = typename std::enable_if<
+                      std::is_convertible<U (*)[], T (*)[]>::value>::type>
+        span(std::array<U, N>& arr) noexcept : m_data(arr.data()), m_size(N)
+        {
+        }
+        template <typename U,
+                  std::size_t N,
+                  typename = typename std::enable_if<
+                      std::is_convertible<const U (*)[], T (*)[]>::value>::type>
+        span(const std::array<U, N>& arr) noexcept
+            : m_data(arr.data()), m_size(N)
+        {
+        }
+
+        template <typename U,
+                  typename Alloc,
+                  typename = typename std::enable_if<
+                      std::is_convertible<U (*)[], T (*)[]>::value>::type>
+        span(std::vector<U, Alloc>& vec) noexcept
+            : m_data(vec.data()), m_size(vec.size())
+        {
+        }
+        template <typename U,
+                  typename Alloc,
+                  typename = typename std::enable_if<
+                      std::is_convertible<const U (*)[], T (*)[]>::value>::type>
+        span(const std::vector<U, Alloc>& vec) noexcept
+            : m_data(vec.data()), m_size(vec.size())
+        {
+        }
+
+        /// Conversion from span<U> to span<const U>
+        template <typename U,
+                  typename = typename std::enable_if<
+                      std::is_convertible<U (*)[], T (*)[]>::value>::type>
+        span(const span<U>& other) noexcept
+            : m_data(other.data()), m_size(other.size())
+        {
+        }
+
+        pointer data() const noexcept
+        {
+            return m_data;
+        }
+        std::size_t size() const noexcept
+        {
+            return m_size;
+        }
+        bool empty() const noexcept
+        {
+            return m_size == 0;
+        }
+
+        reference operator[](std::size_t i) const
+        {
+            return m_data[i];
+        }
+
+        iterator begin() const noexcept
+        {
+            return m_data;
+        }
+        iterator end() const noexcept
+        {
+            return m_data + m_size;
+        }
+
+    private:
+        pointer m_data{nullptr};
+        std::size_t m_size{0};
+    };
+}  // namespace ffi
+
+#include "cppffi_end.h"
+
+#endif  // CPPFFI_SPAN_H
@@ -21,10 +21,16 @@
 #ifndef CPPFFI_SUPPORT_H
 #define CPPFFI_SUPPORT_H
 
+#include "ffi.h"
 #include <cassert>
+#include <cstddef>
+#include <cstring>
+#include <limits>
 #include <memory>
+#include <new>
 #include <string>
 #include <stdexcept>
+#include <type_traits>
 #include <utility>
 
 #include "cppffi_begin.h"
@@ -48,6 +54,209 @@ namespace ffi {
             return "Bad ABI";
         }
     };
+    class bad_argument_count : public exception {
+    public:
+        const char* what() const noexcept override
+        {
+            return "Wrong number of arguments";
+        }
+    };
+    class bad_argument_type : public exception {
+    public:
+        const char* what() const noexcept override
+        {
+            return "Argument type doesn't match the interface";
+        }
+    };
+    class bad_batch_size : public exception {
+    public:
+        const char* what() const noexcept override
+        {
+            return "Batch column shorter than the number of rows";
+        }
+    };
+    class bad_library : public exception {
+    public:
+        const char* what() const noexcept override
+        {
+            return "Failed to load shared library";
+        }
+    };
+    class bad_symbol : public exception {
+    public:
+        const char* what() const noexcept override
+        {
+            return "Symbol not found in shared library";
+        }
+    };
+    class bad_signature : public exception {
+    public:
+        const char* what() const noexcept override
+        {
+            return "Malformed signature string";
+        }
+    };
+    class bad_recording : public exception {
+    public:
+        const char* what() const noexcept override
+        {
+            return "Failed to create, map or read a call recording";
+        }
+    };
+    class bad_function_id : public exception {
+    public:
+        const char* what() const noexcept override
+        {
+            return "No function with that id in the dispatch table";
+        }
+    };
+
+    namespace detail {
+        template <typename T>
+        struct is_widened_return
+            : std::integral_constant<bool,
+                                     std::is_integral<T>::value &&
+                                         sizeof(T) < sizeof(ffi_arg)> {
+        };
+
+        /**
+         * Read a return value written by libffi.
+         * Integral types narrower than a register are widened to ffi_arg
+         */
+        template <typename T>
+        typename std::enable_if<is_widened_return<T>::value, T>::type
+        read_return(const void* storage)
+        {
+            using wide = typename std::conditional<std::is_signed<T>::value,
+                                                   ffi_sarg, ffi_arg>::type;
+            wide value;
+            std::memcpy(&value, storage, sizeof(wide));
+            return static_cast<T>(value);
+        }
+        template <typename T>
+        typename std::enable_if<!is_widened_return<T>::value, T>::type
+        read_return(const void* storage)
+        {
+            T value;
+            std::memcpy(&value, storage, sizeof(T));
+            return value;
+        }
+
+        /**
+         * Write a return value for libffi from inside a closure.
+         * Integral types narrower than a register are widened to ffi_arg
+         */
+        template <typename T>
+        typename std::enable_if<is_widened_return<T>::value>::type
+        write_return(void* storage, const T& value)
+        {
+            using wide = typename std::conditional<std::is_signed<T>::value,
+                                                   ffi_sarg, ffi_arg>::type;
+            const auto widened = static_cast<wide>(value);
+            std::memcpy(storage, &widened, sizeof(wide));
+        }
+        template <typename T>
+        typename std::enable_if<!is_widened_return<T>::value>::type
+        write_return(void* storage, const T& value)
+        {
+            std::memcpy(storage, std::addressof(value), sizeof(T));
+        }
+
+        /**
+         * Address of an argument, in the form libffi expects.
+         * libffi never writes through argument pointers
+         */
+        template <typename T>
+        void* arg_address(const T& arg)
+        {
+            return const_cast<void*>(
+                static_cast<const void*>(std::addressof(arg)));
+        }
+
+        template <size_t... I>
+        struct index_sequence {
+        };
+        template <size_t N, size_t... I>
+        struct make_index_sequence_impl
+            : make_index_sequence_impl<N - 1, N - 1, I...> {
+        };
+        template <size_t... I>
+        struct make_index_sequence_impl<0, I...> {
+            using type = index_sequence<I...>;
+        };
+        template <size_t N>
+        using make_index_sequence =
+            typename make_index_sequence_impl<N>::type;
+
+        /**
+         * Allocator honouring alignof(T) beyond alignof(std::max_align_t).
+         * std::allocator only does so from C++17 on. Every block is
+         * over-allocated, and the pointer ::operator new returned is kept
+         * just before the aligned storage
+         */
+        template <typename T>
+        struct aligned_allocator {
+            using value_type = T;
+
+            template <typename U>
+            struct rebind {
+                using other = aligned_allocator<U>;
+            };
+
+            aligned_allocator() = default;
+            template <typename U>
+            aligned_allocator(const aligned_allocator<U>&) noexcept
+            {
+            }
+
+            T* allocate(std::size_t n)
+            {
+                const auto extra = alignof(T) + sizeof(void*);
+                const auto max = static_cast<std::size_t>(
+                    std::numeric_limits<std::ptrdiff_t>::max());
+                if (n > (max - extra) / sizeof(T)) {
+                    CPPFFI_THROW(std::bad_alloc());
+                }
+                auto space = n * sizeof(T) + extra;
+                void* raw = ::operator new(space);
+                void* aligned = static_cast<char*>(raw) + sizeof(void*);
+                space -= sizeof(void*);
+                std::align(alignof(T), n * sizeof(T), aligned, space);
+                std::memcpy(static_cast<char*>(aligned) - sizeof(void*), &raw,
+                            sizeof(void*));
+                return static_cast<T*>(aligned);
+            }
+            void deallocate(T* p, std::size_t) noexcept
+            {
+                void* raw = nullptr;
+                std::memcpy(&raw, reinterpret_cast<char*>(p) - sizeof(void*),
+                            sizeof(void*));
+                ::operator delete(raw);
+            }
+
+            template <typename U>
+            bool operator==(const aligned_allocator<U>&) const noexcept
+            {
+                return true;
+            }
+            template <typename U>
+            bool operator!=(const aligned_allocator<U>&) const noexcept
+            {
+                return false;
+            }
+        };
+
+        inline void check_status(ffi_status status)
+        {
+            if (status == FFI_BAD_ABI) {
+                CPPFFI_THROW(bad_abi());
+            }
+            // FFI_BAD_TYPEDEF, or FFI_BAD_ARGTYPE in newer versions of libffi
+            if (status != FFI_OK) {
+                CPPFFI_THROW(bad_typedef());
+            }
+        }
+    }  // namespace detail
 }  // namespace ffi
 
 #include "cppffi_end.h"
@@ -0,0 +1,241 @@
+// Copyright 2017 Elias Kosunen
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef CPPFFI_THUNK_H
+#define CPPFFI_THUNK_H
+
+#include "ffi.h"
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "cppffi_begin.h"
+
+#include "cppffi_support.h"
+
+#ifndef CPPFFI_THUNK_MAX_ARGS
+#define CPPFFI_THUNK_MAX_ARGS 4
+#endif
+
+namespace ffi {
+    namespace detail {
+        /**
+         * Calls fn with the arguments in the libffi-style argument array and
+         * stores the return value the way ffi_call would
+         */
+        using thunk_fn = void (*)(void (*fn)(), void* ret, void** args);
+
+        /**
+         * Argument kinds with a precompiled thunk, in the order they're
+         * numbered in the table
+         */
+        template <size_t Kind>
+        struct thunk_arg;
+        template <>
+        struct thunk_arg<0> {
+            using type = int64_t;
+        };
+        template <>
+        struct thunk_arg<1> {
+            using type = void*;
+        };
+        template <>
+        struct thunk_arg<2> {
+            using type = double;
+        };
+
+        template <size_t Kind>
+        struct thunk_return;
+        template <>
+        struct thunk_return<0> {
+            using type = int64_t;
+        };
+        template <>
+        struct thunk_return<1> {
+            using type = double;
+        };
+        template <>
+        struct thunk_return<2> {
+            using type = void;
+        };
+
+        template <typename ReturnT, typename... ArgsT>
+        struct thunk {
+            static void call(void (*fn)(), void* ret, void** args)
+            {
+                _call(fn, ret, args, make_index_sequence<sizeof...(ArgsT)>{},
+                      std::is_void<ReturnT>{});
+            }
+
+        private:
+            using function_type = ReturnT (*)(ArgsT...);
+
+            template <size_t... I>
+            static void _call(void (*fn)(),
+                              void* ret,
+                              void** args,
+                              index_sequence<I...>,
+                              std::false_type)
+            {
+                const ReturnT value = reinterpret_cast<function_type>(fn)(
+                    *static_cast<ArgsT*>(args[I])...);
+                std::memcpy(ret, &value, sizeof(value));
+            }
+            template <size_t... I>
+            static void _call(void (*fn)(),
+                              void*,
+                              void** args,
+                              index_sequence<I...>,
+                              std::true_type)
+            {
+                reinterpret_cast<function_type>(fn)(
+                    *static_cast<ArgsT*>(args[I])...);
+            }
+        };
+
+        constexpr size_t thunk_pow3(size_t n)
+        {
+            return n == 0 ? 1 : 3 * thunk_pow3(n - 1);
+        }
+        /// Index of the first thunk taking n arguments
+        constexpr size_t thunk_offset(size_t n)
+        {
+            return (thunk_pow3(n) - 1) / 2;
+        }
+        /// Thunks per return kind
+        constexpr size_t thunks_per_return =
+            thunk_offset(CPPFFI_THUNK_MAX_ARGS + 1);
+        constexpr size_t thunk_count = 3 * thunks_per_return;
+
+        constexpr size_t thunk_arity(size_t index, size_t n = 0)
+        {
+            return index < thunk_offset(n + 1) ? n
+                                               : thunk_arity(index, n + 1);
+        }
+
+        /**
+         * Decodes the argument kinds of a table entry: the digits of Code in
+         * base 3, most significant first
+         */
+        template <typename ReturnT, size_t N, size_t Code, typename... ArgsT>
+        struct make_thunk
+            : make_thunk<ReturnT,
+                         N - 1,
+                         Code / 3,
+                         typename thunk_arg<Code % 3>::type,
+                         ArgsT...> {
+        };
+        template <typename ReturnT, size_t Code, typename... ArgsT>
+        struct make_thunk<ReturnT, 0, Code, ArgsT...> {
+            static constexpr thunk_fn get()
+            {
+                return &thunk<ReturnT, ArgsT...>::call;
+            }
+        };
+
+        template <size_t Index>
+        struct thunk_entry {
+            static constexpr size_t ret = Index / thunks_per_return;
+            static constexpr size_t local = Index % thunks_per_return;
+            static constexpr size_t arity = thunk_arity(local);
+
+            static constexpr thunk_fn get()
+            {
+                return make_thunk<typename thunk_return<ret>::type, arity,
+                                  local - thunk_offset(arity)>::get();
+            }
+        };
+
+        /**
+         * Every thunk, grouped by return kind, then by number of arguments.
+         * A constant table, so looking it up needs no initialization guard
+         */
+        template <size_t... I>
+        inline const thunk_fn* thunk_table(index_sequence<I...>)
+        {
+            static constexpr thunk_fn table[] = {thunk_entry<I>::get()...};
+            return table;
+        }
+
+        /**
+         * Kind of an ffi_type in the thunk table
+         * \return Kind, or -1 if there's no thunk taking the type
+         */
+        inline int thunk_arg_kind(const ffi_type& t)
+        {
+            switch (t.type) {
+            case FFI_TYPE_SINT64:
+            case FFI_TYPE_UINT64:
+                return 0;
+            case FFI_TYPE_POINTER:
+                return 1;
+            case FFI_TYPE_DOUBLE:
+                return 2;
+            default:
+                return -1;
+            }
+        }
+        inline int thunk_return_kind(const ffi_type& t)
+        {
+            switch (t.type) {
+            case FFI_TYPE_SINT64:
+            case FFI_TYPE_UINT64:
+                return 0;
+            case FFI_TYPE_DOUBLE:
+                return 1;
+            case FFI_TYPE_VOID:
+                return 2;
+            default:
+                return -1;
+            }
+        }
+
+        /**
+         * Find the precompiled thunk for a signature
+         * \return Thunk, or nullptr if the signature isn't in the table
+         */
+        inline thunk_fn find_thunk(const ffi_type& ret,
+                                   const std::vector<ffi_type*>& args)
+        {
+            const auto ret_kind = thunk_return_kind(ret);
+            if (ret_kind < 0 || args.size() > CPPFFI_THUNK_MAX_ARGS) {
+                return nullptr;
+            }
+
+            size_t code = 0;
+            for (auto t : args) {
+                const auto kind = thunk_arg_kind(*t);
+                if (kind < 0) {
+                    return nullptr;
+                }
+                code = code * 3 + static_cast<size_t>(kind);
+            }
+            const auto index = static_cast<size_t>(ret_kind) *
+                                   thunks_per_return +
+                               thunk_offset(args.size()) + code;
+            return thunk_table(make_index_sequence<thunk_count>{})[index];
+        }
+    }  // namespace detail
+}  // namespace ffi
+
+#include "cppffi_end.h"
+
+#endif  // CPPFFI_THUNK_H
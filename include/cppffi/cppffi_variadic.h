@@ -0,0 +1,222 @@
+// Copyright 2017 Elias Kosunen
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef CPPFFI_VARIADIC_H
+#define CPPFFI_VARIADIC_H
+
+#include "ffi.h"
+#include <array>
+#include <cstddef>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+#include "cppffi_begin.h"
+
+#include "cppffi.h"
+
+namespace ffi {
+    namespace detail {
+        template <typename T, typename = void>
+        struct promote_impl {
+            using type = T;
+        };
+        template <>
+        struct promote_impl<float> {
+            using type = double;
+        };
+        template <>
+        struct promote_impl<std::nullptr_t> {
+            using type = void*;
+        };
+        // Integers narrower than int and unscoped enums
+        template <typename T>
+        struct promote_impl<
+            T,
+            typename std::enable_if<std::is_integral<T>::value ||
+                                    (std::is_enum<T>::value &&
+                                     std::is_convertible<T, int>::value)>::
+                type> {
+            using type = decltype(+std::declval<T>());
+        };
+
+        /**
+         * Type of an argument passed through `...`, after the default
+         * argument promotions
+         */
+        template <typename T>
+        struct promote
+            : promote_impl<typename std::remove_cv<
+                  typename std::decay<T>::type>::type> {
+        };
+
+        template <typename... T>
+        struct type_list {
+        };
+
+        template <size_t N, typename List, bool = (N == 0)>
+        struct drop_front {
+            using type = List;
+        };
+        template <size_t N, typename First, typename... Rest>
+        struct drop_front<N, type_list<First, Rest...>, false>
+            : drop_front<N - 1, type_list<Rest...>> {
+        };
+
+        /**
+         * Prepared interface for one variadic call shape: the fixed
+         * parameters followed by the promoted variadic argument types.
+         * Created through cif_cache, so every shape is prepared once per
+         * ABI
+         */
+        template <typename Signature, typename... VarT>
+        class var_shape;
+
+        template <typename ReturnT, typename... FixedT, typename... VarT>
+        class var_shape<ReturnT(FixedT...), VarT...> {
+        public:
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmissing-field-initializers"
+            var_shape(abi p_abi, prepare_tag)
+                : m_cif{},
+                  m_argtypes{{&type<FixedT>::ffitype()...,
+                              &type<VarT>::ffitype()...}}
+            {
+                check_status(ffi_prep_cif_var(
+                    &m_cif, p_abi, sizeof...(FixedT),
+                    sizeof...(FixedT) + sizeof...(VarT),
+                    &type<ReturnT>::ffitype(), m_argtypes.data()));
+            }
+#pragma GCC diagnostic pop
+
+            // m_cif points into m_argtypes
+            var_shape(const var_shape&) = delete;
+            var_shape& operator=(const var_shape&) = delete;
+
+            ffi_cif m_cif;
+            std::array<ffi_type*, sizeof...(FixedT) + sizeof...(VarT)>
+                m_argtypes;
+        };
+    }  // namespace detail
+
+    /**
+     * Call InterFace for variadic functions.
+     * T is the signature without the ellipsis: for
+     * `int printf(const char*, ...)` use cif_var<int(const char*)>.
+     *
+     * The interface for every distinct set of variadic argument types is
+     * prepared with ffi_prep_cif_var once and cached for the rest of the
+     * process, so calls with a recurring shape never prepare again.
+     */
+    template <typename T>
+    class cif_var;
+
+    template <typename ReturnT, typename... FixedT>
+    class cif_var<ReturnT(FixedT...)> {
+    public:
+        using function_type = ReturnT(FixedT..., ...);
+
+        explicit cif_var(abi p_abi = FFI_DEFAULT_ABI) : m_abi(p_abi) {}
+
+        /**
+         * Call a variadic function.
+         * The first arguments are converted to the fixed parameter types,
+         * the rest get the default argument promotions
+         * \param fn   Function to call
+         * \param args Fixed arguments, followed by the variadic ones
+         */
+        template <typename... Args>
+        ReturnT call(function_type& fn, Args&&... args) const
+        {
+            static_assert(sizeof...(Args) >= sizeof...(FixedT),
+                          "Too few arguments for the fixed parameters");
+            return _call(
+                fn,
+                typename detail::drop_front<sizeof...(FixedT),
+                                            detail::type_list<Args...>>::type{},
+                std::forward<Args>(args)...);
+        }
+
+        /**
+         * The prepared interface used for calls with the given variadic
+         * argument types
+         */
+        template <typename... VarArgs>
+        const ffi_cif& native() const
+        {
+            return _shape<VarArgs...>().m_cif;
+        }
+
+    private:
+        template <typename... VarArgs>
+        using shape_type =
+            detail::var_shape<ReturnT(FixedT...),
+                              typename detail::promote<VarArgs>::type...>;
+
+        template <typename... VarArgs>
+        shape_type<VarArgs...>& _shape() const
+        {
+            return detail::cif_cache<shape_type<VarArgs...>>::get(m_abi);
+        }
+
+        template <typename... VarArgs, typename... Args>
+        ReturnT _call(function_type& fn,
+                      detail::type_list<VarArgs...>,
+                      Args&&... args) const
+        {
+            auto& shape = _shape<VarArgs...>();
+            std::tuple<FixedT..., typename detail::promote<VarArgs>::type...>
+                values(std::forward<Args>(args)...);
+            return _invoke(shape.m_cif, fn, values,
+                           detail::make_index_sequence<sizeof...(Args)>{});
+        }
+
+        template <typename Tuple, size_t... I>
+        static ReturnT _invoke(ffi_cif& c,
+                               function_type& fn,
+                               Tuple& values,
+                               detail::index_sequence<I...>)
+        {
+            std::array<void*, sizeof...(I)> args{
+                {detail::arg_address(std::get<I>(values))...}};
+            typename detail::call_return<ReturnT>::type ret{};
+            detail::return_slot<ReturnT>::call(c, CPPFFI_FN(&fn), ret,
+                                               args.data());
+            return detail::call_return<ReturnT>::release(std::move(ret));
+        }
+
+        abi m_abi;
+    };
+
+    /**
+     * Call a variadic function through libffi, with the interface for this
+     * shape of arguments taken from the cache
+     */
+    template <typename ReturnT, typename... FixedT, typename... Args>
+    inline ReturnT call_var(ReturnT (&fn)(FixedT..., ...), Args&&... args)
+    {
+        return cif_var<ReturnT(FixedT...)>().call(fn,
+                                                  std::forward<Args>(args)...);
+    }
+}  // namespace ffi
+
+#include "cppffi_end.h"
+
+#endif  // CPPFFI_VARIADIC_H
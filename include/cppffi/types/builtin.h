@@ -22,15 +22,61 @@
 #define CPPFFI_TYPES_BUILTIN_H
 
 #include "ffi.h"
+#include <complex>
+#include <cstddef>
 #include <cstdint>
+#include <tuple>
 #include <type_traits>
+#include <utility>
 
 #include "../cppffi_begin.h"
 
+#include "../cppffi_span.h"
+
+// 8-byte vectors are passed exactly like a double on these ABIs
+#if (defined(__x86_64__) && !defined(_WIN64)) || defined(__aarch64__)
+#define CPPFFI_SHORT_VECTORS 1
+#else
+#define CPPFFI_SHORT_VECTORS 0
+#endif
+
+// std::complex<float> and std::complex<double> are passed and returned like
+// C's _Complex float and _Complex double on these ABIs. Elsewhere, e.g. on
+// i386 System V, the class is returned in memory but _Complex is not
+#if defined(FFI_TARGET_HAS_COMPLEX_TYPE) && \
+    ((defined(__x86_64__) && !defined(_WIN64)) || defined(__aarch64__))
+#define CPPFFI_COMPLEX 1
+#else
+#define CPPFFI_COMPLEX 0
+#endif
+
 namespace ffi {
     template <typename T, typename Enable = void>
     struct type;
 
+    namespace detail {
+        template <typename T>
+        struct is_span : std::false_type {
+        };
+        template <typename T>
+        struct is_span<span<T>> : std::true_type {
+        };
+
+        /// GCC vector extension types, the only scalars with a subscript
+        template <typename T, typename = void>
+        struct is_vector : std::false_type {
+        };
+        template <typename T>
+        struct is_vector<
+            T,
+            typename std::enable_if<
+                !std::is_class<T>::value && !std::is_pointer<T>::value &&
+                !std::is_array<T>::value &&
+                (sizeof(std::declval<T&>()[0]) > 0)>::type>
+            : std::true_type {
+        };
+    }  // namespace detail
+
     template <>
     struct type<void> {
         using arg_type = ffi_arg;
@@ -127,7 +173,7 @@ namespace ffi {
 
     template <>
     struct type<float> {
-        using arg_type = ffi_arg;
+        using arg_type = float;
 
         static constexpr ffi_type& ffitype()
         {
@@ -136,7 +182,7 @@ namespace ffi {
     };
     template <>
     struct type<double> {
-        using arg_type = ffi_arg;
+        using arg_type = double;
 
         static constexpr ffi_type& ffitype()
         {
@@ -145,7 +191,7 @@ namespace ffi {
     };
     template <>
     struct type<long double> {
-        using arg_type = ffi_arg;
+        using arg_type = long double;
 
         static constexpr ffi_type& ffitype()
         {
@@ -153,11 +199,64 @@ namespace ffi {
         }
     };
 
+    /**
+     * std::complex, where it matches C's _Complex; see CPPFFI_COMPLEX.
+     * std::complex<long double> never does: on x86-64 the class is returned
+     * in memory, but _Complex long double on the x87 stack
+     */
+    template <typename T>
+    struct type<std::complex<T>> {
+        static_assert(sizeof(T) == 0,
+                      "libffi can't pass this std::complex type by value");
+    };
+#if CPPFFI_COMPLEX
+    template <>
+    struct type<std::complex<float>> {
+        using arg_type = std::complex<float>;
+
+        static constexpr ffi_type& ffitype()
+        {
+            return ffi_type_complex_float;
+        }
+    };
+    template <>
+    struct type<std::complex<double>> {
+        using arg_type = std::complex<double>;
+
+        static constexpr ffi_type& ffitype()
+        {
+            return ffi_type_complex_double;
+        }
+    };
+#endif
+
+    /**
+     * GCC vector extension types, like __m64 or
+     * float __attribute__((vector_size(8))).
+     * libffi has no vector types, so only vectors that the ABI passes
+     * exactly like some libffi type work. 8-byte vectors travel in one SIMD
+     * register, just like a double, on x86-64 System V and AArch64. Wider
+     * vectors such as __m128 or __m256d are classified unlike anything
+     * libffi can describe, and are rejected at compile time
+     */
+    template <typename T>
+    struct type<T, typename std::enable_if<detail::is_vector<T>::value>::type> {
+        static_assert(CPPFFI_SHORT_VECTORS && sizeof(T) == 8,
+                      "libffi can't pass this vector type by value");
+
+        using arg_type = T;
+
+        static constexpr ffi_type& ffitype()
+        {
+            return ffi_type_double;
+        }
+    };
+
     template <typename T>
     struct type<T,
                 typename std::enable_if<std::is_pointer<
                     typename std::decay<T>::type>::value>::type> {
-        using arg_type = ffi_arg;
+        using arg_type = typename std::decay<T>::type;
 
         static constexpr ffi_type& ffitype()
         {
@@ -165,14 +264,60 @@ namespace ffi {
         }
     };
 
+    /**
+     * A span parameter expands to two native parameters: a pointer to the
+     * first element and the element count. A function taking
+     * (const T*, size_t) can then be called with a span, std::vector,
+     * std::array or C array, and the elements are never copied.
+     *
+     * Types that expand like this define params, native, ffitypes() and
+     * addresses() instead of ffitype()
+     */
     template <typename T>
-    struct type<T, typename std::enable_if<!std::is_pointer<
-        typename std::decay<T>::type>::value>::type> {
+    struct type<span<T>> {
+        using arg_type = T*;
+
+        /// Number of native parameters
+        static constexpr std::size_t params = 2;
+        /// The native parameters, as a function type
+        using native = void(T*, std::size_t);
+
+        static void ffitypes(ffi_type** out)
+        {
+            out[0] = &ffi_type_pointer;
+            out[1] = sizeof(std::size_t) == sizeof(uint64_t)
+                         ? &ffi_type_uint64
+                         : &ffi_type_uint32;
+        }
+
+        /// Argument addresses for libffi, pointing into the span itself
+        static void addresses(const span<T>& s, void** out)
+        {
+            out[0] = const_cast<void*>(static_cast<const void*>(&s.m_data));
+            out[1] = const_cast<void*>(static_cast<const void*>(&s.m_size));
+        }
+
+        /// The native arguments, for calling the function directly
+        static std::tuple<T*, std::size_t> unpack(const span<T>& s)
+        {
+            return std::tuple<T*, std::size_t>(s.m_data, s.m_size);
+        }
+    };
+
+    template <typename T>
+    struct type<T,
+                typename std::enable_if<
+                    !std::is_pointer<typename std::decay<T>::type>::value &&
+                    !detail::is_span<T>::value &&
+                    !detail::is_vector<T>::value>::type> {
         using arg_type = ffi_arg;
 
-        static const ffi_type& ffitype()
+        // A template, so that types without create_ffitype() can be told
+        // apart in SFINAE contexts
+        template <typename U = T>
+        static auto ffitype() -> decltype(U::create_ffitype())
         {
-            return T::create_ffitype();
+            return U::create_ffitype();
         }
     };
 }  // namespace ffi
@@ -21,63 +21,199 @@
 #ifndef CPPFFI_TYPES_STRUCTS_H
 #define CPPFFI_TYPES_STRUCTS_H
 
-#include "../cppffi_begin.h"
-
 #include "ffi.h"
-#include <array>
+#include <cstddef>
 #include <type_traits>
 
+#include "../cppffi_begin.h"
+
+#include "../cppffi_support.h"
+#include "builtin.h"
+
 namespace ffi {
-    template <typename T>
-    class struct_type_specialize;
+    /**
+     * Describes one member of a struct for struct_type:
+     * its type and its offset in the struct
+     */
+    template <typename T, size_t Offset>
+    struct field {
+        using type = T;
+        static constexpr size_t offset = Offset;
+    };
 
-    template <typename StructT>
-    class struct_type_specialize<StructT> {
-    public:
-        static const ffi_type& create_ffitype()
+/**
+ * Describe the member m of struct S for struct_type
+ */
+#define CPPFFI_FIELD(S, m) ::ffi::field<decltype(S::m), offsetof(S, m)>
+
+    namespace detail {
+        template <typename... T>
+        struct any_array : std::false_type {
+        };
+        template <typename First, typename... Rest>
+        struct any_array<First, Rest...>
+            : std::integral_constant<bool,
+                                     std::is_array<First>::value ||
+                                         any_array<Rest...>::value> {
+        };
+
+        constexpr size_t layout_align(size_t n, size_t alignment)
         {
-            static ffi_type t;
-            t.size = t.alignment = 0;
-            t.type = FFI_TYPE_STRUCT;
+            return (n + alignment - 1) / alignment * alignment;
+        }
 
-            static ffi_type* field = nullptr;
-            t.elements = &field;
+        /**
+         * C layout of a sequence of fields, computed at compile time.
+         * End is the end of the previous field, Alignment the largest
+         * alignment so far
+         */
+        template <size_t End, size_t Alignment, typename... Fields>
+        struct struct_layout {
+            static constexpr size_t size = layout_align(End, Alignment);
+            static constexpr size_t alignment = Alignment;
+            static constexpr bool offsets_match = true;
+        };
 
-            return t;
+        template <size_t End,
+                  size_t Alignment,
+                  typename Field,
+                  typename... Fields>
+        struct struct_layout<End, Alignment, Field, Fields...> {
+            using field_type = typename Field::type;
+
+            static_assert(!std::is_array<field_type>::value,
+                          "Array members aren't supported: type<> would "
+                          "pass them as a pointer");
+
+            static constexpr size_t offset =
+                layout_align(End, alignof(field_type));
+
+            using rest = struct_layout<offset + sizeof(field_type),
+                                       (alignof(field_type) > Alignment
+                                            ? alignof(field_type)
+                                            : Alignment),
+                                       Fields...>;
+
+            static constexpr size_t size = rest::size;
+            static constexpr size_t alignment = rest::alignment;
+            static constexpr bool offsets_match =
+                offset == Field::offset && rest::offsets_match;
+        };
+
+        /**
+         * Fill in the size and alignment of a struct type the same way
+         * ffi_prep_cif would, so the type never changes after it's shared.
+         * \throw bad_typedef if a member hasn't been laid out yet, i.e. its
+         *        alignment is 0
+         */
+        inline void layout_struct(ffi_type& t)
+        {
+            size_t size = 0;
+            unsigned short alignment = 1;
+            for (auto e = t.elements; *e; ++e) {
+                if ((*e)->alignment == 0) {
+                    CPPFFI_THROW(bad_typedef());
+                }
+                size = layout_align(size, (*e)->alignment) + (*e)->size;
+                if ((*e)->alignment > alignment) {
+                    alignment = (*e)->alignment;
+                }
+            }
+            t.size = layout_align(size, alignment);
+            t.alignment = alignment;
         }
-    };
 
-    template <typename StructT, typename... FieldsT>
-    class struct_type_specialize<StructT, FieldsT...> {
-    public:
-        static const ffi_type& create_ffitype()
+        inline ffi_type make_struct_type(ffi_type** elements)
         {
-            static ffi_type t;
-            t.size = t.alignment = 0;
+            ffi_type t;
+            t.size = 0;
+            t.alignment = 0;
+            t.type = FFI_TYPE_STRUCT;
+            t.elements = elements;
+            layout_struct(t);
+            return t;
+        }
+    }  // namespace detail
 
-            static std::array<ffi_type*, sizeof...(FieldsT) + 1> fields;
-            _fill_fields<decltype(fields), 0>(fields);
-            fields[sizeof...(FieldsT)] = nullptr;
-            t.elements = &fields[0];
+    /**
+     * ffi_type for a struct, described field by field:
+     *
+     *     struct point {
+     *         int32_t x, y;
+     *
+     *         static ffi_type& create_ffitype()
+     *         {
+     *             return ffi::struct_type<point, CPPFFI_FIELD(point, x),
+     *                                     CPPFFI_FIELD(point, y)>::
+     *                 create_ffitype();
+     *         }
+     *     };
+     *
+     * The layout is computed at compile time and checked against the real
+     * struct. The ffi_type is created once, with its size and alignment
+     * already filled in, and never modified afterwards, so it can be shared
+     * between threads freely.
+     */
+    template <typename StructT, typename... Fields>
+    class struct_type {
+        using layout = detail::struct_layout<0, 1, Fields...>;
 
+        static_assert(sizeof...(Fields) > 0,
+                      "struct_type needs at least one field");
+        static_assert(std::is_standard_layout<StructT>::value,
+                      "struct_type requires a standard-layout struct");
+        static_assert(layout::offsets_match,
+                      "Field offsets don't match the struct: fields must be "
+                      "listed in declaration order");
+        static_assert(layout::size == sizeof(StructT),
+                      "Fields don't cover the whole struct");
+        static_assert(layout::alignment == alignof(StructT),
+                      "Alignment of the fields doesn't match the struct");
+
+    public:
+        static constexpr size_t size = layout::size;
+        static constexpr size_t alignment = layout::alignment;
+
+        static ffi_type& create_ffitype()
+        {
+            static ffi_type* elements[] = {
+                &type<typename Fields::type>::ffitype()..., nullptr};
+            static ffi_type t = {size, static_cast<unsigned short>(alignment),
+                                 FFI_TYPE_STRUCT, elements};
             return t;
         }
+    };
 
-    private:
-        template <typename Container, size_t Index, typename Field>
-        static void _fill_fields(Container& arr)
+    /**
+     * ffi_type for a struct, described by the types of its fields in order.
+     * The type is created once, with its layout computed the way
+     * ffi_prep_cif would, and never modified afterwards.
+     * Prefer struct_type, which also checks the layout at compile time
+     */
+    template <typename StructT, typename... FieldsT>
+    class struct_type_specialize {
+        static_assert(!detail::any_array<FieldsT...>::value,
+                      "Array members aren't supported: type<> would pass "
+                      "them as a pointer");
+
+    public:
+        static ffi_type& create_ffitype()
         {
-            arr[Index] = Field::ffitype();
+            static ffi_type* fields[] = {&type<FieldsT>::ffitype()...,
+                                         nullptr};
+            static ffi_type t = detail::make_struct_type(fields);
+            return t;
         }
+    };
 
-        template <typename Container,
-                  size_t Index,
-                  typename FirstField,
-                  typename... Fields>
-        static void _fill_fields(Container& arr)
+    template <typename StructT>
+    class struct_type_specialize<StructT> {
+    public:
+        static ffi_type& create_ffitype()
         {
-            arr[Index] = FirstField::ffitype();
-            _fill_fields<Container, Index + 1, Fields...>(arr);
+            static ffi_type* field = nullptr;
+            static ffi_type t = detail::make_struct_type(&field);
+            return t;
         }
     };
 }  // namespace ffi
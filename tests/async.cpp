@@ -0,0 +1,189 @@
+// Copyright 2017 Elias Kosunen
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <doctest.h>
+#include <cppffi.h>
+#include <chrono>
+#include <future>
+#include <thread>
+#include <vector>
+
+static int64_t slow_square(int64_t x)
+{
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    return x * x;
+}
+
+static int32_t async_ticks = 0;
+
+static void async_tick()
+{
+    ++async_ticks;
+}
+
+static int64_t async_total(const int32_t* values, size_t n)
+{
+    int64_t total = 0;
+    for (size_t i = 0; i < n; ++i) {
+        total += values[i];
+    }
+    return total;
+}
+
+static double async_sum(double a, float b)
+{
+    return a + static_cast<double>(b);
+}
+
+namespace {
+    // Runs tasks on the submitting thread, when asked to
+    class manual_executor {
+    public:
+        void submit(ffi::task& t)
+        {
+            m_tasks.push_back(&t);
+        }
+
+        void run_all()
+        {
+            for (auto t : m_tasks) {
+                t->run();
+            }
+            m_tasks.clear();
+        }
+
+    private:
+        std::vector<ffi::task*> m_tasks{};
+    };
+}  // namespace
+
+TEST_CASE("callable::call_async")
+{
+    ffi::cif<int64_t(int64_t)> c;
+    auto bound = c.bind(slow_square);
+
+    SUBCASE("Global pool")
+    {
+        std::vector<ffi::future<int64_t>> results;
+        for (int64_t i = 0; i < 8; ++i) {
+            results.push_back(bound.call_async(i));
+        }
+        for (int64_t i = 0; i < 8; ++i) {
+            CHECK(results[static_cast<size_t>(i)].get() == i * i);
+        }
+    }
+
+    SUBCASE("Arguments are copied")
+    {
+        ffi::thread_pool pool(1);
+        ffi::cif<double(double, float)> sc;
+        double a = 1.5;
+        float b = 0.25f;
+        auto f = sc.bind(async_sum).call_async(pool, a, b);
+        a = 0.0;
+        b = 0.0f;
+        CHECK(f.get() == doctest::Approx(1.75));
+        CHECK_FALSE(f.valid());
+    }
+
+    SUBCASE("Custom executor")
+    {
+        manual_executor ex;
+        auto f = bound.call_async(ex, 7);
+        CHECK_FALSE(f.ready());
+        ex.run_all();
+        CHECK(f.ready());
+        CHECK(f.get() == 49);
+
+        async_ticks = 0;
+        ffi::cif<void()> vc;
+        auto v = vc.bind(async_tick).call_async(ex);
+        ex.run_all();
+        v.get();
+        CHECK(async_ticks == 1);
+    }
+
+    SUBCASE("Span arguments outlive their container")
+    {
+        manual_executor ex;
+        ffi::cif<int64_t(ffi::span<const int32_t>)> sc;
+        auto f = sc.bind(async_total)
+                     .call_async(ex, std::vector<int32_t>{1, 2, 3});
+        ex.run_all();
+        CHECK(f.get() == 6);
+    }
+
+    SUBCASE("Destroying a pending future waits for the call")
+    {
+        async_ticks = 0;
+        ffi::cif<void()> vc;
+        {
+            ffi::thread_pool pool(1);
+            auto v = vc.bind(async_tick).call_async(pool);
+        }
+        CHECK(async_ticks == 1);
+    }
+}
+
+#if CPPFFI_HAS_COROUTINES
+namespace {
+    struct detached {
+        struct promise_type {
+            detached get_return_object()
+            {
+                return {};
+            }
+            std::suspend_never initial_suspend() noexcept
+            {
+                return {};
+            }
+            std::suspend_never final_suspend() noexcept
+            {
+                return {};
+            }
+            void return_void() {}
+            void unhandled_exception()
+            {
+                std::terminate();
+            }
+        };
+    };
+
+// The coroutine machinery generated by GCC trips these
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wswitch-default"
+#pragma GCC diagnostic ignored "-Wzero-as-null-pointer-constant"
+    detached square_twice(ffi::callable<int64_t(int64_t)> c,
+                          std::promise<int64_t>& result)
+    {
+        const auto x = co_await c.call_async(3);
+        result.set_value(co_await c.call_async(x));
+    }
+#pragma GCC diagnostic pop
+}  // namespace
+
+TEST_CASE("co_await callable::call_async")
+{
+    ffi::cif<int64_t(int64_t)> c;
+    std::promise<int64_t> result;
+    square_twice(c.bind(slow_square), result);
+    CHECK(result.get_future().get() == 81);
+}
+#endif
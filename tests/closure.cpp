@@ -0,0 +1,145 @@
+// Copyright 2017 Elias Kosunen
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <doctest.h>
+#include <cppffi.h>
+#include <cstdlib>
+#include <vector>
+
+extern "C" {
+typedef int (*compare_fn)(const void*, const void*);
+typedef void (*visit_fn)(int32_t);
+}
+
+static void visit_all(visit_fn visit, int32_t count)
+{
+    for (int32_t i = 0; i < count; ++i) {
+        visit(i);
+    }
+}
+
+TEST_CASE("closure")
+{
+    SUBCASE("Stateful qsort comparator")
+    {
+        int calls = 0;
+        ffi::closure<int(const void*, const void*)> cmp(
+            [&calls](const void* a, const void* b) {
+                ++calls;
+                return *static_cast<const int*>(a) -
+                       *static_cast<const int*>(b);
+            });
+        compare_fn fn = cmp.get();
+
+        std::vector<int> values{5, 3, 9, 1, 7};
+        std::qsort(values.data(), values.size(), sizeof(int), fn);
+        CHECK(values == std::vector<int>{1, 3, 5, 7, 9});
+        CHECK(calls > 0);
+    }
+
+    SUBCASE("Void return")
+    {
+        int32_t sum = 0;
+        ffi::closure<void(int32_t)> visit([&sum](int32_t i) { sum += i; });
+        visit_all(visit.get(), 5);
+        CHECK(sum == 10);
+    }
+
+    SUBCASE("Narrow and floating point returns")
+    {
+        ffi::closure<int8_t(int8_t)> negate(
+            [](int8_t v) { return static_cast<int8_t>(-v); });
+        CHECK(negate.get()(int8_t{7}) == -7);
+
+        double factor = 2.5;
+        ffi::closure<double(float, double)> scale(
+            [factor](float a, double b) {
+                return static_cast<double>(a) * b * factor;
+            });
+        CHECK(scale.get()(2.0f, 3.0) == doctest::Approx(15.0));
+    }
+
+    SUBCASE("Move")
+    {
+        ffi::closure<int32_t(int32_t)> a([](int32_t v) { return v + 1; });
+        auto fn = a.get();
+        ffi::closure<int32_t(int32_t)> b(std::move(a));
+        CHECK(b.get() == fn);
+        CHECK(b.get()(1) == 2);
+
+        ffi::closure<int32_t(int32_t)> c([](int32_t v) { return v * 2; });
+        c = std::move(b);
+        CHECK(c.get()(4) == 5);
+    }
+}
+
+TEST_CASE("closure_pool")
+{
+    ffi::closure_pool pool(4);
+
+    SUBCASE("Recycles trampolines")
+    {
+        void* first = nullptr;
+        {
+            ffi::closure<int32_t(int32_t)> c([](int32_t v) { return v + 1; },
+                                             pool);
+            first = reinterpret_cast<void*>(c.get());
+            CHECK(c.get()(1) == 2);
+            CHECK(pool.allocated() == 4);
+            CHECK(pool.available() == 3);
+        }
+        CHECK(pool.available() == 4);
+
+        ffi::closure<int32_t(int32_t)> c([](int32_t v) { return v * 3; },
+                                         pool);
+        CHECK(reinterpret_cast<void*>(c.get()) == first);
+        CHECK(c.get()(2) == 6);
+        CHECK(pool.allocated() == 4);
+    }
+
+    SUBCASE("Grows in batches")
+    {
+        std::vector<ffi::closure<int32_t(int32_t)>> live;
+        for (int32_t i = 0; i < 6; ++i) {
+            live.emplace_back([i](int32_t v) { return v + i; }, pool);
+        }
+        CHECK(pool.allocated() == 8);
+        for (int32_t i = 0; i < 6; ++i) {
+            CHECK(live[static_cast<size_t>(i)].get()(10) == 10 + i);
+        }
+        live.clear();
+        CHECK(pool.available() == 8);
+    }
+
+    SUBCASE("Reserve")
+    {
+        pool.reserve(10);
+        CHECK(pool.available() == 10);
+        CHECK(pool.allocated() == 10);
+    }
+
+    SUBCASE("Thread-local pool")
+    {
+        auto& local = ffi::closure_pool::local();
+        CHECK(&local == &ffi::closure_pool::local());
+        ffi::closure<int32_t()> c([] { return int32_t{5}; }, local);
+        CHECK(c.get()() == 5);
+    }
+}
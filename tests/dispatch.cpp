@@ -0,0 +1,149 @@
+// Copyright 2017 Elias Kosunen
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <doctest.h>
+#include <cppffi.h>
+#include <cppffi_dispatch.h>
+#include <cppffi_signature.h>
+#include <array>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+static int64_t add3(int64_t a, int64_t b, int64_t c)
+{
+    return a + b + c;
+}
+
+static double scale(double v, int32_t factor)
+{
+    return v * factor;
+}
+
+static int8_t clamp8(int32_t v)
+{
+    return static_cast<int8_t>(v > 127 ? 127 : (v < -128 ? -128 : v));
+}
+
+static int64_t calls = 0;
+
+static void tick()
+{
+    ++calls;
+}
+
+TEST_CASE("dispatch_table")
+{
+    ffi::dispatch_table table(4);
+    const auto add_id = table.add("l(lll)", add3);
+    const auto scale_id = table.add("d(di)", scale);
+    const auto clamp_id = table.add("c(i)", clamp8);
+    const auto tick_id = table.add(ffi::signature("v()"), tick);
+
+    CHECK(table.size() == 4);
+    CHECK(add_id == 0);
+    CHECK(tick_id == 3);
+    CHECK(&table.interface(scale_id) == &ffi::signature("d(di)"));
+
+    SUBCASE("invoke")
+    {
+        CHECK(table.invoke<int64_t>(add_id, int64_t{1}, int64_t{2},
+                                    int64_t{3}) == 6);
+        CHECK(table.invoke<double>(scale_id, 1.5, int32_t{4}) ==
+              doctest::Approx(6.0));
+        CHECK(table.invoke<int8_t>(clamp_id, int32_t{1000}) == 127);
+
+        calls = 0;
+        table.invoke<void>(tick_id);
+        CHECK(calls == 1);
+
+        CHECK_THROWS_AS(table.invoke<int64_t>(4), ffi::bad_function_id);
+        CHECK_THROWS_AS(table.invoke<int64_t>(add_id, int64_t{1}),
+                        ffi::bad_argument_count);
+    }
+
+    SUBCASE("Frames")
+    {
+        ffi::dynamic_frame frame(table.interface(scale_id));
+        frame.set(0, 2.0);
+        frame.set(1, int32_t{-3});
+        table.call(scale_id, frame);
+        CHECK(frame.ret<double>() == doctest::Approx(-6.0));
+    }
+
+    SUBCASE("call_batch")
+    {
+        int64_t a = 10, b = 20, c = 30;
+        double v = 0.5;
+        int32_t f = 8, big = -500;
+        void* add_args[] = {&a, &b, &c};
+        void* scale_args[] = {&v, &f};
+        void* clamp_args[] = {&big};
+
+        int64_t sum = 0;
+        double scaled = 0;
+        ffi_arg clamped = 0, none = 0;
+
+        calls = 0;
+        const std::vector<ffi::dispatch_table::id_type> ids{
+            add_id, scale_id, tick_id, clamp_id, tick_id};
+        const std::array<void*, 5> rets{
+            {&sum, &scaled, &none, &clamped, &none}};
+        const std::array<void**, 5> args{
+            {add_args, scale_args, nullptr, clamp_args, nullptr}};
+        table.call_batch(ids, rets, args);
+
+        CHECK(sum == 60);
+        CHECK(scaled == doctest::Approx(4.0));
+        CHECK(static_cast<int8_t>(clamped) == -128);
+        CHECK(calls == 2);
+
+        CHECK_THROWS_AS(table.call_batch(ids, rets, {args.data(), 4}),
+                        ffi::bad_batch_size);
+    }
+
+    SUBCASE("Concurrent calls")
+    {
+        std::vector<int64_t> results(8, 0);
+        std::vector<std::thread> threads;
+        for (size_t i = 0; i < results.size(); ++i) {
+            threads.emplace_back([&table, &results, add_id, i] {
+                const auto n = static_cast<int64_t>(i);
+                results[i] = table.invoke<int64_t>(add_id, n, n, n);
+            });
+        }
+        for (auto& t : threads) {
+            t.join();
+        }
+        CHECK(results[7] == 21);
+    }
+}
+
+TEST_CASE("dispatch_table entry storage")
+{
+    // std::allocator ignores alignas(32) before C++17
+    ffi::detail::dispatch_entries entries;
+    for (int i = 0; i < 200; ++i) {
+        entries.push_back(ffi::detail::dispatch_entry{});
+        CHECK(reinterpret_cast<std::uintptr_t>(entries.data()) % 32 == 0);
+    }
+    entries.shrink_to_fit();
+    CHECK(reinterpret_cast<std::uintptr_t>(entries.data()) % 32 == 0);
+}
@@ -0,0 +1,282 @@
+// Copyright 2017 Elias Kosunen
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <doctest.h>
+#include <cppffi.h>
+#include <cppffi_dynamic.h>
+
+static int32_t mix(int32_t a, float b, const int32_t* c)
+{
+    return a + static_cast<int32_t>(b) + *c;
+}
+
+static double sum3(double a, double b, double c)
+{
+    return a + b + c;
+}
+
+static int8_t negate(int8_t v)
+{
+    return static_cast<int8_t>(-v);
+}
+
+struct span3 {
+    int64_t begin;
+    int64_t end;
+    int64_t step;
+
+    static ffi_type& create_ffitype()
+    {
+        return ffi::struct_type_specialize<span3, int64_t, int64_t,
+                                           int64_t>::create_ffitype();
+    }
+};
+
+static int64_t steps(int8_t scale, span3 s)
+{
+    return scale * (s.end - s.begin) / s.step;
+}
+
+static int64_t offset_of(const char* base, const char* p, int64_t bias)
+{
+    return (p - base) + bias;
+}
+
+static double weighted(int64_t a, double w, int64_t b, double v)
+{
+    return static_cast<double>(a) * w + static_cast<double>(b) * v;
+}
+
+static int64_t last_store = 0;
+
+static void store(int64_t v)
+{
+    last_store = v;
+}
+
+static double pi()
+{
+    return 3.25;
+}
+
+TEST_CASE("dynamic_cif")
+{
+    SUBCASE("Mixed arguments")
+    {
+        ffi::dynamic_cif c(ffi::type<int32_t>::ffitype(),
+                           {&ffi::type<int32_t>::ffitype(),
+                            &ffi::type<float>::ffitype(),
+                            &ffi::type<const int32_t*>::ffitype()});
+        CHECK(c.arg_count() == 3);
+        CHECK(c.arg_offset(1) % alignof(float) == 0);
+        CHECK(c.arg_offset(2) % alignof(void*) == 0);
+
+        const int32_t three = 3;
+        auto f = c.bind(mix);
+        CHECK(f.invoke<int32_t>(int32_t{1}, 2.0f, &three) == 6);
+    }
+
+    SUBCASE("Explicit frame")
+    {
+        ffi::dynamic_cif c(ffi::type<double>::ffitype(),
+                           std::vector<ffi_type*>(
+                               3, &ffi::type<double>::ffitype()));
+        auto f = c.bind(sum3);
+        ffi::dynamic_frame frame(c);
+        frame.set(0, 1.0);
+        frame.set(1, 2.0);
+        frame.set(2, 3.5);
+        f.call(frame);
+        CHECK(frame.ret<double>() == doctest::Approx(6.5));
+    }
+
+    SUBCASE("Narrow return")
+    {
+        ffi::dynamic_cif c(ffi::type<int8_t>::ffitype(),
+                           {&ffi::type<int8_t>::ffitype()});
+        CHECK(c.bind(negate).invoke<int8_t>(int8_t{5}) == -5);
+    }
+
+    SUBCASE("Struct argument")
+    {
+        ffi::dynamic_cif c(ffi::type<int64_t>::ffitype(),
+                           {&ffi::type<int8_t>::ffitype(),
+                            &ffi::type<span3>::ffitype()});
+        CHECK(c.arg_offset(1) % 8 == 0);
+        CHECK(c.bind(steps).invoke<int64_t>(int8_t{2}, span3{0, 10, 2}) ==
+              10);
+    }
+
+    SUBCASE("Large frame")
+    {
+        ffi::dynamic_cif c(ffi::type<double>::ffitype(),
+                           std::vector<ffi_type*>(
+                               16, &ffi::type<span3>::ffitype()));
+        CHECK(c.frame_size() > CPPFFI_FRAME_INLINE_SIZE);
+        ffi::dynamic_frame frame(c);
+        frame.set(15, span3{1, 2, 3});
+        CHECK(reinterpret_cast<uintptr_t>(frame.arg(15)) % 8 == 0);
+        CHECK(frame.args()[15] == frame.arg(15));
+    }
+
+    SUBCASE("Mismatched arguments")
+    {
+        ffi::dynamic_cif c(ffi::type<double>::ffitype(),
+                           std::vector<ffi_type*>(
+                               3, &ffi::type<double>::ffitype()));
+        auto f = c.bind(sum3);
+        CHECK_THROWS_AS(f.invoke<double>(1.0, 2.0), ffi::bad_argument_count);
+        CHECK_THROWS_AS(f.invoke<double>(1.0, 2.0, 3.0f),
+                        ffi::bad_argument_type);
+
+        // Same size, different type
+        ffi::dynamic_cif m(ffi::type<int32_t>::ffitype(),
+                           {&ffi::type<int32_t>::ffitype(),
+                            &ffi::type<float>::ffitype(),
+                            &ffi::type<const int32_t*>::ffitype()});
+        ffi::dynamic_frame frame(m);
+        CHECK_THROWS_AS(frame.set(0, 1.0f), ffi::bad_argument_type);
+        CHECK_THROWS_AS(frame.set(1, int32_t{1}), ffi::bad_argument_type);
+        CHECK_THROWS_AS(frame.ret<float>(), ffi::bad_argument_type);
+        CHECK_THROWS_AS(frame.ret<uint32_t>(), ffi::bad_argument_type);
+        CHECK_NOTHROW(frame.set(0, int32_t{1}));
+        CHECK_NOTHROW(frame.ret<int32_t>());
+    }
+}
+
+TEST_CASE("Precompiled thunks")
+{
+    auto& i64 = ffi::type<int64_t>::ffitype();
+    auto& dbl = ffi::type<double>::ffitype();
+    auto& ptr = ffi::type<const char*>::ffitype();
+
+    SUBCASE("Matching signatures")
+    {
+        ffi::dynamic_cif c(i64, {&ptr, &ptr, &i64});
+        CHECK(c.has_thunk());
+        const char* text = "abcdef";
+        CHECK(c.bind(offset_of).invoke<int64_t>(text, text + 4,
+                                                int64_t{10}) == 14);
+
+        ffi::dynamic_cif w(dbl, {&i64, &dbl, &i64, &dbl});
+        CHECK(w.has_thunk());
+        CHECK(w.bind(weighted).invoke<double>(int64_t{2}, 0.5, int64_t{3},
+                                              2.0) == doctest::Approx(7.0));
+
+        ffi::dynamic_cif v(ffi::type<void>::ffitype(), {&i64});
+        CHECK(v.has_thunk());
+        v.bind(store).invoke<void>(int64_t{-42});
+        CHECK(last_store == -42);
+
+        ffi::dynamic_cif n(dbl, {});
+        CHECK(n.has_thunk());
+        CHECK(n.bind(pi).invoke<double>() == doctest::Approx(3.25));
+    }
+
+    SUBCASE("Other signatures go through libffi")
+    {
+        auto& i32 = ffi::type<int32_t>::ffitype();
+        CHECK_FALSE(ffi::dynamic_cif(i32, {&i32}).has_thunk());
+        CHECK_FALSE(ffi::dynamic_cif(dbl, {&dbl, &dbl, &dbl, &dbl, &dbl})
+                        .has_thunk());
+        auto& s3 = span3::create_ffitype();
+        CHECK_FALSE(ffi::dynamic_cif(dbl, {&s3}).has_thunk());
+    }
+}
+
+namespace {
+    struct counting_allocator {
+        int allocations{0};
+        int deallocations{0};
+
+        static void* allocate(std::size_t size, void* context)
+        {
+            ++static_cast<counting_allocator*>(context)->allocations;
+            return ::operator new(size);
+        }
+        static void deallocate(void* block, std::size_t, void* context)
+        {
+            ++static_cast<counting_allocator*>(context)->deallocations;
+            ::operator delete(block);
+        }
+
+        ffi::arena_allocator get()
+        {
+            return {&allocate, &deallocate, this};
+        }
+    };
+}  // namespace
+
+TEST_CASE("frame_arena")
+{
+    counting_allocator counter;
+
+    SUBCASE("Memory is reused after rewinding")
+    {
+        ffi::frame_arena arena(1024, counter.get());
+        for (int i = 0; i < 3; ++i) {
+            const auto m = arena.position();
+            auto a = arena.allocate(100, 8);
+            auto b = arena.allocate(200, 64);
+            CHECK(reinterpret_cast<uintptr_t>(b) % 64 == 0);
+            CHECK(static_cast<char*>(b) >= static_cast<char*>(a) + 100);
+            arena.rewind(m);
+        }
+        CHECK(counter.allocations == 1);
+        CHECK(arena.reserved() == 1024);
+    }
+
+    SUBCASE("Oversized requests get their own block")
+    {
+        {
+            ffi::frame_arena arena(256, counter.get());
+            const auto m = arena.position();
+            arena.allocate(64, 8);
+            const auto inner = arena.position();
+            arena.allocate(4096, 16);
+            CHECK(counter.allocations == 2);
+            arena.rewind(inner);
+            arena.allocate(4096, 16);
+            CHECK(counter.allocations == 2);
+            arena.rewind(m);
+        }
+        CHECK(counter.deallocations == 2);
+    }
+
+    SUBCASE("Frames")
+    {
+        ffi::frame_arena arena(4096, counter.get());
+        ffi::dynamic_cif c(ffi::type<double>::ffitype(),
+                           std::vector<ffi_type*>(
+                               3, &ffi::type<double>::ffitype()));
+        auto f = c.bind(sum3);
+        for (int i = 0; i < 4; ++i) {
+            ffi::dynamic_frame outer(c, arena);
+            ffi::dynamic_frame inner(c, arena);
+            CHECK(inner.arg(0) != outer.arg(0));
+            inner.set(0, 1.0);
+            inner.set(1, 2.0);
+            inner.set(2, 0.5);
+            f.call(inner);
+            CHECK(inner.ret<double>() == doctest::Approx(3.5));
+        }
+        CHECK(counter.allocations == 1);
+    }
+}
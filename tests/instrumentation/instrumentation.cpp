@@ -0,0 +1,225 @@
+// Copyright 2017 Elias Kosunen
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
+#include <doctest.h>
+#include <cppffi.h>
+#include <cppffi_dynamic.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+static int32_t add(int32_t a, int32_t b)
+{
+    return a + b;
+}
+
+static double scale(double x, int32_t n)
+{
+    return x * n;
+}
+
+static const ffi::call_stats* find(const std::vector<ffi::call_stats>& stats,
+                                   void (*fn)())
+{
+    for (auto& s : stats) {
+        if (s.fn == fn) {
+            return &s;
+        }
+    }
+    return nullptr;
+}
+
+template <typename F>
+static void (*address(F& fn))()
+{
+    return reinterpret_cast<void (*)()>(&fn);
+}
+
+TEST_CASE("describe")
+{
+    ffi::cif<double(int32_t, float, void*)> c;
+    CHECK(ffi::describe(c.native()) == "double(sint32, float, pointer)");
+}
+
+// Runs first, so the global pool exists before the instrumentation does and
+// is torn down after it at exit, when its workers retire their counters
+TEST_CASE("First call on a pool worker")
+{
+    ffi::cif<int32_t(int32_t, int32_t)> c;
+    auto f = c.bind(add).call_async(20, 22);
+    CHECK(f.get() == 42);
+
+    const auto stats = ffi::instrumentation::global().snapshot();
+    const auto adds = find(stats, address(add));
+    REQUIRE(adds != nullptr);
+    CHECK(adds->calls == 1);
+}
+
+TEST_CASE("Call counts and latencies")
+{
+    auto& inst = ffi::instrumentation::global();
+    inst.reset();
+
+    ffi::cif<int32_t(int32_t, int32_t)> c;
+    auto bound = c.bind(add);
+    for (int32_t i = 0; i < 10; ++i) {
+        CHECK(bound(i, 1) == i + 1);
+    }
+
+    std::thread worker([&] {
+        for (int32_t i = 0; i < 5; ++i) {
+            bound(i, i);
+        }
+    });
+    worker.join();
+
+    ffi::cif<double(double, int32_t)> sc;
+    const std::vector<double> xs{1.0, 2.0, 3.0};
+    const std::vector<int32_t> ns{2, 2, 2};
+    std::vector<double> out(xs.size());
+    sc.bind(scale).call_batch(out, xs, ns);
+
+    const auto stats = inst.snapshot();
+    const auto adds = find(stats, address(add));
+    REQUIRE(adds != nullptr);
+    CHECK(adds->calls == 15);
+    CHECK(adds->signature == "sint32(sint32, sint32)");
+    std::uint64_t histogram = 0;
+    for (auto n : adds->histogram) {
+        histogram += n;
+    }
+    CHECK(histogram == 15);
+    CHECK(adds->percentile_ns(1.0) >= adds->percentile_ns(0.5));
+
+    const auto scales = find(stats, address(scale));
+    REQUIRE(scales != nullptr);
+    CHECK(scales->calls == 3);
+    CHECK(&stats.front() == adds);
+
+    inst.reset();
+    CHECK(inst.snapshot().empty());
+}
+
+static int32_t add_at_depth(int depth)
+{
+    if (depth == 0) {
+        return ffi::call(add, 1, 2);
+    }
+    // Moves the next cif to a different stack address
+    volatile char frame[64] = {};
+    return add_at_depth(depth - 1) + frame[depth];
+}
+
+TEST_CASE("Calls through copies of one interface share a site")
+{
+    auto& inst = ffi::instrumentation::global();
+    inst.reset();
+
+    for (int depth = 0; depth < 3; ++depth) {
+        CHECK(add_at_depth(depth) == 3);
+    }
+
+    std::size_t sites = 0;
+    for (auto& s : inst.snapshot()) {
+        if (s.fn == address(add)) {
+            CHECK(s.calls == 3);
+            ++sites;
+        }
+    }
+    CHECK(sites == 1);
+    inst.reset();
+}
+
+namespace {
+    struct hook_log {
+        int pre{0};
+        int post{0};
+        int32_t last{0};
+    };
+
+    void on_pre(const ffi::call_info& info, void* context)
+    {
+        CHECK(info.ns == 0);
+        ++static_cast<hook_log*>(context)->pre;
+    }
+
+    void on_post(const ffi::call_info& info, void* context)
+    {
+        auto log = static_cast<hook_log*>(context);
+        ++log->post;
+        log->last = *static_cast<int32_t*>(info.args[0]);
+    }
+}  // namespace
+
+TEST_CASE("Hooks")
+{
+    auto& inst = ffi::instrumentation::global();
+    hook_log log;
+    inst.set_hooks(on_pre, on_post, &log);
+
+    ffi::cif<int32_t(int32_t, int32_t)> c;
+    c.bind(add)(41, 1);
+    ffi::dynamic_cif dc(ffi::type<int32_t>::ffitype(),
+                        {&ffi::type<int32_t>::ffitype(),
+                         &ffi::type<int32_t>::ffitype()});
+    CHECK(dc.bind(address(add)).invoke<int32_t>(7, 8) == 15);
+
+    inst.set_hooks(nullptr, nullptr, nullptr);
+    c.bind(add)(1, 1);
+
+    CHECK(log.pre == 2);
+    CHECK(log.post == 2);
+    CHECK(log.last == 7);
+}
+
+TEST_CASE("Replacing hooks while calls are in flight")
+{
+    auto& inst = ffi::instrumentation::global();
+    ffi::cif<int32_t(int32_t, int32_t)> c;
+    auto bound = c.bind(add);
+
+    std::atomic<bool> done{false};
+    std::thread caller([&] {
+        while (!done.load()) {
+            bound(1, 2);
+        }
+    });
+
+    // Alternate between installing a fresh set and removing it, as
+    // successive call_recorders do
+    std::vector<hook_log> logs(64);
+    for (auto& log : logs) {
+        inst.set_hooks(on_pre, on_post, &log);
+        CHECK(inst.hooks().context == &log);
+        inst.set_hooks(nullptr, nullptr, nullptr);
+        CHECK(inst.hooks().context == nullptr);
+    }
+    done = true;
+    caller.join();
+
+    hook_log last;
+    inst.set_hooks(on_pre, on_post, &last);
+    bound(5, 6);
+    inst.set_hooks(nullptr, nullptr, nullptr);
+    CHECK(last.pre == 1);
+    CHECK(last.post == 1);
+    CHECK(last.last == 5);
+}
@@ -0,0 +1,130 @@
+// Copyright 2017 Elias Kosunen
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <doctest.h>
+#include <cppffi.h>
+#include <cppffi_recorder.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+#ifndef _WIN32
+
+struct span2 {
+    int32_t a;
+    double b;
+
+    static ffi_type& create_ffitype()
+    {
+        return ffi::struct_type<span2, CPPFFI_FIELD(span2, a),
+                                CPPFFI_FIELD(span2, b)>::create_ffitype();
+    }
+};
+
+static double span_sum(span2 s)
+{
+    return s.a + s.b;
+}
+
+template <typename T>
+static T value_as(const std::vector<unsigned char>& bytes)
+{
+    T value{};
+    CHECK(bytes.size() == sizeof(T));
+    std::memcpy(&value, bytes.data(), std::min(bytes.size(), sizeof(T)));
+    return value;
+}
+
+TEST_CASE("call_recorder")
+{
+    const std::string path = "cppffi_recorder_test.bin";
+    ffi::shared_library lib(CPPFFI_TESTLIB_PATH);
+    auto& add = lib.get<int32_t(int32_t, int32_t)>("testlib_add");
+
+    SUBCASE("Calls are read back in order")
+    {
+        {
+            ffi::call_recorder rec(path);
+            CHECK(add(2, 3) == 5);
+            CHECK(add(40, 2) == 42);
+            CHECK(ffi::call(span_sum, span2{1, 0.5}) == doctest::Approx(1.5));
+            CHECK(rec.recorded() == 3);
+        }
+        add(1, 1);
+
+        ffi::call_log log(path);
+        const auto& calls = log.calls();
+        REQUIRE(calls.size() == 3);
+
+        CHECK(calls[0].seq == 0);
+        CHECK(calls[0].signature == "i(ii)");
+        CHECK(calls[0].name == "testlib_add");
+        CHECK(calls[0].library.find("testlib") != std::string::npos);
+        CHECK_FALSE(calls[0].truncated);
+        REQUIRE(calls[0].values.size() == 3);
+        CHECK(value_as<int32_t>(calls[0].values[0]) == 5);
+        CHECK(value_as<int32_t>(calls[0].values[1]) == 2);
+        CHECK(value_as<int32_t>(calls[0].values[2]) == 3);
+        CHECK(calls[1].function == calls[0].function);
+        CHECK(calls[1].timestamp_ns >= calls[0].timestamp_ns);
+        CHECK(value_as<int32_t>(calls[1].values[0]) == 42);
+
+        CHECK(calls[2].signature == "d({id})");
+        REQUIRE(calls[2].values.size() == 2);
+        const auto s = value_as<span2>(calls[2].values[1]);
+        CHECK(s.a == 1);
+        CHECK(s.b == doctest::Approx(0.5));
+    }
+
+    SUBCASE("The ring keeps the newest calls")
+    {
+        {
+            ffi::call_recorder rec(path, 4);
+            for (int32_t i = 0; i < 10; ++i) {
+                add(i, 0);
+            }
+        }
+        ffi::call_log log(path);
+        REQUIRE(log.calls().size() == 4);
+        CHECK(log.calls()[0].seq == 6);
+        CHECK(value_as<int32_t>(log.calls()[3].values[0]) == 9);
+    }
+
+    SUBCASE("Raw calls are recorded without values")
+    {
+        {
+            ffi::call_recorder rec(path);
+            ffi::cif<int32_t(int32_t, int32_t)> c;
+            CHECK(c.bind(add.address()).call_raw(3, 4) == 7);
+        }
+        ffi::call_log log(path);
+        REQUIRE(log.calls().size() == 1);
+        CHECK(log.calls()[0].signature == "i(ii)");
+        CHECK(log.calls()[0].truncated);
+        CHECK(log.calls()[0].values.empty());
+    }
+
+    CHECK_THROWS_AS(ffi::call_log{"cppffi_no_such_recording.bin"},
+                    ffi::bad_recording);
+    std::remove(path.c_str());
+}
+
+#endif
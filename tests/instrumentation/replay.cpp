@@ -0,0 +1,87 @@
+// Copyright 2017 Elias Kosunen
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <doctest.h>
+#include <cppffi.h>
+#include <cppffi_replay.h>
+#include <cstdio>
+#include <string>
+
+#ifndef _WIN32
+
+static int32_t local_add(int32_t a, int32_t b)
+{
+    return a + b;
+}
+
+TEST_CASE("replay")
+{
+    const std::string path = "cppffi_replay_test.bin";
+    ffi::shared_library lib(CPPFFI_TESTLIB_PATH);
+    auto& add = lib.get<int32_t(int32_t, int32_t)>("testlib_add");
+    auto& scale = lib.get<double(double, int32_t)>("testlib_scale");
+    auto& next = lib.get<int32_t()>("testlib_next");
+
+    {
+        ffi::call_recorder rec(path);
+        add(1, 2);
+        scale(0.5, 3);
+        next();
+        next();
+        ffi::call(local_add, 3, 4);
+    }
+
+    ffi::call_log log(path);
+    REQUIRE(log.calls().size() == 5);
+    ffi::replay r(log, lib);
+    CHECK(r.size() == 4);
+    CHECK(r.skipped() == 1);
+
+    SUBCASE("Calls are issued again")
+    {
+        const auto before = next();
+        const auto report = r.run();
+        CHECK(report.calls == 4);
+        CHECK(next() == before + 3);
+        CHECK(report.p50_ns <= report.max_ns);
+        CHECK(report.calls_per_second > 0);
+    }
+
+    SUBCASE("Repeated and in parallel")
+    {
+        ffi::replay_options options;
+        options.threads = 3;
+        options.repeat = 50;
+        const auto report = r.run(options);
+        CHECK(report.calls == 200);
+        CHECK(report.p99_ns <= report.max_ns);
+    }
+
+    SUBCASE("Recorded pacing")
+    {
+        ffi::replay_options options;
+        options.recorded_pacing = true;
+        CHECK(r.run(options).calls == 4);
+    }
+
+    std::remove(path.c_str());
+}
+
+#endif
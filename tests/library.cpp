@@ -0,0 +1,101 @@
+// Copyright 2017 Elias Kosunen
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <doctest.h>
+#include <cppffi.h>
+#include <thread>
+#include <vector>
+
+TEST_CASE("shared_library")
+{
+    ffi::shared_library lib(CPPFFI_TESTLIB_PATH);
+
+    SUBCASE("Lazy resolution")
+    {
+        auto& add = lib.get<int32_t(int32_t, int32_t)>("testlib_add");
+        CHECK_FALSE(add.resolved());
+        CHECK(add(2, 3) == 5);
+        CHECK(add.resolved());
+        CHECK(add.bind()(4, 5) == 9);
+    }
+
+    SUBCASE("Lookups are cached")
+    {
+        auto& a = lib.get<double(double, int32_t)>("testlib_scale");
+        auto& b = lib.get<double(double, int32_t)>("testlib_scale");
+        CHECK(&a == &b);
+        CHECK(a(1.5, 4) == doctest::Approx(6.0));
+
+        // Same name, different signature
+        auto& c = lib.get<double(double, int64_t)>("testlib_scale");
+        CHECK(static_cast<const void*>(&c) != static_cast<const void*>(&a));
+        CHECK(lib.address("testlib_scale") ==
+              lib.address("testlib_scale"));
+    }
+
+    SUBCASE("Nullary functions")
+    {
+        auto& next = lib.get<int32_t()>("testlib_next");
+        const auto first = next();
+        CHECK(next() == first + 1);
+    }
+
+    SUBCASE("Span parameters")
+    {
+        auto& sum =
+            lib.get<int64_t(ffi::span<const int32_t>)>("testlib_sum");
+        const std::vector<int32_t> values{1, 2, 3, 4};
+        CHECK(sum(values) == 10);
+        CHECK(sum.bind()(ffi::span<const int32_t>(values.data(), 2)) == 3);
+        CHECK(sum.address()(values.data(), values.size()) == 10);
+    }
+
+    SUBCASE("Concurrent first call")
+    {
+        auto& add = lib.get<int32_t(int32_t, int32_t)>("testlib_add");
+        std::vector<std::thread> threads;
+        std::vector<int32_t> results(4);
+        for (size_t i = 0; i < results.size(); ++i) {
+            threads.emplace_back([&add, &results, i] {
+                results[i] = add(static_cast<int32_t>(i), 10);
+            });
+        }
+        for (auto& t : threads) {
+            t.join();
+        }
+        for (size_t i = 0; i < results.size(); ++i) {
+            CHECK(results[i] == static_cast<int32_t>(i) + 10);
+        }
+    }
+
+    SUBCASE("Missing symbol")
+    {
+        auto& missing = lib.get<void()>("testlib_missing");
+        CHECK_THROWS_AS(missing(), ffi::bad_symbol);
+        CHECK_FALSE(missing.resolved());
+        CHECK(lib.address("testlib_missing") == nullptr);
+    }
+
+    SUBCASE("Missing library")
+    {
+        CHECK_THROWS_AS(ffi::shared_library{"libcppffi-missing.so"},
+                        ffi::bad_library);
+    }
+}
@@ -0,0 +1,141 @@
+// Copyright 2017 Elias Kosunen
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <doctest.h>
+#include <cppffi.h>
+#include <atomic>
+#include <numeric>
+#include <thread>
+#include <vector>
+
+static std::atomic<int64_t> total{0};
+
+static void add_to_total(int64_t n)
+{
+    total += n;
+}
+
+static double weigh(double x, int32_t w)
+{
+    return x * w;
+}
+
+TEST_CASE("thread_pool")
+{
+    ffi::thread_pool pool(3);
+    CHECK(pool.size() == 3);
+
+    SUBCASE("parallel_for covers every index once")
+    {
+        std::vector<std::atomic<int>> hits(10007);
+        for (auto& h : hits) {
+            h = 0;
+        }
+        pool.parallel_for(hits.size(), 7, [&](size_t begin, size_t end) {
+            for (auto i = begin; i < end; ++i) {
+                ++hits[i];
+            }
+        });
+
+        bool once = true;
+        for (auto& h : hits) {
+            once = once && h == 1;
+        }
+        CHECK(once);
+    }
+
+    SUBCASE("Nested parallel_for")
+    {
+        std::atomic<size_t> count{0};
+        pool.parallel_for(8, 1, [&](size_t begin, size_t end) {
+            for (auto i = begin; i < end; ++i) {
+                pool.parallel_for(100, 10, [&](size_t b, size_t e) {
+                    count += e - b;
+                });
+            }
+        });
+        CHECK(count == 800);
+    }
+
+    SUBCASE("Tasks")
+    {
+        struct counter : ffi::task {
+            counter() : ffi::task(&counter::run) {}
+
+            static void run(ffi::task& t)
+            {
+                ++static_cast<counter&>(t).runs;
+            }
+
+            std::atomic<int> runs{0};
+        };
+
+        counter c;
+        pool.submit(c);
+        while (c.runs == 0) {
+            std::this_thread::yield();
+        }
+        CHECK(c.runs == 1);
+        CHECK_FALSE(pool.cancel(c));
+    }
+}
+
+TEST_CASE("Parallel call_batch")
+{
+    ffi::thread_pool pool(4);
+
+    SUBCASE("Matches the sequential batch")
+    {
+        const size_t rows = 50000;
+        std::vector<double> xs(rows);
+        std::vector<int32_t> ws(rows);
+        for (size_t i = 0; i < rows; ++i) {
+            xs[i] = static_cast<double>(i) * 0.5;
+            ws[i] = static_cast<int32_t>(i % 7);
+        }
+
+        ffi::cif<double(double, int32_t)> c;
+        auto bound = c.bind(weigh);
+        std::vector<double> expected(rows), actual(rows);
+        bound.call_batch(expected, xs, ws);
+        bound.call_batch(pool, actual, xs, ws);
+        CHECK(actual == expected);
+    }
+
+    SUBCASE("void functions")
+    {
+        total = 0;
+        std::vector<int64_t> ns(20000);
+        std::iota(ns.begin(), ns.end(), int64_t{1});
+
+        ffi::cif<void(int64_t)> c;
+        c.bind(add_to_total).call_batch(pool, ns.size(), ns);
+        CHECK(total == 20000 * 20001 / 2);
+    }
+
+    SUBCASE("Short column")
+    {
+        std::vector<double> xs(10), out(10);
+        std::vector<int32_t> ws(9);
+        ffi::cif<double(double, int32_t)> c;
+        CHECK_THROWS_AS(c.bind(weigh).call_batch(pool, out, xs, ws),
+                        ffi::bad_batch_size);
+    }
+}
@@ -0,0 +1,146 @@
+// Copyright 2017 Elias Kosunen
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <doctest.h>
+#include <cppffi.h>
+#include <cppffi_signature.h>
+#include <thread>
+#include <vector>
+
+namespace {
+    struct point {
+        int32_t x;
+        int32_t y;
+    };
+    struct vec2 {
+        double x;
+        double y;
+    };
+}  // namespace
+
+static int32_t weighted(int32_t a, float b, const int32_t* c)
+{
+    return a * static_cast<int32_t>(b) + *c;
+}
+
+static point translate(const int32_t* base, vec2 offset)
+{
+    return point{*base + static_cast<int32_t>(offset.x),
+                 *base + static_cast<int32_t>(offset.y)};
+}
+
+TEST_CASE("signature strings")
+{
+    ffi::signature_table table;
+
+    SUBCASE("Scalars")
+    {
+        auto& c = table.get("i(ifp)");
+        CHECK(c.arg_count() == 3);
+        CHECK(c.return_type().type == FFI_TYPE_SINT32);
+        CHECK(c.arg_type(1).type == FFI_TYPE_FLOAT);
+        CHECK(c.arg_type(2).type == FFI_TYPE_POINTER);
+
+        const int32_t one = 1;
+        CHECK(c.bind(weighted).invoke<int32_t>(int32_t{3}, 2.0f, &one) == 7);
+    }
+
+    SUBCASE("Structs")
+    {
+        auto& c = table.get("{ii}(p{dd})");
+        CHECK(c.return_type().type == FFI_TYPE_STRUCT);
+        CHECK(c.return_type().size == sizeof(point));
+        CHECK(c.arg_type(1).size == sizeof(vec2));
+        CHECK(c.arg_type(1).alignment == alignof(vec2));
+
+        const int32_t base = 10;
+        auto p = c.bind(translate).invoke<point>(&base, vec2{1.0, 2.0});
+        CHECK(p.x == 11);
+        CHECK(p.y == 12);
+    }
+
+    SUBCASE("Interning")
+    {
+        CHECK(&table.get("v(i{ll})") == &table.get("v(i{ll})"));
+        CHECK(&table.get("v(i{ll})") != &table.get("v(l{ll})"));
+        CHECK(&table.get("v(i{ll})").arg_type(1) ==
+              &table.get("v(l{ll})").arg_type(1));
+        CHECK(&table.get_type("{ll}") == &table.get("v(l{ll})").arg_type(1));
+        CHECK(table.size() == 2);
+    }
+
+    SUBCASE("Nested structs")
+    {
+        auto& t = table.get_type("{c{dc}i}");
+        CHECK(t.size == 32);
+        CHECK(t.alignment == 8);
+    }
+
+    SUBCASE("Concurrent lookups")
+    {
+        std::vector<const ffi::dynamic_cif*> seen(8, nullptr);
+        std::vector<std::thread> threads;
+        for (size_t i = 0; i < seen.size(); ++i) {
+            threads.emplace_back(
+                [&seen, i] { seen[i] = &ffi::signature("d(dd{pi})"); });
+        }
+        for (auto& t : threads) {
+            t.join();
+        }
+        for (auto p : seen) {
+            CHECK(p == seen[0]);
+        }
+    }
+
+    SUBCASE("Concurrent first use")
+    {
+        // Threads race to prepare distinct strings that share struct types
+        const char* sigs[] = {"v({dp})", "i({dp}{dp})", "{dp}(i)", "l(l)"};
+        std::vector<const ffi::dynamic_cif*> seen(16, nullptr);
+        std::vector<std::thread> threads;
+        for (size_t i = 0; i < seen.size(); ++i) {
+            threads.emplace_back([&table, &seen, &sigs, i] {
+                seen[i] = &table.get(sigs[i % 4]);
+            });
+        }
+        for (auto& t : threads) {
+            t.join();
+        }
+        for (size_t i = 4; i < seen.size(); ++i) {
+            CHECK(seen[i] == seen[i % 4]);
+        }
+        CHECK(&seen[0]->arg_type(0) == &seen[1]->arg_type(1));
+        CHECK(&seen[2]->return_type() == &table.get_type("{dp}"));
+        CHECK(table.size() == 4);
+    }
+
+    SUBCASE("Malformed")
+    {
+        CHECK_THROWS_AS(table.get(""), ffi::bad_signature);
+        CHECK_THROWS_AS(table.get("i"), ffi::bad_signature);
+        CHECK_THROWS_AS(table.get("i(i"), ffi::bad_signature);
+        CHECK_THROWS_AS(table.get("i(i)x"), ffi::bad_signature);
+        CHECK_THROWS_AS(table.get("i(v)"), ffi::bad_signature);
+        CHECK_THROWS_AS(table.get("i(q)"), ffi::bad_signature);
+        CHECK_THROWS_AS(table.get("{}(i)"), ffi::bad_signature);
+        CHECK_THROWS_AS(table.get("{ii(i)"), ffi::bad_signature);
+        CHECK(table.size() == 0);
+    }
+}
@@ -21,7 +21,10 @@
 #define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
 #include <doctest.h>
 #include <cppffi.h>
+#include <complex>
+#include <thread>
 #include <type_traits>
+#include <vector>
 
 static int func(bool reset = false)
 {
@@ -65,3 +68,620 @@ TEST_CASE("ffi::call")
         CHECK(ffi::call(factorial, 10) == 3628800);
     }
 }
+
+static int scale(double x, int factor)
+{
+    return static_cast<int>(x * factor);
+}
+
+TEST_CASE("cif cache")
+{
+#ifndef CPPFFI_NO_CIF_CACHE
+    SUBCASE("Copies outlive the original")
+    {
+        auto original = new ffi::cif<int(int)>;
+        ffi::cif<int(int)> copy(*original);
+        delete original;
+        CHECK(copy.bind(factorial)(4) == 24);
+    }
+
+    SUBCASE("Concurrent first use")
+    {
+        using entry = ffi::cif<int(double, int)>;
+        std::vector<const entry*> seen(8, nullptr);
+        std::vector<std::thread> threads;
+        for (size_t i = 0; i < seen.size(); ++i) {
+            threads.emplace_back([&seen, i] {
+                seen[i] = &ffi::detail::cif_cache<entry>::get(FFI_DEFAULT_ABI);
+            });
+        }
+        for (auto& t : threads) {
+            t.join();
+        }
+        for (auto p : seen) {
+            CHECK(p == seen[0]);
+        }
+    }
+#endif
+
+    SUBCASE("shared_cif")
+    {
+        auto& shared = ffi::shared_cif<int(int)>();
+        CHECK(&shared == &ffi::shared_cif<int(int)>());
+        CHECK_THROWS_AS(ffi::shared_cif<int(int)>(FFI_LAST_ABI), ffi::bad_abi);
+
+        std::vector<int> results(8, 0);
+        std::vector<std::thread> threads;
+        for (size_t i = 0; i < results.size(); ++i) {
+            threads.emplace_back([&results, i] {
+                auto f = ffi::shared_cif<int(int)>().bind(factorial);
+                results[i] = f(static_cast<int>(i));
+            });
+        }
+        for (auto& t : threads) {
+            t.join();
+        }
+        CHECK(results[5] == 120);
+    }
+
+    SUBCASE("Repeated ffi::call")
+    {
+        for (int i = 0; i < 4; ++i) {
+            CHECK(ffi::call(scale, 1.5, 2) == 3);
+        }
+    }
+
+    SUBCASE("Bad ABI")
+    {
+        CHECK_THROWS_AS(ffi::cif<int(int)>{FFI_LAST_ABI}, ffi::bad_abi);
+    }
+}
+
+struct pair {
+    int32_t a;
+    double b;
+
+    static ffi_type& create_ffitype()
+    {
+        return ffi::struct_type_specialize<pair, int32_t,
+                                           double>::create_ffitype();
+    }
+};
+
+static double half(float x)
+{
+    return static_cast<double>(x) / 2.0;
+}
+
+static const char* skip(const char* str, int n)
+{
+    return str + n;
+}
+
+static double sum_pair(pair p)
+{
+    return p.a + p.b;
+}
+
+static void clear(int* p)
+{
+    *p = 0;
+}
+
+struct measured {
+    explicit measured(double p_value) : value(p_value) {}
+
+    double value;
+
+    static ffi_type& create_ffitype()
+    {
+        return ffi::struct_type_specialize<measured,
+                                           double>::create_ffitype();
+    }
+};
+
+static double twice(measured m)
+{
+    return m.value * 2.0;
+}
+
+TEST_CASE("Argument and return types")
+{
+    SUBCASE("Floating point return")
+    {
+        CHECK(ffi::call(half, 3.0f) == doctest::Approx(1.5));
+    }
+
+    SUBCASE("Pointer return")
+    {
+        const char* str = "hello";
+        CHECK(ffi::call(skip, str, 2) == str + 2);
+    }
+
+    SUBCASE("Struct argument")
+    {
+        CHECK(ffi::call(sum_pair, pair{1, 0.5}) == doctest::Approx(1.5));
+    }
+
+    SUBCASE("void return")
+    {
+        int value = 1;
+        ffi::call(clear, &value);
+        CHECK(value == 0);
+
+        value = 2;
+        ffi::cif<void(int*)> c;
+        c.bind(clear)(&value);
+        CHECK(value == 0);
+    }
+
+    SUBCASE("Lvalue arguments")
+    {
+        float x = 5.0f;
+        pair p{2, 0.25};
+        CHECK(ffi::call(half, x) == doctest::Approx(2.5));
+        CHECK(ffi::call(sum_pair, p) == doctest::Approx(2.25));
+        CHECK(p.a == 2);
+    }
+
+    SUBCASE("Converting arguments")
+    {
+        short n = 3;
+        CHECK(ffi::call(factorial, n) == 6);
+        CHECK(ffi::call(half, 1.0f) == doctest::Approx(0.5));
+    }
+
+    SUBCASE("Argument without default constructor")
+    {
+        const measured m{1.25};
+        CHECK(ffi::call(twice, m) == doctest::Approx(2.5));
+        CHECK(ffi::call(twice, measured{3.0}) == doctest::Approx(6.0));
+    }
+}
+
+static int64_t counted = 0;
+
+static void count(int64_t n)
+{
+    counted += n;
+}
+
+static int64_t ticks()
+{
+    return ++counted;
+}
+
+TEST_CASE("callable::call_batch")
+{
+    ffi::cif<int(double, int)> c;
+    auto bound = c.bind(scale);
+
+    SUBCASE("Columns")
+    {
+        const std::vector<double> xs{0.5, 1.5, 2.5, 3.5};
+        const std::vector<int> factors{2, 4, 6, 8};
+        std::vector<int> out(xs.size());
+
+        bound.call_batch(out, xs, factors);
+        CHECK(out[0] == 1);
+        CHECK(out[1] == 6);
+        CHECK(out[2] == 15);
+        CHECK(out[3] == 28);
+    }
+
+    SUBCASE("Rows are bounded by the output")
+    {
+        const double xs[] = {1.0, 2.0, 3.0};
+        const int factors[] = {3, 3, 3};
+        int out[2] = {0, 0};
+
+        bound.call_batch(out, xs, factors);
+        CHECK(out[0] == 3);
+        CHECK(out[1] == 6);
+    }
+
+    SUBCASE("Short column")
+    {
+        const std::vector<double> xs{1.0, 2.0};
+        const std::vector<int> factors{1};
+        std::vector<int> out(2);
+        CHECK_THROWS_AS(bound.call_batch(out, xs, factors),
+                        ffi::bad_batch_size);
+    }
+
+    SUBCASE("Structs and floating point returns")
+    {
+        ffi::cif<double(pair)> pc;
+        const std::vector<pair> pairs{{1, 0.5}, {2, 0.25}};
+        std::vector<double> out(2);
+
+        pc.bind(sum_pair).call_batch(out, pairs);
+        CHECK(out[0] == doctest::Approx(1.5));
+        CHECK(out[1] == doctest::Approx(2.25));
+    }
+
+    SUBCASE("void and nullary functions")
+    {
+        counted = 0;
+        const std::vector<int64_t> ns{1, 2, 3};
+        ffi::cif<void(int64_t)> vc;
+        vc.bind(count).call_batch(ns.size(), ns);
+        CHECK(counted == 6);
+
+        std::array<int64_t, 2> out{};
+        ffi::cif<int64_t()> nc;
+        nc.bind(ticks).call_batch(out);
+        CHECK(out[0] == 7);
+        CHECK(out[1] == 8);
+    }
+}
+
+TEST_CASE("callable::direct")
+{
+    ffi::cif<int(int)> c;
+    auto bound = c.bind(factorial);
+    CHECK(bound.direct(5) == 120);
+    CHECK(bound.direct(5) == bound.call(5).ret());
+
+    counted = 0;
+    ffi::cif<int64_t()> nc;
+    auto counter = nc.bind(ticks);
+    CHECK(counter.direct() == 1);
+    CHECK(counter() == 2);
+}
+
+struct rgb {
+    uint8_t r, g, b;
+};
+
+struct pixel {
+    int16_t x;
+    rgb color;
+    double alpha;
+
+    static ffi_type& create_ffitype();
+};
+
+namespace ffi {
+    template <>
+    struct type<rgb> {
+        using arg_type = ffi_arg;
+
+        static ffi_type& ffitype()
+        {
+            return struct_type<rgb, CPPFFI_FIELD(rgb, r), CPPFFI_FIELD(rgb, g),
+                               CPPFFI_FIELD(rgb, b)>::create_ffitype();
+        }
+    };
+}  // namespace ffi
+
+ffi_type& pixel::create_ffitype()
+{
+    return ffi::struct_type<pixel, CPPFFI_FIELD(pixel, x),
+                            CPPFFI_FIELD(pixel, color),
+                            CPPFFI_FIELD(pixel, alpha)>::create_ffitype();
+}
+
+static double brightness(pixel p)
+{
+    return (p.color.r + p.color.g + p.color.b) * p.alpha + p.x;
+}
+
+TEST_CASE("struct_type")
+{
+    using layout = ffi::struct_type<pixel, CPPFFI_FIELD(pixel, x),
+                                    CPPFFI_FIELD(pixel, color),
+                                    CPPFFI_FIELD(pixel, alpha)>;
+    static_assert(layout::size == sizeof(pixel), "size");
+    static_assert(layout::alignment == alignof(pixel), "alignment");
+
+    SUBCASE("Layout is filled in before any cif is prepared")
+    {
+        auto& t = pixel::create_ffitype();
+        CHECK(t.type == FFI_TYPE_STRUCT);
+        CHECK(t.size == sizeof(pixel));
+        CHECK(t.alignment == alignof(pixel));
+        CHECK(t.elements[1]->size == sizeof(rgb));
+        CHECK(t.elements[3] == nullptr);
+        CHECK(&t == &pixel::create_ffitype());
+    }
+
+    SUBCASE("Nested struct argument")
+    {
+        pixel p{-3, {10, 20, 30}, 0.5};
+        CHECK(ffi::call(brightness, p) == doctest::Approx(27.0));
+    }
+
+    SUBCASE("struct_type_specialize computes the layout too")
+    {
+        auto& t = pair::create_ffitype();
+        CHECK(t.size == sizeof(pair));
+        CHECK(t.alignment == alignof(pair));
+    }
+
+    SUBCASE("Members that aren't laid out are rejected")
+    {
+        // A hand-written type, left for ffi_prep_cif to fill in
+        ffi_type* inner_elements[] = {&ffi_type_sint32, nullptr};
+        ffi_type inner = {0, 0, FFI_TYPE_STRUCT, inner_elements};
+        ffi_type* outer_elements[] = {&ffi_type_double, &inner, nullptr};
+        ffi_type outer = {0, 0, FFI_TYPE_STRUCT, outer_elements};
+        CHECK_THROWS_AS(ffi::detail::layout_struct(outer), ffi::bad_typedef);
+    }
+}
+
+struct triple {
+    double a, b, c;
+
+    static ffi_type& create_ffitype()
+    {
+        return ffi::struct_type<triple, CPPFFI_FIELD(triple, a),
+                                CPPFFI_FIELD(triple, b),
+                                CPPFFI_FIELD(triple, c)>::create_ffitype();
+    }
+};
+
+static triple make_triple(double base)
+{
+    return {base, base * 2, base * 3};
+}
+
+static pair make_pair(int32_t a, double b)
+{
+    return {a, b};
+}
+
+static rgb gray(uint8_t v)
+{
+    return {v, v, v};
+}
+
+TEST_CASE("Struct returns")
+{
+    SUBCASE("Returned in memory")
+    {
+        const auto t = ffi::call(make_triple, 1.5);
+        CHECK(t.a == doctest::Approx(1.5));
+        CHECK(t.b == doctest::Approx(3.0));
+        CHECK(t.c == doctest::Approx(4.5));
+    }
+
+    SUBCASE("Returned in registers")
+    {
+        const auto p = ffi::call(make_pair, 7, 0.25);
+        CHECK(p.a == 7);
+        CHECK(p.b == doctest::Approx(0.25));
+
+        const auto g = ffi::call(gray, uint8_t{9});
+        CHECK(g.r == 9);
+        CHECK(g.g == 9);
+        CHECK(g.b == 9);
+    }
+
+    SUBCASE("call_batch")
+    {
+        const std::vector<uint8_t> levels{1, 2, 3};
+        std::vector<rgb> out(levels.size());
+        ffi::cif<rgb(uint8_t)> c;
+        c.bind(gray).call_batch(out, levels);
+        CHECK(out[2].g == 3);
+
+        const std::vector<double> bases{1.0, 2.0};
+        std::vector<triple> triples(bases.size());
+        ffi::cif<triple(double)> tc;
+        tc.bind(make_triple).call_batch(triples, bases);
+        CHECK(triples[1].c == doctest::Approx(6.0));
+    }
+
+    SUBCASE("call_into")
+    {
+        ffi::cif<triple(double)> c;
+        triple t{0, 0, 0};
+        c.bind(make_triple).call_into(t, 2.0);
+        CHECK(t.c == doctest::Approx(6.0));
+
+        ffi::cif<rgb(uint8_t)> gc;
+        rgb g{0, 0, 0};
+        gc.bind(gray).call_into(g, uint8_t{200});
+        CHECK(g.b == 200);
+
+        ffi::cif<int(int)> fc;
+        int n = 0;
+        fc.bind(factorial).call_into(n, 4);
+        CHECK(n == 24);
+
+        counted = 0;
+        ffi::cif<int64_t()> tc;
+        int64_t ticked = 0;
+        tc.bind(ticks).call_into(ticked);
+        CHECK(ticked == 1);
+    }
+}
+
+static int widen(int8_t a, int16_t b, uint8_t c)
+{
+    return a + b + c;
+}
+
+TEST_CASE("callable::call_raw")
+{
+    SUBCASE("Scalars")
+    {
+        ffi::cif<int(double, int)> c;
+        auto bound = c.bind(scale);
+        CHECK(bound.call_raw(2.5, 4) == 10);
+        CHECK(bound.call_raw(2.5, 4) == bound(2.5, 4));
+
+        ffi::cif<int(int8_t, int16_t, uint8_t)> wc;
+        CHECK(wc.bind(widen).call_raw(int8_t{-5}, int16_t{-300},
+                                      uint8_t{250}) == -55);
+
+        ffi::cif<double(float)> hc;
+        CHECK(hc.bind(half).call_raw(3.0f) == doctest::Approx(1.5));
+
+        const char* str = "hello";
+        ffi::cif<const char*(const char*, int)> sc;
+        CHECK(sc.bind(skip).call_raw(str, 3) == str + 3);
+    }
+
+    SUBCASE("Structs")
+    {
+        ffi::cif<double(pair)> pc;
+        CHECK(pc.bind(sum_pair).call_raw(pair{3, 0.5}) ==
+              doctest::Approx(3.5));
+
+        ffi::cif<triple(double)> tc;
+        CHECK(tc.bind(make_triple).call_raw(1.0).c == doctest::Approx(3.0));
+
+        ffi::cif<pair(int32_t, double)> mc;
+        const auto p = mc.bind(make_pair).call_raw(4, 0.75);
+        CHECK(p.a == 4);
+        CHECK(p.b == doctest::Approx(0.75));
+    }
+
+    SUBCASE("void and nullary functions")
+    {
+        int value = 1;
+        ffi::cif<void(int*)> c;
+        c.bind(clear).call_raw(&value);
+        CHECK(value == 0);
+
+        counted = 0;
+        ffi::cif<int64_t()> nc;
+        CHECK(nc.bind(ticks).call_raw() == 1);
+    }
+}
+
+static int64_t sum(const int32_t* values, size_t count)
+{
+    int64_t total = 0;
+    for (size_t i = 0; i < count; ++i) {
+        total += values[i];
+    }
+    return total;
+}
+
+static void scale_all(double factor, double* values, size_t count)
+{
+    for (size_t i = 0; i < count; ++i) {
+        values[i] *= factor;
+    }
+}
+
+TEST_CASE("span parameters")
+{
+    ffi::cif<int64_t(ffi::span<const int32_t>)> c;
+    CHECK(c.native().nargs == 2);
+    CHECK(c.native().arg_types[0] == &ffi_type_pointer);
+    CHECK(c.native().arg_types[1]->size == sizeof(size_t));
+    static_assert(
+        std::is_same<decltype(c.bind(sum))::native_type,
+                     int64_t(const int32_t*, size_t)>::value,
+        "span expands to a pointer and a length");
+
+    auto bound = c.bind(sum);
+
+    SUBCASE("Containers")
+    {
+        const std::vector<int32_t> vec{1, 2, 3, 4};
+        std::array<int32_t, 3> arr{{10, 20, 30}};
+        int32_t raw[] = {-1, -2};
+        CHECK(bound(vec) == 10);
+        CHECK(bound(arr) == 60);
+        CHECK(bound(raw) == -3);
+        CHECK(bound(ffi::span<const int32_t>(vec.data() + 1, 2)) == 5);
+        CHECK(bound(std::vector<int32_t>{}) == 0);
+    }
+
+    SUBCASE("No copies")
+    {
+        std::vector<double> values{1.0, 2.0, 3.0};
+        ffi::cif<void(double, ffi::span<double>)> sc;
+        sc.bind(scale_all)(2.0, values);
+        CHECK(values[2] == doctest::Approx(6.0));
+    }
+
+    SUBCASE("Other call paths")
+    {
+        const std::vector<int32_t> vec{5, 6, 7};
+        CHECK(bound.direct(vec) == 18);
+        CHECK(bound.call_raw(vec) == 18);
+
+        int64_t out = 0;
+        bound.call_into(out, vec);
+        CHECK(out == 18);
+
+        const ffi::span<const int32_t> rows[] = {
+            {vec.data(), 1}, {vec.data(), 2}, {vec.data(), 3}};
+        std::vector<int64_t> totals(3);
+        bound.call_batch(totals, rows);
+        CHECK(totals == std::vector<int64_t>{5, 11, 18});
+    }
+}
+
+static std::complex<double> cmul(std::complex<double> a,
+                                 std::complex<double> b)
+{
+    return a * b;
+}
+
+static std::complex<float> cconj(std::complex<float> a)
+{
+    return std::conj(a);
+}
+
+#if CPPFFI_SHORT_VECTORS
+typedef float float2 __attribute__((vector_size(8)));
+typedef int16_t short4 __attribute__((vector_size(8)));
+
+static float2 madd(float2 a, float2 b, float k)
+{
+    return a + b * k;
+}
+
+static int32_t hsum(short4 v, int32_t bias)
+{
+    return v[0] + v[1] + v[2] + v[3] + bias;
+}
+#endif
+
+TEST_CASE("Complex and vector types")
+{
+#if CPPFFI_COMPLEX
+    SUBCASE("std::complex")
+    {
+        using cd = std::complex<double>;
+        ffi::cif<cd(cd, cd)> c;
+        CHECK(c.native().rtype->type == FFI_TYPE_COMPLEX);
+        CHECK(ffi::describe(c.native()) ==
+              "complex<double>(complex<double>, complex<double>)");
+
+        const auto product = c.bind(cmul)(cd{1, 2}, cd{3, -1});
+        CHECK(product.real() == doctest::Approx(5));
+        CHECK(product.imag() == doctest::Approx(5));
+
+        ffi::cif<std::complex<float>(std::complex<float>)> fc;
+        const auto conj = fc.bind(cconj)(std::complex<float>{1.5f, 2.5f});
+        CHECK(conj.imag() == doctest::Approx(-2.5f));
+        CHECK(fc.bind(cconj).call_raw(std::complex<float>{0, 1}).imag() ==
+              doctest::Approx(-1.0f));
+    }
+#endif
+
+#if CPPFFI_SHORT_VECTORS
+    SUBCASE("8-byte vectors")
+    {
+        ffi::cif<float2(float2, float2, float)> c;
+        const float2 a = {1.0f, 2.0f};
+        const float2 b = {0.5f, -1.0f};
+        const auto r = c.bind(madd)(a, b, 2.0f);
+        CHECK(r[0] == doctest::Approx(2.0f));
+        CHECK(r[1] == doctest::Approx(0.0f));
+
+        ffi::cif<int32_t(short4, int32_t)> hc;
+        const short4 v = {1, -2, 300, 4};
+        CHECK(hc.bind(hsum)(v, 10) == 313);
+        CHECK(hc.bind(hsum).call_raw(v, 10) == 313);
+    }
+#endif
+}
@@ -0,0 +1,61 @@
+// Copyright 2017 Elias Kosunen
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+// Small shared library loaded by the shared_library tests
+
+#include <cstddef>
+#include <cstdint>
+
+#if defined(_WIN32)
+#define TESTLIB_EXPORT extern "C" __declspec(dllexport)
+#else
+#define TESTLIB_EXPORT extern "C" __attribute__((visibility("default")))
+#endif
+
+TESTLIB_EXPORT int32_t testlib_add(int32_t a, int32_t b);
+TESTLIB_EXPORT double testlib_scale(double x, int32_t factor);
+TESTLIB_EXPORT int32_t testlib_next();
+TESTLIB_EXPORT int64_t testlib_sum(const int32_t* values, size_t n);
+
+TESTLIB_EXPORT int32_t testlib_add(int32_t a, int32_t b)
+{
+    return a + b;
+}
+
+TESTLIB_EXPORT double testlib_scale(double x, int32_t factor)
+{
+    return x * factor;
+}
+
+static int32_t counter = 0;
+
+TESTLIB_EXPORT int32_t testlib_next()
+{
+    return ++counter;
+}
+
+TESTLIB_EXPORT int64_t testlib_sum(const int32_t* values, size_t n)
+{
+    int64_t total = 0;
+    for (size_t i = 0; i < n; ++i) {
+        total += values[i];
+    }
+    return total;
+}
@@ -0,0 +1,88 @@
+// Copyright 2017 Elias Kosunen
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <doctest.h>
+#include <cppffi.h>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+
+static double sum_var(int32_t count, ...)
+{
+    va_list list;
+    va_start(list, count);
+    double sum = 0;
+    for (int32_t i = 0; i < count; ++i) {
+        sum += va_arg(list, double);
+    }
+    va_end(list);
+    return sum;
+}
+
+static int64_t sum_ints(int32_t count, ...)
+{
+    va_list list;
+    va_start(list, count);
+    int64_t sum = 0;
+    for (int32_t i = 0; i < count; ++i) {
+        sum += va_arg(list, int);
+    }
+    va_end(list);
+    return sum;
+}
+
+TEST_CASE("cif_var")
+{
+    SUBCASE("snprintf")
+    {
+        char buf[64];
+        ffi::cif_var<int(char*, size_t, const char*)> c;
+        const auto n = c.call(snprintf, buf, sizeof(buf), "%d-%s-%.1f", 42,
+                              "abc", 2.5);
+        CHECK(n == 10);
+        CHECK(std::strcmp(buf, "42-abc-2.5") == 0);
+    }
+
+    SUBCASE("Default promotions")
+    {
+        CHECK(ffi::call_var(sum_var, 3, 1.5f, 2.5, 3.0f) ==
+              doctest::Approx(7.0));
+
+        const char c = 2;
+        const short s = 3;
+        CHECK(ffi::call_var(sum_ints, 4, c, s, true, 'A') == 71);
+    }
+
+    SUBCASE("No variadic arguments")
+    {
+        CHECK(ffi::call_var(sum_var, 0) == doctest::Approx(0.0));
+    }
+
+    SUBCASE("One cached interface per shape")
+    {
+        ffi::cif_var<double(int32_t)> c;
+        ffi::cif_var<double(int32_t)> other;
+        CHECK(&c.native<double>() == &other.native<double>());
+        CHECK(&c.native<float>() == &c.native<double>());
+        CHECK(&c.native<char>() == &c.native<int>());
+        CHECK(&c.native<int>() != &c.native<double>());
+        CHECK(c.native<double, double>().nargs == 3);
+    }
+}